@@ -21,24 +21,425 @@
 
 #include "schema11.hpp"
 #include <cassert>
+#include <cerrno>
+#include <cfloat>
 #include <cmath>
+#include <cstddef>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <condition_variable>
+#include <exception>
+#include <istream>
 #include <limits>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include "third_party/json11/json11.hpp"
 
+#if defined(__AVX2__) || (defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)))
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 namespace schema11 {
 
 static const int max_depth = 200;
 
 using std::string;
 using std::vector;
-using std::map;
 using std::make_shared;
 using std::initializer_list;
 using std::move;
 using json11::Json;
 
+/* * * * * * * * * * * * * * * * * * * *
+ * Number formatting
+ *
+ * Doubles and floats are written with Grisu2 (Florian Loitsch, "Printing Floating-Point
+ * Numbers Quickly and Accurately with Integers", PLDI 2010), following the formulation in
+ * nlohmann/json. It produces the shortest digit string that reads back to the same value
+ * in all but a tiny fraction of cases, and never more digits than %.17g, without going
+ * through the locale-dependent printf machinery.
+ */
+
+struct diyfp {
+    uint64_t f;
+    int e;
+};
+
+static diyfp diyfp_sub(diyfp x, diyfp y) {
+    assert(x.e == y.e && x.f >= y.f);
+    return diyfp { x.f - y.f, x.e };
+}
+
+// Return the upper 64 bits of the 128-bit product, rounded.
+static diyfp diyfp_mul(diyfp x, diyfp y) {
+    const uint64_t u_lo = x.f & 0xFFFFFFFFu;
+    const uint64_t u_hi = x.f >> 32;
+    const uint64_t v_lo = y.f & 0xFFFFFFFFu;
+    const uint64_t v_hi = y.f >> 32;
+
+    const uint64_t p0 = u_lo * v_lo;
+    const uint64_t p1 = u_lo * v_hi;
+    const uint64_t p2 = u_hi * v_lo;
+    const uint64_t p3 = u_hi * v_hi;
+
+    uint64_t q = (p0 >> 32) + (p1 & 0xFFFFFFFFu) + (p2 & 0xFFFFFFFFu);
+    q += uint64_t(1) << 31;
+    return diyfp { p3 + (p1 >> 32) + (p2 >> 32) + (q >> 32), x.e + y.e + 64 };
+}
+
+static diyfp diyfp_normalize(diyfp x) {
+    while ((x.f >> 63) == 0) {
+        x.f <<= 1;
+        x.e--;
+    }
+    return x;
+}
+
+/* compute_boundaries(value, minus, plus)
+ *
+ * Return the normalized value, and set minus and plus to the boundaries halfway to its
+ * neighbouring floating-point values, using the same exponent as plus. Any decimal number
+ * strictly between the boundaries reads back as value.
+ */
+template <class FloatType>
+static diyfp compute_boundaries(FloatType value, diyfp &minus, diyfp &plus) {
+    typedef typename std::conditional<sizeof(FloatType) == 4, uint32_t, uint64_t>::type bits_type;
+    const int precision = std::numeric_limits<FloatType>::digits;
+    const int bias = std::numeric_limits<FloatType>::max_exponent - 1 + (precision - 1);
+    const int min_exponent = 1 - bias;
+    const uint64_t hidden_bit = uint64_t(1) << (precision - 1);
+
+    bits_type bits;
+    std::memcpy(&bits, &value, sizeof bits);
+    const uint64_t biased_exponent = static_cast<uint64_t>(bits) >> (precision - 1);
+    const uint64_t fraction = static_cast<uint64_t>(bits) & (hidden_bit - 1);
+
+    const diyfp v = biased_exponent == 0
+        ? diyfp { fraction, min_exponent }
+        : diyfp { fraction + hidden_bit, static_cast<int>(biased_exponent) - bias };
+
+    // The lower neighbour is closer when value is a power of two (except the smallest
+    // normal one).
+    const bool lower_is_closer = fraction == 0 && biased_exponent > 1;
+    plus = diyfp_normalize(diyfp { 2 * v.f + 1, v.e - 1 });
+    minus = lower_is_closer ? diyfp { 4 * v.f - 1, v.e - 2 } : diyfp { 2 * v.f - 1, v.e - 1 };
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+    return diyfp_normalize(v);
+}
+
+// The binary exponent range the scaled value is brought into, so that its integral part
+// fits in 32 bits.
+static const int grisu_alpha = -60;
+static const int grisu_gamma = -32;
+
+struct cached_power {
+    uint64_t f;
+    int e;
+    int k;
+};
+
+/* cached_power_for(e)
+ *
+ * Return a normalized power of ten c = 10^-k such that a diyfp with exponent e multiplied
+ * by c has an exponent in [grisu_alpha, grisu_gamma].
+ */
+static cached_power cached_power_for(int e) {
+    // Exact, rounded normalized powers of ten 10^k for k = -300, -292, ..., 324.
+    static const cached_power powers[] = {
+        { 0xAB70FE17C79AC6CA, -1060, -300 },
+        { 0xFF77B1FCBEBCDC4F, -1034, -292 },
+        { 0xBE5691EF416BD60C, -1007, -284 },
+        { 0x8DD01FAD907FFC3C,  -980, -276 },
+        { 0xD3515C2831559A83,  -954, -268 },
+        { 0x9D71AC8FADA6C9B5,  -927, -260 },
+        { 0xEA9C227723EE8BCB,  -901, -252 },
+        { 0xAECC49914078536D,  -874, -244 },
+        { 0x823C12795DB6CE57,  -847, -236 },
+        { 0xC21094364DFB5637,  -821, -228 },
+        { 0x9096EA6F3848984F,  -794, -220 },
+        { 0xD77485CB25823AC7,  -768, -212 },
+        { 0xA086CFCD97BF97F4,  -741, -204 },
+        { 0xEF340A98172AACE5,  -715, -196 },
+        { 0xB23867FB2A35B28E,  -688, -188 },
+        { 0x84C8D4DFD2C63F3B,  -661, -180 },
+        { 0xC5DD44271AD3CDBA,  -635, -172 },
+        { 0x936B9FCEBB25C996,  -608, -164 },
+        { 0xDBAC6C247D62A584,  -582, -156 },
+        { 0xA3AB66580D5FDAF6,  -555, -148 },
+        { 0xF3E2F893DEC3F126,  -529, -140 },
+        { 0xB5B5ADA8AAFF80B8,  -502, -132 },
+        { 0x87625F056C7C4A8B,  -475, -124 },
+        { 0xC9BCFF6034C13053,  -449, -116 },
+        { 0x964E858C91BA2655,  -422, -108 },
+        { 0xDFF9772470297EBD,  -396, -100 },
+        { 0xA6DFBD9FB8E5B88F,  -369,  -92 },
+        { 0xF8A95FCF88747D94,  -343,  -84 },
+        { 0xB94470938FA89BCF,  -316,  -76 },
+        { 0x8A08F0F8BF0F156B,  -289,  -68 },
+        { 0xCDB02555653131B6,  -263,  -60 },
+        { 0x993FE2C6D07B7FAC,  -236,  -52 },
+        { 0xE45C10C42A2B3B06,  -210,  -44 },
+        { 0xAA242499697392D3,  -183,  -36 },
+        { 0xFD87B5F28300CA0E,  -157,  -28 },
+        { 0xBCE5086492111AEB,  -130,  -20 },
+        { 0x8CBCCC096F5088CC,  -103,  -12 },
+        { 0xD1B71758E219652C,   -77,   -4 },
+        { 0x9C40000000000000,   -50,    4 },
+        { 0xE8D4A51000000000,   -24,   12 },
+        { 0xAD78EBC5AC620000,     3,   20 },
+        { 0x813F3978F8940984,    30,   28 },
+        { 0xC097CE7BC90715B3,    56,   36 },
+        { 0x8F7E32CE7BEA5C70,    83,   44 },
+        { 0xD5D238A4ABE98068,   109,   52 },
+        { 0x9F4F2726179A2245,   136,   60 },
+        { 0xED63A231D4C4FB27,   162,   68 },
+        { 0xB0DE65388CC8ADA8,   189,   76 },
+        { 0x83C7088E1AAB65DB,   216,   84 },
+        { 0xC45D1DF942711D9A,   242,   92 },
+        { 0x924D692CA61BE758,   269,  100 },
+        { 0xDA01EE641A708DEA,   295,  108 },
+        { 0xA26DA3999AEF774A,   322,  116 },
+        { 0xF209787BB47D6B85,   348,  124 },
+        { 0xB454E4A179DD1877,   375,  132 },
+        { 0x865B86925B9BC5C2,   402,  140 },
+        { 0xC83553C5C8965D3D,   428,  148 },
+        { 0x952AB45CFA97A0B3,   455,  156 },
+        { 0xDE469FBD99A05FE3,   481,  164 },
+        { 0xA59BC234DB398C25,   508,  172 },
+        { 0xF6C69A72A3989F5C,   534,  180 },
+        { 0xB7DCBF5354E9BECE,   561,  188 },
+        { 0x88FCF317F22241E2,   588,  196 },
+        { 0xCC20CE9BD35C78A5,   614,  204 },
+        { 0x98165AF37B2153DF,   641,  212 },
+        { 0xE2A0B5DC971F303A,   667,  220 },
+        { 0xA8D9D1535CE3B396,   694,  228 },
+        { 0xFB9B7CD9A4A7443C,   720,  236 },
+        { 0xBB764C4CA7A44410,   747,  244 },
+        { 0x8BAB8EEFB6409C1A,   774,  252 },
+        { 0xD01FEF10A657842C,   800,  260 },
+        { 0x9B10A4E5E9913129,   827,  268 },
+        { 0xE7109BFBA19C0C9D,   853,  276 },
+        { 0xAC2820D9623BF429,   880,  284 },
+        { 0x80444B5E7AA7CF85,   907,  292 },
+        { 0xBF21E44003ACDD2D,   933,  300 },
+        { 0x8E679C2F5E44FF8F,   960,  308 },
+        { 0xD433179D9C8CB841,   986,  316 },
+        { 0x9E19DB92B4E31BA9,  1013,  324 },
+    };
+    const int min_decimal_exponent = -300;
+    const int decimal_step = 8;
+
+    // k = ceil((alpha - e - 1) * log10(2)), using 78913 / 2^18 as an approximation of log10(2)
+    const int f = grisu_alpha - e - 1;
+    const int k = (f * 78913) / (1 << 18) + static_cast<int>(f > 0);
+    const int index = (-min_decimal_exponent + k + (decimal_step - 1)) / decimal_step;
+    assert(index >= 0 && index < static_cast<int>(sizeof powers / sizeof powers[0]));
+
+    const cached_power cached = powers[index];
+    assert(grisu_alpha <= cached.e + e + 64 && cached.e + e + 64 <= grisu_gamma);
+    return cached;
+}
+
+// Return the number of decimal digits in n, and set pow10 to 10^(digits - 1).
+static int largest_pow10(uint32_t n, uint32_t &pow10) {
+    static const uint32_t powers[] = {
+        1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+    };
+    int digits = 10;
+    while (digits > 1 && n < powers[digits - 1])
+        digits--;
+    pow10 = powers[digits - 1];
+    return digits;
+}
+
+/* grisu2_round(buffer, length, dist, delta, rest, ten_k)
+ *
+ * Move the last digit down towards w while the result stays within the boundaries and gets
+ * closer to w.
+ */
+static void grisu2_round(char *buffer, int length, uint64_t dist, uint64_t delta,
+                         uint64_t rest, uint64_t ten_k) {
+    while (rest < dist && delta - rest >= ten_k
+           && (rest + ten_k < dist || dist - rest > rest + ten_k - dist)) {
+        buffer[length - 1]--;
+        rest += ten_k;
+    }
+}
+
+/* grisu2_digits(buffer, length, decimal_exponent, minus, w, plus)
+ *
+ * Generate the shortest digit string in [minus, plus], closest to w, all scaled into
+ * [grisu_alpha, grisu_gamma]. On return the value is buffer * 10^decimal_exponent.
+ */
+static void grisu2_digits(char *buffer, int &length, int &decimal_exponent,
+                          diyfp minus, diyfp w, diyfp plus) {
+    uint64_t delta = diyfp_sub(plus, minus).f;
+    uint64_t dist = diyfp_sub(plus, w).f;
+
+    // Split plus into an integral part p1 and a fractional part p2.
+    const int shift = -plus.e;
+    const uint64_t one = uint64_t(1) << shift;
+    uint32_t p1 = static_cast<uint32_t>(plus.f >> shift);
+    uint64_t p2 = plus.f & (one - 1);
+
+    uint32_t pow10;
+    int n = largest_pow10(p1, pow10);
+    while (n > 0) {
+        buffer[length++] = static_cast<char>('0' + p1 / pow10);
+        p1 %= pow10;
+        n--;
+
+        const uint64_t rest = (static_cast<uint64_t>(p1) << shift) + p2;
+        if (rest <= delta) {
+            decimal_exponent += n;
+            grisu2_round(buffer, length, dist, delta, rest, static_cast<uint64_t>(pow10) << shift);
+            return;
+        }
+        pow10 /= 10;
+    }
+
+    int m = 0;
+    while (true) {
+        p2 *= 10;
+        buffer[length++] = static_cast<char>('0' + (p2 >> shift));
+        p2 &= one - 1;
+        m++;
+
+        delta *= 10;
+        dist *= 10;
+        if (p2 <= delta)
+            break;
+    }
+    decimal_exponent -= m;
+    grisu2_round(buffer, length, dist, delta, p2, one);
+}
+
+template <class FloatType>
+static void grisu2(char *buffer, int &length, int &decimal_exponent, FloatType value) {
+    diyfp minus, plus;
+    const diyfp v = compute_boundaries(value, minus, plus);
+    const cached_power cached = cached_power_for(plus.e);
+    const diyfp c { cached.f, cached.e };
+
+    const diyfp w = diyfp_mul(v, c);
+    const diyfp w_minus = diyfp_mul(minus, c);
+    const diyfp w_plus = diyfp_mul(plus, c);
+
+    // The products may be off by one ulp, so shrink the interval to stay safely inside it.
+    length = 0;
+    decimal_exponent = -cached.k;
+    grisu2_digits(buffer, length, decimal_exponent,
+                  diyfp { w_minus.f + 1, w_minus.e }, w, diyfp { w_plus.f - 1, w_plus.e });
+}
+
+/* format_float(value, buf)
+ *
+ * Write value to buf the way %.17g would lay it out -- fixed notation for decimal exponents
+ * in [-4, 17), otherwise d.ddde+XX -- but with the shortest digits that round-trip. buf must
+ * hold 32 bytes. Return the number of bytes written.
+ */
+template <class FloatType>
+static size_t format_float(FloatType value, char *buf) {
+    char *p = buf;
+    if (std::signbit(value)) {
+        *p++ = '-';
+        value = -value;
+    }
+    if (value == 0) {
+        *p++ = '0';
+        return p - buf;
+    }
+
+    char digits[20];
+    int length, decimal_exponent;
+    grisu2(digits, length, decimal_exponent, value);
+
+    // The decimal point goes after the first `point` digits.
+    const int point = length + decimal_exponent;
+    if (point - 1 < -4 || point - 1 >= 17) {
+        *p++ = digits[0];
+        if (length > 1) {
+            *p++ = '.';
+            std::memcpy(p, digits + 1, length - 1);
+            p += length - 1;
+        }
+        int exponent = point - 1;
+        *p++ = 'e';
+        *p++ = exponent < 0 ? '-' : '+';
+        exponent = std::abs(exponent);
+        if (exponent >= 100)
+            *p++ = static_cast<char>('0' + exponent / 100);
+        *p++ = static_cast<char>('0' + exponent / 10 % 10);
+        *p++ = static_cast<char>('0' + exponent % 10);
+    } else if (point <= 0) {
+        *p++ = '0';
+        *p++ = '.';
+        std::memset(p, '0', -point);
+        p += -point;
+        std::memcpy(p, digits, length);
+        p += length;
+    } else if (point >= length) {
+        std::memcpy(p, digits, length);
+        p += length;
+        std::memset(p, '0', point - length);
+        p += point - length;
+    } else {
+        std::memcpy(p, digits, point);
+        p += point;
+        *p++ = '.';
+        std::memcpy(p, digits + point, length - point);
+        p += length - point;
+    }
+    return p - buf;
+}
+
+/* format_int(value, end)
+ *
+ * Write value so that it ends just before end, two digits at a time. Return a pointer to
+ * the first byte written; at most 11 bytes are used.
+ */
+static char *format_int(int value, char *end) {
+    static const char pairs[] =
+        "0001020304050607080910111213141516171819"
+        "2021222324252627282930313233343536373839"
+        "4041424344454647484950515253545556575859"
+        "6061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    uint32_t n = value < 0 ? 0u - static_cast<uint32_t>(value) : static_cast<uint32_t>(value);
+    char *p = end;
+    while (n >= 100) {
+        const uint32_t i = (n % 100) * 2;
+        n /= 100;
+        *--p = pairs[i + 1];
+        *--p = pairs[i];
+    }
+    if (n >= 10) {
+        *--p = pairs[n * 2 + 1];
+        *--p = pairs[n * 2];
+    } else {
+        *--p = static_cast<char>('0' + n);
+    }
+    if (value < 0)
+        *--p = '-';
+    return p;
+}
+
 // /* * * * * * * * * * * * * * * * * * * *
 //  * Serialization
 //  */
@@ -47,30 +448,139 @@ static void dump(std::nullptr_t, string &out) {
     out += "null";
 }
 
-static void dump(double value, string &out) {
+void dump(double value, string &out) {
     if (std::isfinite(value)) {
         char buf[32];
-        snprintf(buf, sizeof buf, "%.17g", value);
-        out += buf;
+        out.append(buf, format_float(value, buf));
     } else {
         out += "null";
     }
 }
 
-static void dump(int value, string &out) {
-    char buf[32];
-    snprintf(buf, sizeof buf, "%d", value);
-    out += buf;
+void dump(float value, string &out) {
+    if (std::isfinite(value)) {
+        char buf[32];
+        out.append(buf, format_float(value, buf));
+    } else {
+        out += "null";
+    }
+}
+
+void dump(int value, string &out) {
+    char buf[12];
+    char *end = buf + sizeof buf;
+    char *begin = format_int(value, end);
+    out.append(begin, end - begin);
 }
 
-static void dump(bool value, string &out) {
+void dump(bool value, string &out) {
     out += value ? "true" : "false";
 }
 
-static void dump(const string &value, string &out) {
+/* find_escape(data, i, n)
+ *
+ * Return the index of the first byte in [i, n) that dump(string) has to look at: '"', '\\',
+ * a control character, or 0xe2, the lead byte of U+2028 and U+2029. Return n if there is
+ * none. Long runs of plain characters are scanned 32 or 16 bytes at a time where AVX2 or
+ * SSE2 is available.
+ */
+static inline bool needs_escape(uint8_t ch) {
+    return ch == '"' || ch == '\\' || ch <= 0x1f || ch == 0xe2;
+}
+
+static inline unsigned trailing_zeros(uint32_t bits) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, bits);
+    return index;
+#else
+    return __builtin_ctz(bits);
+#endif
+}
+
+static inline unsigned trailing_zeros(uint64_t bits) {
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanForward64(&index, bits);
+    return index;
+#elif defined(_MSC_VER)
+    return static_cast<uint32_t>(bits) ? trailing_zeros(static_cast<uint32_t>(bits))
+                                       : 32 + trailing_zeros(static_cast<uint32_t>(bits >> 32));
+#else
+    return __builtin_ctzll(bits);
+#endif
+}
+
+static inline size_t find_escape(const char *data, size_t i, size_t n) {
+#if defined(__AVX2__)
+    {
+        const __m256i quote = _mm256_set1_epi8('"');
+        const __m256i backslash = _mm256_set1_epi8('\\');
+        const __m256i lead = _mm256_set1_epi8(static_cast<char>(0xe2));
+        const __m256i control = _mm256_set1_epi8(0x1f);
+        for (; i + 32 <= n; i += 32) {
+            const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+            const __m256i special = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote), _mm256_cmpeq_epi8(chunk, backslash)),
+                _mm256_or_si256(_mm256_cmpeq_epi8(chunk, lead),
+                                _mm256_cmpeq_epi8(_mm256_max_epu8(chunk, control), control)));
+            const uint32_t bits = static_cast<uint32_t>(_mm256_movemask_epi8(special));
+            if (bits)
+                return i + trailing_zeros(bits);
+        }
+    }
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+    {
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i backslash = _mm_set1_epi8('\\');
+        const __m128i lead = _mm_set1_epi8(static_cast<char>(0xe2));
+        const __m128i control = _mm_set1_epi8(0x1f);
+        for (; i + 16 <= n; i += 16) {
+            const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+            // There is no unsigned byte compare, but max(ch, 0x1f) == 0x1f iff ch <= 0x1f.
+            const __m128i special = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+                _mm_or_si128(_mm_cmpeq_epi8(chunk, lead),
+                             _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control)));
+            const uint32_t bits = static_cast<uint32_t>(_mm_movemask_epi8(special));
+            if (bits)
+                return i + trailing_zeros(bits);
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        if (needs_escape(static_cast<uint8_t>(data[i])))
+            return i;
+    }
+    return n;
+}
+
+/* line_separator(data, i, n)
+ *
+ * Return whether the 0xe2 at data[i] starts U+2028 or U+2029, which are valid JSON but not
+ * valid JavaScript, and so are escaped too.
+ */
+static inline bool line_separator(const char *data, size_t i, size_t n) {
+    return i + 2 < n && static_cast<uint8_t>(data[i+1]) == 0x80
+        && (static_cast<uint8_t>(data[i+2]) == 0xa8 || static_cast<uint8_t>(data[i+2]) == 0xa9);
+}
+
+void dump(std::string_view value, string &out) {
+    static const char hex[] = "0123456789abcdef";
+    const char *data = value.data();
+    const size_t n = value.length();
     out += '"';
-    for (size_t i = 0; i < value.length(); i++) {
-        const char ch = value[i];
+    size_t i = 0;
+    while (true) {
+        // Append the run of characters that need no escaping in one go
+        const size_t next = find_escape(data, i, n);
+        out.append(data + i, next - i);
+        if (next == n)
+            break;
+        i = next;
+
+        const char ch = data[i];
         if (ch == '\\') {
             out += "\\\\";
         } else if (ch == '"') {
@@ -86,701 +596,4799 @@ static void dump(const string &value, string &out) {
         } else if (ch == '\t') {
             out += "\\t";
         } else if (static_cast<uint8_t>(ch) <= 0x1f) {
-            char buf[8];
-            snprintf(buf, sizeof buf, "\\u%04x", ch);
-            out += buf;
-        } else if (static_cast<uint8_t>(ch) == 0xe2 && static_cast<uint8_t>(value[i+1]) == 0x80
-                   && static_cast<uint8_t>(value[i+2]) == 0xa8) {
-            out += "\\u2028";
-            i += 2;
-        } else if (static_cast<uint8_t>(ch) == 0xe2 && static_cast<uint8_t>(value[i+1]) == 0x80
-                   && static_cast<uint8_t>(value[i+2]) == 0xa9) {
-            out += "\\u2029";
+            const char escaped[] = { '\\', 'u', '0', '0', hex[(ch >> 4) & 0xf], hex[ch & 0xf] };
+            out.append(escaped, sizeof escaped);
+        } else if (line_separator(data, i, n)) {
+            out += static_cast<uint8_t>(data[i+2]) == 0xa8 ? "\\u2028" : "\\u2029";
             i += 2;
         } else {
             out += ch;
         }
+        i++;
     }
     out += '"';
 }
 
+/* dump_size(value)
+ *
+ * Return the exact number of bytes dump(value, out) appends.
+ */
+size_t dump_size(double value) {
+    char buf[32];
+    return std::isfinite(value) ? format_float(value, buf) : 4;
+}
+
+size_t dump_size(float value) {
+    char buf[32];
+    return std::isfinite(value) ? format_float(value, buf) : 4;
+}
+
+size_t dump_size(int value) {
+    uint32_t n = value < 0 ? 0u - static_cast<uint32_t>(value) : static_cast<uint32_t>(value);
+    size_t size = value < 0 ? 2 : 1;
+    while (n >= 10) {
+        n /= 10;
+        size++;
+    }
+    return size;
+}
+
+size_t dump_size(bool value) {
+    return value ? 4 : 5;
+}
+
+size_t dump_size(std::string_view value) {
+    const char *data = value.data();
+    const size_t n = value.length();
+    size_t size = 2;
+    size_t i = 0;
+    while (true) {
+        const size_t next = find_escape(data, i, n);
+        size += next - i;
+        if (next == n)
+            break;
+        i = next;
+
+        const char ch = data[i];
+        if (ch == '\\' || ch == '"' || ch == '\b' || ch == '\f' || ch == '\n' || ch == '\r' || ch == '\t') {
+            size += 2;
+        } else if (static_cast<uint8_t>(ch) <= 0x1f) {
+            size += 6;
+        } else if (line_separator(data, i, n)) {
+            size += 6;
+            i += 2;
+        } else {
+            size += 1;
+        }
+        i++;
+    }
+    return size;
+}
+
+/* primitive_dump(kind, target, out)
+ *
+ * Serialize the primitive of the given kind at target.
+ */
+static void primitive_dump(ValueConverter::Kind kind, const void *target, string &out) {
+    switch (kind) {
+    case ValueConverter::INT:    dump(*static_cast<const int *>(target), out);                         break;
+    case ValueConverter::BOOL:   dump(*static_cast<const bool *>(target), out);                        break;
+    case ValueConverter::FLOAT:  dump(*static_cast<const float *>(target), out);                       break;
+    case ValueConverter::DOUBLE: dump(*static_cast<const double *>(target), out);                      break;
+    case ValueConverter::STRING: dump(*static_cast<const string *>(target), out);                      break;
+    case ValueConverter::STRING_VIEW: dump(*static_cast<const std::string_view *>(target), out);       break;
+    case ValueConverter::CUSTOM: dump(nullptr, out);                                                   break;
+    }
+}
+
+static size_t primitive_dump_size(ValueConverter::Kind kind, const void *target) {
+    switch (kind) {
+    case ValueConverter::INT:    return dump_size(*static_cast<const int *>(target));
+    case ValueConverter::BOOL:   return dump_size(*static_cast<const bool *>(target));
+    case ValueConverter::FLOAT:  return dump_size(*static_cast<const float *>(target));
+    case ValueConverter::DOUBLE: return dump_size(*static_cast<const double *>(target));
+    case ValueConverter::STRING: return dump_size(*static_cast<const string *>(target));
+    case ValueConverter::STRING_VIEW: return dump_size(*static_cast<const std::string_view *>(target));
+    case ValueConverter::CUSTOM: return 4;
+    }
+    return 0;
+}
+
+/* custom_dump(converter, out)
+ *
+ * Serialize a value bound through a custom converter, which can only produce a json11::Json.
+ */
+static void custom_dump(const ValueConverter &converter, string &out) {
+    Json json;
+    converter.to_json(json);
+    json.dump(out);
+}
+
+static size_t custom_dump_size(const ValueConverter &converter) {
+    Json json;
+    converter.to_json(json);
+    return json.dump().size();
+}
+
 static void dump(const Schema::array &values, string &out) {
     bool first = true;
     out += "[";
-    // for (const auto &value : values) {
-    //     if (!first)
-    //         out += ", ";
-    //     value.dump(out);
-    //     first = false;
-    // }
+    const size_t size = values.size ? values.size() : 0;
+    for (size_t i = 0; i < size; i++) {
+        if (!first)
+            out += ", ";
+        if (values.element_schema) {
+            values.element_schema->dump(values.element(i), out);
+        } else if (values.element_kind != ValueConverter::CUSTOM) {
+            primitive_dump(values.element_kind, values.element(i), out);
+        } else {
+            values.at(i).dump(out);
+        }
+        first = false;
+    }
     out += "]";
 }
 
+static size_t dump_size(const Schema::array &values) {
+    const size_t count = values.size ? values.size() : 0;
+    size_t size = 2 + (count ? 2 * (count - 1) : 0);
+    for (size_t i = 0; i < count; i++) {
+        if (values.element_schema) {
+            size += values.element_schema->dump_size(values.element(i));
+        } else if (values.element_kind != ValueConverter::CUSTOM) {
+            size += primitive_dump_size(values.element_kind, values.element(i));
+        } else {
+            size += values.at(i).dump_size();
+        }
+    }
+    return size;
+}
+
 static void dump(const Schema::object &values, string &out) {
     bool first = true;
     out += "{";
     for (const auto &kv : values) {
         if (!first)
             out += ", ";
-        dump(kv.first, out);
+        dump(kv.first.str(), out);
         out += ": ";
-        // TODO:
-        // kv.second.dump(out);
+        kv.second.dump(out);
         first = false;
     }
     out += "}";
 }
 
+static size_t dump_size(const Schema::object &values) {
+    size_t size = 2 + (values.empty() ? 0 : 2 * (values.size() - 1));
+    for (const auto &kv : values)
+        size += dump_size(kv.first.str()) + 2 + kv.second.dump_size();
+    return size;
+}
+
 void Schema::dump(string &out) const {
     m_ptr->dump(out);
 }
 
+size_t Schema::dump_size() const {
+    return m_ptr->dump_size();
+}
+
 /* * * * * * * * * * * * * * * * * * * *
- * Value wrappers
+ * Symbols
  */
 
-template <Schema::Type tag>
-class Value : public SchemaValue {
-protected:
+/* SymbolTable
+ *
+ * The process-wide set of interned keys, indexed by hash. Entries are never removed, so
+ * Symbols stay valid for the life of the process; the table itself is deliberately leaked
+ * so that schemas destroyed during static destruction can still use it.
+ */
+struct SymbolTable {
+    std::mutex mutex;
+    std::unordered_multimap<uint32_t, const Symbol::Entry *> entries;
+    const Symbol::Entry *empty;
 
-    // Constructors
-    explicit Value(ValueConverter valueConverter) : m_valueConverter(valueConverter) {}
+    SymbolTable() : empty(insert("", 0, KeyHash("", 0))) {}
 
-    // Get type tag
-    Schema::Type type() const override {
-        return tag;
+    const Symbol::Entry *find(const char *key, size_t length, uint32_t hash) const {
+        const auto range = entries.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            const string &name = it->second->name;
+            if (name.size() == length && memcmp(name.data(), key, length) == 0)
+                return it->second;
+        }
+        return nullptr;
     }
 
-    // Comparisons
-    bool equals(const SchemaValue * other) const override {
-        return type() == static_cast<const Value<tag> *>(other)->type();
-        //return m_value == static_cast<const Value<tag, T> *>(other)->m_value;
+    const Symbol::Entry *insert(const char *key, size_t length, uint32_t hash) {
+        const Symbol::Entry *entry = new Symbol::Entry { string(key, length), hash };
+        entries.emplace(hash, entry);
+        return entry;
     }
-    bool less(const SchemaValue * other) const override {
-        return type() < static_cast<const Value<tag> *>(other)->type();
-        //return m_value < static_cast<const Value<tag, T> *>(other)->m_value;
-    }
-
-    ValueConverter m_valueConverter;
-	void from_json(const Json &json) const override {
-		m_valueConverter.from_json(json);
-	}
-	
-	void to_json(Json &json) const override {
-		m_valueConverter.to_json(json);
-	}
-	
-    void dump(string &out) const override { /*schema11::dump(m_value, out); */ }
-};
-
-class SchemaNumber final : public Value<Schema::NUMBER> {
-public:
-    explicit SchemaNumber(ValueConverter valueConverter) : Value(valueConverter) {}
 };
 
-class SchemaBoolean final : public Value<Schema::BOOL> {
-public:
-    explicit SchemaBoolean(ValueConverter valueConverter) : Value(valueConverter) {}
-};
+static SymbolTable &symbol_table() {
+    static SymbolTable *table = new SymbolTable;
+    return *table;
+}
 
-class SchemaString final : public Value<Schema::STRING> {
-public:
-    explicit SchemaString(ValueConverter valueConverter) : Value(valueConverter) {}
-};
+Symbol::Symbol() : m_entry(symbol_table().empty) {}
 
-class SchemaArray final : public Value<Schema::ARRAY> {
-public:
-    explicit SchemaArray(const Schema::array &value) : Value(ValueConverter()), m_value(value) {}
-    
-	void from_json(const Json &json) const override {
-        for (const auto & itemJson : json.array_items()) {
-            auto schema = m_value.first();
-            schema.from_json(itemJson);
-            // TODO: Assume the schema conversion succeeds and do the insertion
-            m_value.second();
-        }
-	}
-	
-	void to_json(Json &json) const override {
-	}
-    
-    Schema::array m_value;
-};
+Symbol::Symbol(const char *key) : Symbol(key, strlen(key)) {}
 
-class SchemaObject final : public Value<Schema::OBJECT> {
-    const Schema::object &object_items() const override { return m_value; }
-    const Schema & operator[](const string &key) const override;
-public:
-    explicit SchemaObject(const Schema::object &value) : Value(ValueConverter()), m_value(value) {}
-    explicit SchemaObject(Schema::object &&value) : Value(ValueConverter()), m_value(move(value)) {}
-	
-	void from_json(const Json &json) const override {
-		for (auto & value : m_value) {
-			value.second.from_json(json[value.first]);
-		}
-	}
-	
-	void to_json(Json &json) const override {
-		// for (const auto & value : m_value) {
-		// 	value.second.to_json(json[value.first]);
-		// }
-	}
-    
-    Schema::object m_value;
-};
+Symbol::Symbol(const string &key) : Symbol(key.data(), key.size()) {}
 
-class SchemaNull final : public Value<Schema::NUL> {
-public:
-    SchemaNull() : Value(ValueConverter()) {}
+Symbol::Symbol(const char *key, size_t length) {
+    const uint32_t hash = KeyHash(key, length);
+    SymbolTable &table = symbol_table();
+    std::lock_guard<std::mutex> lock(table.mutex);
+    m_entry = table.find(key, length, hash);
+    if (!m_entry)
+        m_entry = table.insert(key, length, hash);
+}
 
-	void from_json(const Json &json) const override {
-	}
-	
-	void to_json(Json &json) const override {
-	}
-};
+bool Symbol::Lookup(const char *key, size_t length, Symbol &symbol) {
+    const uint32_t hash = KeyHash(key, length);
+    SymbolTable &table = symbol_table();
+    std::lock_guard<std::mutex> lock(table.mutex);
+    const Symbol::Entry *entry = table.find(key, length, hash);
+    if (!entry)
+        return false;
+    symbol = Symbol(entry);
+    return true;
+}
 
 /* * * * * * * * * * * * * * * * * * * *
- * Static globals - static-init-safe
+ * Arena allocation
  */
-struct Statics {
-    const std::shared_ptr<SchemaValue> null = make_shared<SchemaNull>();
-    // const std::shared_ptr<SchemaValue> t = make_shared<SchemaBoolean>(true);
-    // const std::shared_ptr<SchemaValue> f = make_shared<SchemaBoolean>(false);
-    const string empty_string;
-    const vector<Schema> empty_vector;
-    const map<string, Schema> empty_map;
-    Statics() {}
+
+struct SchemaArena::Block {
+    Block *next;
 };
 
-static const Statics & statics() {
-    static const Statics s {};
-    return s;
+static thread_local SchemaArena *current_arena = nullptr;
+
+SchemaArena::SchemaArena(size_t block_size) : m_block_size(block_size) {}
+
+SchemaArena::~SchemaArena() {
+    reset();
 }
 
-static const Schema & static_null() {
-    // This has to be separate, not in Statics, because Schema() accesses statics().null.
-    static const Schema json_null;
-    return json_null;
+void *SchemaArena::allocate(size_t size, size_t alignment) {
+    uintptr_t next = (reinterpret_cast<uintptr_t>(m_next) + alignment - 1) & ~(alignment - 1);
+    if (!m_next || next + size > reinterpret_cast<uintptr_t>(m_end)) {
+        // Start a new block, big enough for oversized requests
+        const size_t header = (sizeof(Block) + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+        const size_t capacity = std::max(m_block_size, size + alignment);
+        Block *block = static_cast<Block *>(::operator new(header + capacity));
+        block->next = m_blocks;
+        m_blocks = block;
+        m_next = reinterpret_cast<char *>(block) + header;
+        m_end = m_next + capacity;
+        next = (reinterpret_cast<uintptr_t>(m_next) + alignment - 1) & ~(alignment - 1);
+    }
+    m_next = reinterpret_cast<char *>(next + size);
+    m_allocated += size;
+    return reinterpret_cast<void *>(next);
 }
 
-/* * * * * * * * * * * * * * * * * * * *
- * Constructors
+void SchemaArena::reset() {
+    while (m_blocks) {
+        Block *next = m_blocks->next;
+        ::operator delete(m_blocks);
+        m_blocks = next;
+    }
+    m_next = m_end = nullptr;
+    m_allocated = 0;
+}
+
+SchemaArena *SchemaArena::current() {
+    return current_arena;
+}
+
+SchemaArena::Scope::Scope(SchemaArena &arena) : m_previous(current_arena) {
+    current_arena = &arena;
+}
+
+SchemaArena::Scope::~Scope() {
+    current_arena = m_previous;
+}
+
+/* ArenaAllocator<T>
+ *
+ * Allocates from an arena, or from the heap when the arena is null. Deallocation within an
+ * arena is a no-op; the memory is reclaimed when the arena is.
+ */
+template <class T>
+class ArenaAllocator {
+public:
+    typedef T value_type;
+
+    explicit ArenaAllocator(SchemaArena *arena = SchemaArena::current()) : m_arena(arena) {}
+    template <class U>
+    ArenaAllocator(const ArenaAllocator<U> &other) : m_arena(other.arena()) {}
+
+    T *allocate(size_t n) {
+        if (m_arena)
+            return static_cast<T *>(m_arena->allocate(n * sizeof(T), alignof(T)));
+        return static_cast<T *>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, size_t) {
+        if (!m_arena)
+            ::operator delete(p);
+    }
+
+    SchemaArena *arena() const { return m_arena; }
+
+    template <class U>
+    bool operator==(const ArenaAllocator<U> &other) const { return m_arena == other.arena(); }
+    template <class U>
+    bool operator!=(const ArenaAllocator<U> &other) const { return m_arena != other.arena(); }
+
+private:
+    SchemaArena *m_arena;
+};
+
+/* make_value<T>(args...)
+ *
+ * Construct a schema node, with its reference count, in the current arena if there is one.
+ */
+template <class T, class... Args>
+static std::shared_ptr<T> make_value(Args &&... args) {
+    return std::allocate_shared<T>(ArenaAllocator<T>(), std::forward<Args>(args)...);
+}
+
+/* * * * * * * * * * * * * * * * * * * *
+ * Primitive conversion
+ */
+
+/* primitive_from_json(kind, target, json)
+ *
+ * Assign json to the primitive of the given kind at target, using the same json11
+ * accessors (and therefore the same defaults) as PrimitiveConverter.
+ */
+static void primitive_from_json(ValueConverter::Kind kind, void *target, const Json &json) {
+    switch (kind) {
+    case ValueConverter::INT:
+        *static_cast<int *>(target) = json.int_value();
+        break;
+    case ValueConverter::BOOL:
+        *static_cast<bool *>(target) = json.bool_value();
+        break;
+    case ValueConverter::FLOAT:
+        *static_cast<float *>(target) = static_cast<float>(json.number_value());
+        break;
+    case ValueConverter::DOUBLE:
+        *static_cast<double *>(target) = json.number_value();
+        break;
+    case ValueConverter::STRING:
+        *static_cast<string *>(target) = json.string_value();
+        break;
+    case ValueConverter::STRING_VIEW:
+        // Points into json, which must outlive it
+        *static_cast<std::string_view *>(target) = json.string_value();
+        break;
+    case ValueConverter::CUSTOM:
+        break;
+    }
+}
+
+/* primitive_to_json(kind, target, json)
+ *
+ * Assign the primitive of the given kind at target to json.
+ */
+static void primitive_to_json(ValueConverter::Kind kind, const void *target, Json &json) {
+    switch (kind) {
+    case ValueConverter::INT:    json = Json(*static_cast<const int *>(target));                         break;
+    case ValueConverter::BOOL:   json = Json(*static_cast<const bool *>(target));                        break;
+    case ValueConverter::FLOAT:  json = Json(static_cast<double>(*static_cast<const float *>(target)));  break;
+    case ValueConverter::DOUBLE: json = Json(*static_cast<const double *>(target));                      break;
+    case ValueConverter::STRING: json = Json(*static_cast<const string *>(target));                      break;
+    case ValueConverter::STRING_VIEW: json = Json(string(*static_cast<const std::string_view *>(target))); break;
+    case ValueConverter::CUSTOM: json = Json();                                                          break;
+    }
+}
+
+/* array_to_json(desc, json)
+ *
+ * Assign the elements of the container described by desc to json, as an array.
+ */
+static void array_to_json(const Schema::array &desc, Json &json) {
+    const size_t size = desc.size ? desc.size() : 0;
+    Json::array items(size);
+    for (size_t i = 0; i < size; i++) {
+        if (desc.element_schema) {
+            desc.element_schema->to_json(desc.element(i), items[i]);
+        } else if (desc.element_kind != ValueConverter::CUSTOM) {
+            primitive_to_json(desc.element_kind, desc.element(i), items[i]);
+        } else {
+            desc.at(i).to_json(items[i]);
+        }
+    }
+    json = Json(move(items));
+}
+
+/* WorkerPool
+ *
+ * One worker thread per core besides the caller's, started the first time an array is
+ * decoded in parallel and kept for the life of the process, so decoding does not pay for
+ * creating threads. A parallel loop is posted as a job whose chunks the posting thread
+ * and any idle workers claim from a shared counter, so whoever finishes early takes on
+ * more of the work, including the work of other threads' jobs.
+ */
+static thread_local bool on_worker_thread = false;
+
+class WorkerPool {
+public:
+    struct Job {
+        typedef void (*Function)(void *fn, size_t begin, size_t end);
+
+        Job(size_t count, size_t chunk, Function function, void *fn)
+            : count(count), chunk(chunk), function(function), fn(fn) {}
+
+        const size_t count;
+        const size_t chunk;
+        const Function function;
+        void *const fn;
+        std::atomic<size_t> next { 0 };
+        size_t workers = 0;         // Workers running chunks of this job, under the pool's lock
+        std::mutex error_mutex;
+        std::exception_ptr error;
+
+        // Claim and run chunks until none are left. After an exception, the rest of the
+        // chunks are abandoned.
+        void run() {
+            try {
+                for (size_t begin; (begin = next.fetch_add(chunk)) < count;)
+                    function(fn, begin, std::min(begin + chunk, count));
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error)
+                    error = std::current_exception();
+                next = count;
+            }
+        }
+
+        bool exhausted() const {
+            return next.load() >= count;
+        }
+    };
+
+    // Never destroyed, so that the detached workers never outlive it.
+    static WorkerPool &instance() {
+        static WorkerPool *pool = new WorkerPool();
+        return *pool;
+    }
+
+    size_t workers() const {
+        return m_workers;
+    }
+
+    // Run job on this thread and the idle workers, and return once every chunk is done.
+    void run(Job &job) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_jobs.push_back(&job);
+        }
+        m_wake.notify_all();
+        job.run();
+
+        // Withdraw the job so no more workers join it, then wait for those that did
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_jobs.erase(std::find(m_jobs.begin(), m_jobs.end(), &job));
+        m_done.wait(lock, [&job] { return job.workers == 0; });
+    }
+
+private:
+    WorkerPool() : m_workers(std::max(1u, std::thread::hardware_concurrency()) - 1) {
+        for (size_t i = 0; i < m_workers; i++)
+            std::thread([this] { work(); }).detach();
+    }
+
+    void work() {
+        on_worker_thread = true;
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true) {
+            Job *job;
+            m_wake.wait(lock, [this, &job] { return (job = open_job()) != nullptr; });
+            job->workers++;
+            lock.unlock();
+            job->run();
+            lock.lock();
+            if (--job->workers == 0)
+                m_done.notify_all();
+        }
+    }
+
+    // The first posted job with chunks left to claim, or nullptr.
+    Job *open_job() const {
+        for (Job *job : m_jobs) {
+            if (!job->exhausted())
+                return job;
+        }
+        return nullptr;
+    }
+
+    const size_t m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;     // A job was posted
+    std::condition_variable m_done;     // A worker left a job
+    vector<Job *> m_jobs;
+};
+
+/* parallel_for(count, chunk, fn)
+ *
+ * Call fn(begin, end) over [0, count) in chunks, on the calling thread and the workers
+ * of the WorkerPool. A loop started on a worker, as for an array nested in one being
+ * decoded in parallel, runs inline there, since the pool is already busy. The first
+ * exception thrown by fn is rethrown once every chunk has stopped.
+ */
+template <class Fn>
+static void parallel_for(size_t count, size_t chunk, Fn fn) {
+    if (count <= chunk || on_worker_thread || WorkerPool::instance().workers() == 0) {
+        fn(0, count);
+        return;
+    }
+
+    WorkerPool::Job job(count, chunk, [](void *fn, size_t begin, size_t end) {
+        (*static_cast<Fn *>(fn))(begin, end);
+    }, &fn);
+    WorkerPool::instance().run(job);
+    if (job.error)
+        std::rethrow_exception(job.error);
+}
+
+/* array_from_json(desc, json)
+ *
+ * Append the items of json to the container described by desc, constructing each element
+ * in place, and decoding them in parallel if desc opted in.
+ */
+static void array_from_json(const Schema::array &desc, const Json &json) {
+    static const size_t parallel_chunk = 1024;
+    const auto &items = json.array_items();
+
+    if (desc.parallel_threshold && items.size() >= desc.parallel_threshold && desc.append_elements) {
+        const size_t first = desc.size();
+        desc.append_elements(items.size());
+        parallel_for(items.size(), parallel_chunk, [&desc, &items, first](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                if (desc.element_schema)
+                    desc.element_schema->from_json(desc.element(first + i), items[i]);
+                else if (desc.element_kind != ValueConverter::CUSTOM)
+                    primitive_from_json(desc.element_kind, desc.element(first + i), items[i]);
+                else
+                    desc.at(first + i).from_json(items[i]);
+            }
+        });
+        return;
+    }
+
+    if (desc.reserve)
+        desc.reserve(items.size());
+
+    for (const auto &itemJson : items) {
+        if (desc.element_schema) {
+            desc.element_schema->from_json(desc.append_element(), itemJson);
+        } else if (desc.element_kind != ValueConverter::CUSTOM) {
+            primitive_from_json(desc.element_kind, desc.append_element(), itemJson);
+        } else {
+            desc.append().from_json(itemJson);
+        }
+    }
+}
+
+/* merge_fields(begin, end, key_of, json, fn)
+ *
+ * Walk the fields in [begin, end), sorted by key, together with the members of json, which
+ * json11 keeps sorted too, and call fn(field, value) with each field's value, or with null
+ * if the field is absent. This visits each member once instead of looking every field up.
+ */
+template <typename Iter, typename KeyOf, typename Fn>
+static void merge_fields(Iter begin, Iter end, KeyOf key_of, const Json &json, Fn fn) {
+    static const Json null;
+    const auto &items = json.object_items();
+    auto item = items.begin();
+    for (auto field = begin; field != end; ++field) {
+        const string &key = key_of(*field);
+        int cmp = 1;
+        while (item != items.end() && (cmp = item->first.compare(key)) < 0)
+            ++item;
+        fn(*field, (item != items.end() && cmp == 0) ? item->second : null);
+    }
+}
+
+/* merge_patch_json(target, patch)
+ *
+ * Return target with patch merged into it, as RFC 7386 specifies. Used for values behind
+ * custom converters, which cannot be patched field by field.
+ */
+static Json merge_patch_json(const Json &target, const Json &patch) {
+    if (!patch.is_object())
+        return patch;
+
+    Json::object result = target.object_items();
+    for (const auto &item : patch.object_items()) {
+        if (item.second.is_null())
+            result.erase(item.first);
+        else
+            result[item.first] = merge_patch_json(result[item.first], item.second);
+    }
+    return Json(move(result));
+}
+
+/* merge_diff_json(from, to)
+ *
+ * Return a merge patch that turns from into to: members that differ, diffed again if both
+ * sides are objects, and null for members that were removed.
+ */
+static Json merge_diff_json(const Json &from, const Json &to) {
+    if (!from.is_object() || !to.is_object())
+        return to;
+
+    const auto &before = from.object_items();
+    Json::object result;
+    for (const auto &item : before) {
+        if (!to.object_items().count(item.first))
+            result.emplace(item.first, Json());
+    }
+    for (const auto &item : to.object_items()) {
+        const auto previous = before.find(item.first);
+        if (previous == before.end())
+            result.emplace(item.first, item.second);
+        else if (previous->second != item.second)
+            result.emplace(item.first, merge_diff_json(previous->second, item.second));
+    }
+    return Json(move(result));
+}
+
+/* KeyTable
+ *
+ * Open-addressing hash table from a key to its slot in an object schema, built once when
+ * the schema is created from the symbols' precomputed hashes, so that the direct parser
+ * can find a field by hash rather than by string comparisons down a map.
+ */
+class KeyTable {
+public:
+    explicit KeyTable(vector<Symbol> keys) : m_keys(move(keys)) {
+        size_t capacity = 4;
+        while (capacity < m_keys.size() * 2)
+            capacity <<= 1;
+        m_entries.assign(capacity, Entry { 0, -1 });
+        m_mask = capacity - 1;
+
+        for (size_t slot = 0; slot < m_keys.size(); slot++) {
+            const uint32_t hash = m_keys[slot].hash();
+            size_t index = hash & m_mask;
+            while (m_entries[index].slot >= 0)
+                index = (index + 1) & m_mask;
+            m_entries[index] = Entry { hash, static_cast<int32_t>(slot) };
+        }
+    }
+
+    // Return the slot of key, or -1 if it is not in the table.
+    int find(const char *key, size_t length) const {
+        const uint32_t hash = KeyHash(key, length);
+        for (size_t index = hash & m_mask;; index = (index + 1) & m_mask) {
+            const Entry &entry = m_entries[index];
+            if (entry.slot < 0)
+                return -1;
+            const string &candidate = m_keys[entry.slot].str();
+            if (entry.hash == hash && candidate.size() == length
+                    && memcmp(candidate.data(), key, length) == 0)
+                return entry.slot;
+        }
+    }
+
+private:
+    struct Entry {
+        uint32_t hash;
+        int32_t slot;
+    };
+    vector<Symbol> m_keys;
+    vector<Entry> m_entries;
+    size_t m_mask;
+};
+
+/* * * * * * * * * * * * * * * * * * * *
+ * Value wrappers
+ */
+
+template <Schema::Type tag>
+class Value : public SchemaValue {
+protected:
+
+    // Constructors
+    explicit Value(ValueConverter valueConverter) : m_valueConverter(valueConverter) {}
+
+    // Get type tag
+    Schema::Type type() const override {
+        return tag;
+    }
+
+    // Comparisons
+    bool equals(const SchemaValue * other) const override {
+        return type() == static_cast<const Value<tag> *>(other)->type();
+        //return m_value == static_cast<const Value<tag, T> *>(other)->m_value;
+    }
+    bool less(const SchemaValue * other) const override {
+        return type() < static_cast<const Value<tag> *>(other)->type();
+        //return m_value < static_cast<const Value<tag, T> *>(other)->m_value;
+    }
+
+    ValueConverter m_valueConverter;
+	void from_json(const Json &json) const override {
+		m_valueConverter.from_json(json);
+	}
+	
+	void to_json(Json &json) const override {
+		m_valueConverter.to_json(json);
+	}
+
+	bool merge_patch(const Json &patch, DirtyMask *, string &) const override {
+		if (tag == Schema::OBJECT && patch.is_object() && m_valueConverter.kind == ValueConverter::CUSTOM) {
+			Json json;
+			m_valueConverter.to_json(json);
+			m_valueConverter.from_json(merge_patch_json(json, patch));
+		} else {
+			from_json(patch);
+		}
+		return true;
+	}
+
+	void parse(SchemaParser &parser, int depth) const override;
+	void pack(BinaryWriter &writer) const override;
+	void unpack(BinaryReader &reader, int depth) const override;
+	void save(SnapshotWriter &writer) const override;
+	void load(SnapshotReader &reader) const override;
+	void shape(SnapshotShape &shape) const override;
+	bool delta(DeltaEncoder &encoder, DeltaBaseline &baseline, Json &patch) const override;
+	void delta(const DirtyMask &dirty, Json &patch) const override;
+
+	void compile(CompiledSchema::Instruction &instruction) const override {
+		instruction.target = m_valueConverter.target;
+		switch (m_valueConverter.kind) {
+		case ValueConverter::INT:    instruction.op = CompiledSchema::INT;    break;
+		case ValueConverter::BOOL:   instruction.op = CompiledSchema::BOOL;   break;
+		case ValueConverter::FLOAT:  instruction.op = CompiledSchema::FLOAT;  break;
+		case ValueConverter::DOUBLE: instruction.op = CompiledSchema::DOUBLE; break;
+		case ValueConverter::STRING: instruction.op = CompiledSchema::STRING; break;
+		case ValueConverter::STRING_VIEW:
+		case ValueConverter::CUSTOM:
+			instruction.op = CompiledSchema::CUSTOM;
+			instruction.converter = &m_valueConverter;
+			break;
+		}
+	}
+	
+    void dump(string &out) const override {
+        if (m_valueConverter.kind == ValueConverter::CUSTOM)
+            custom_dump(m_valueConverter, out);
+        else
+            primitive_dump(m_valueConverter.kind, m_valueConverter.target, out);
+    }
+
+    size_t dump_size() const override {
+        if (m_valueConverter.kind == ValueConverter::CUSTOM)
+            return custom_dump_size(m_valueConverter);
+        return primitive_dump_size(m_valueConverter.kind, m_valueConverter.target);
+    }
+};
+
+class SchemaNumber final : public Value<Schema::NUMBER> {
+public:
+    explicit SchemaNumber(ValueConverter valueConverter) : Value(valueConverter) {}
+};
+
+class SchemaBoolean final : public Value<Schema::BOOL> {
+public:
+    explicit SchemaBoolean(ValueConverter valueConverter) : Value(valueConverter) {}
+};
+
+class SchemaString final : public Value<Schema::STRING> {
+public:
+    explicit SchemaString(ValueConverter valueConverter) : Value(valueConverter) {}
+};
+
+class SchemaArray final : public Value<Schema::ARRAY> {
+public:
+    explicit SchemaArray(const Schema::array &value) : Value(ValueConverter()), m_value(value) {}
+    
+	void from_json(const Json &json) const override {
+		array_from_json(m_value, json);
+	}
+	
+	void to_json(Json &json) const override {
+		array_to_json(m_value, json);
+	}
+
+	// Arrays are replaced, not merged, which takes a clear callback.
+	bool merge_patch(const Json &patch, DirtyMask *, string &err) const override {
+		if (!m_value.clear) {
+			err = "merge patch cannot replace an array bound without a clear callback";
+			return false;
+		}
+		m_value.clear();
+		array_from_json(m_value, patch);
+		return true;
+	}
+
+    void dump(string &out) const override {
+        schema11::dump(m_value, out);
+    }
+
+    size_t dump_size() const override {
+        return schema11::dump_size(m_value);
+    }
+
+	void parse(SchemaParser &parser, int depth) const override;
+	void pack(BinaryWriter &writer) const override;
+	void unpack(BinaryReader &reader, int depth) const override;
+	void save(SnapshotWriter &writer) const override;
+	void load(SnapshotReader &reader) const override;
+	void shape(SnapshotShape &shape) const override;
+
+	void compile(CompiledSchema::Instruction &instruction) const override {
+		instruction.op = CompiledSchema::ARRAY;
+		instruction.array = &m_value;
+	}
+    
+    Schema::array m_value;
+};
+
+class SchemaObject final : public Value<Schema::OBJECT> {
+    const Schema::object &object_items() const override { return m_value; }
+    const Schema & operator[](const string &key) const override;
+public:
+    explicit SchemaObject(const Schema::object &value)
+        : Value(ValueConverter()), m_value(value), m_keys(keys(m_value)) {}
+    explicit SchemaObject(Schema::object &&value)
+        : Value(ValueConverter()), m_value(move(value)), m_keys(keys(m_value)) {}
+	
+	void from_json(const Json &json) const override {
+		merge_fields(m_value.begin(), m_value.end(),
+			[](const Schema::object::value_type &value) -> const string & { return value.first.str(); },
+			json,
+			[](const Schema::object::value_type &value, const Json &valueJson) { value.second.from_json(valueJson); });
+	}
+	
+	void to_json(Json &json) const override {
+		Json::object items;
+		for (const auto & value : m_value) {
+			Json valueJson;
+			value.second.to_json(valueJson);
+			items.emplace_hint(items.end(), value.first.str(), move(valueJson));
+		}
+		json = Json(move(items));
+	}
+
+	// Visit the members of patch rather than the fields, so that the cost follows the
+	// size of the patch. A patch that is not an object resets every field.
+	bool merge_patch(const Json &patch, DirtyMask *dirty, string &err) const override {
+		if (!patch.is_object()) {
+			static const Json null;
+			if (dirty)
+				dirty->set_all(m_value.size());
+			for (const auto &value : m_value) {
+				if (!value.second.merge_patch(null, err))
+					return false;
+			}
+			return true;
+		}
+
+		if (dirty)
+			dirty->resize(m_value.size());
+		for (const auto &item : patch.object_items()) {
+			const int slot = m_keys.find(item.first.data(), item.first.size());
+			if (slot < 0)
+				continue;
+			if (!m_value.begin()[slot].second.merge_patch(item.second, err))
+				return false;
+			if (dirty)
+				dirty->set(slot);
+		}
+		return true;
+	}
+
+    void dump(string &out) const override {
+        schema11::dump(m_value, out);
+    }
+
+    size_t dump_size() const override {
+        return schema11::dump_size(m_value);
+    }
+
+	void parse(SchemaParser &parser, int depth) const override;
+	void pack(BinaryWriter &writer) const override;
+	void unpack(BinaryReader &reader, int depth) const override;
+	void save(SnapshotWriter &writer) const override;
+	void load(SnapshotReader &reader) const override;
+	void shape(SnapshotShape &shape) const override;
+	bool delta(DeltaEncoder &encoder, DeltaBaseline &baseline, Json &patch) const override;
+	void delta(const DirtyMask &dirty, Json &patch) const override;
+
+	void compile(CompiledSchema::Instruction &instruction) const override {
+		instruction.op = CompiledSchema::OBJECT;
+	}
+
+    // Return the field with the given key, or nullptr if there is none.
+    const Schema *find(const char *key, size_t length) const {
+        const int slot = m_keys.find(key, length);
+        return slot < 0 ? nullptr : &m_value.begin()[slot].second;
+    }
+    const Schema *find(const string &key) const {
+        return find(key.data(), key.size());
+    }
+    
+    Schema::object m_value;
+
+private:
+    static vector<Symbol> keys(const Schema::object &value) {
+        vector<Symbol> result;
+        result.reserve(value.size());
+        for (const auto &item : value)
+            result.push_back(item.first);
+        return result;
+    }
+
+    const KeyTable m_keys;
+};
+
+class SchemaNull final : public Value<Schema::NUL> {
+public:
+    SchemaNull() : Value(ValueConverter()) {}
+
+	void from_json(const Json &json) const override {
+	}
+	
+	void to_json(Json &json) const override {
+		json = Json();
+	}
+
+    void dump(string &out) const override {
+        schema11::dump(nullptr, out);
+    }
+
+    size_t dump_size() const override {
+        return 4;
+    }
+
+	void parse(SchemaParser &parser, int depth) const override;
+	void pack(BinaryWriter &writer) const override;
+	void unpack(BinaryReader &reader, int depth) const override;
+	void save(SnapshotWriter &writer) const override;
+	void load(SnapshotReader &reader) const override;
+	void shape(SnapshotShape &shape) const override;
+
+	void compile(CompiledSchema::Instruction &instruction) const override {
+		instruction.op = CompiledSchema::NUL;
+	}
+};
+
+template <Schema::Type tag>
+class SchemaConverted final : public Value<tag> {
+public:
+    explicit SchemaConverted(const ValueConverter &valueConverter) : Value<tag>(valueConverter) {}
+};
+
+class SchemaTyped final : public Value<Schema::OBJECT> {
+public:
+    SchemaTyped(const TypeSchemaBase &schema, void *object)
+        : Value(ValueConverter { ValueConverter::CUSTOM, object,
+              { [](void *self, const Json &json) { static_cast<SchemaTyped *>(self)->from_json(json); }, this },
+              { [](void *self, Json &json) { static_cast<SchemaTyped *>(self)->to_json(json); }, this } }),
+          m_schema(schema), m_object(object) {}
+
+    void from_json(const Json &json) const override {
+        m_schema.from_json(m_object, json);
+    }
+
+    void to_json(Json &json) const override {
+        m_schema.to_json(m_object, json);
+    }
+
+    bool merge_patch(const Json &patch, DirtyMask *dirty, string &) const override {
+        m_schema.merge_patch(m_object, patch, dirty);
+        return true;
+    }
+
+    void dump(string &out) const override {
+        m_schema.dump(m_object, out);
+    }
+
+    size_t dump_size() const override {
+        return m_schema.dump_size(m_object);
+    }
+
+	void parse(SchemaParser &parser, int depth) const override;
+	void pack(BinaryWriter &writer) const override;
+	void unpack(BinaryReader &reader, int depth) const override;
+	void save(SnapshotWriter &writer) const override;
+	void load(SnapshotReader &reader) const override;
+	void shape(SnapshotShape &shape) const override;
+	bool delta(DeltaEncoder &encoder, DeltaBaseline &baseline, Json &patch) const override;
+	void delta(const DirtyMask &dirty, Json &patch) const override;
+
+    TypeSchemaBase m_schema;
+    void *m_object;
+};
+
+/* * * * * * * * * * * * * * * * * * * *
+ * Static globals - static-init-safe
+ */
+struct Statics {
+    const std::shared_ptr<SchemaValue> null = make_shared<SchemaNull>();
+    // const std::shared_ptr<SchemaValue> t = make_shared<SchemaBoolean>(true);
+    // const std::shared_ptr<SchemaValue> f = make_shared<SchemaBoolean>(false);
+    const string empty_string;
+    const vector<Schema> empty_vector;
+    const Schema::object empty_object;
+    Statics() {}
+};
+
+static const Statics & statics() {
+    static const Statics s {};
+    return s;
+}
+
+static const Schema & static_null() {
+    // This has to be separate, not in Statics, because Schema() accesses statics().null.
+    static const Schema json_null;
+    return json_null;
+}
+
+/* * * * * * * * * * * * * * * * * * * *
+ * Constructors
+ */
+
+Schema::Schema() noexcept                  : m_ptr(statics().null) {}
+Schema::Schema(std::nullptr_t) noexcept    : m_ptr(statics().null) {}
+Schema::Schema(int &value) : m_ptr(make_value<SchemaNumber>(PrimitiveConverter(value))) {}
+Schema::Schema(float &value) : m_ptr(make_value<SchemaNumber>(PrimitiveConverter(value))) {}
+Schema::Schema(double &value) : m_ptr(make_value<SchemaNumber>(PrimitiveConverter(value))) {}
+Schema::Schema(bool &value) : m_ptr(make_value<SchemaBoolean>(PrimitiveConverter(value))) {}
+Schema::Schema(std::string &value) : m_ptr(make_value<SchemaString>(PrimitiveConverter(value))) {}
+Schema::Schema(std::string_view &value) : m_ptr(make_value<SchemaString>(PrimitiveConverter(value))) {}
+Schema::Schema(const Schema::array &desc)  : m_ptr(make_value<SchemaArray>(desc)) {}
+Schema::Schema(const Schema::object &values) : m_ptr(make_value<SchemaObject>(values)) {}
+Schema::Schema(Schema::object &&values)      : m_ptr(make_value<SchemaObject>(move(values))) {}
+Schema::Schema(const TypeSchemaBase &schema, void *object) : m_ptr(make_value<SchemaTyped>(schema, object)) {}
+
+Schema::Schema(Schema::Type type, const ValueConverter &converter) {
+    switch (type) {
+    case NUL:    m_ptr = make_value<SchemaConverted<NUL>>(converter);    break;
+    case NUMBER: m_ptr = make_value<SchemaConverted<NUMBER>>(converter); break;
+    case BOOL:   m_ptr = make_value<SchemaConverted<BOOL>>(converter);   break;
+    case STRING: m_ptr = make_value<SchemaConverted<STRING>>(converter); break;
+    case ARRAY:  m_ptr = make_value<SchemaConverted<ARRAY>>(converter);  break;
+    case OBJECT: m_ptr = make_value<SchemaConverted<OBJECT>>(converter); break;
+    }
+}
+
+template <>
+Schema::array ArraySchema<bool>(std::vector<bool> & array, std::function<Schema(bool &)> schema)
+{
+    // A Schema for element i, converting through a scratch bool bound by schema.
+    const auto element = [&array, schema](size_t i) {
+        const auto scratch = make_shared<bool>(false);
+        const Schema bound = schema(*scratch);
+        ValueConverter converter;
+        converter.from_json = [&array, i, scratch, bound](const Json &json) {
+            bound.from_json(json);
+            array[i] = *scratch;
+        };
+        converter.to_json = [&array, i, scratch, bound](Json &json) {
+            *scratch = array[i];
+            bound.to_json(json);
+        };
+        return Schema(bound.type(), converter);
+    };
+
+    Schema::array desc;
+    desc.reserve = [&array](size_t n) {
+        array.reserve(array.size() + n);
+    };
+    desc.append = [&array, element] {
+        array.push_back(false);
+        return element(array.size() - 1);
+    };
+    desc.clear = [&array] {
+        array.clear();
+    };
+    desc.size = [&array] {
+        return array.size();
+    };
+    desc.at = element;
+    return desc;
+}
+
+/* * * * * * * * * * * * * * * * * * * *
+ * Object fields
+ */
+
+Schema::object::object(initializer_list<value_type> items) : m_items(items) {
+    sort();
+}
+
+void Schema::object::sort() {
+    // Stable, so that the first of several duplicate keys is the one kept
+    std::stable_sort(m_items.begin(), m_items.end(), [](const value_type &a, const value_type &b) {
+        return a.first < b.first;
+    });
+    m_items.erase(std::unique(m_items.begin(), m_items.end(), [](const value_type &a, const value_type &b) {
+        return a.first == b.first;
+    }), m_items.end());
+}
+
+Schema::object::const_iterator Schema::object::find(const string &key) const {
+    // A key that was never interned cannot be a field
+    Symbol symbol;
+    if (!Symbol::Lookup(key.data(), key.size(), symbol))
+        return m_items.end();
+
+    // Small objects are faster to scan, comparing symbols, than to bisect
+    if (m_items.size() <= 8) {
+        for (auto it = m_items.begin(); it != m_items.end(); ++it) {
+            if (it->first == symbol)
+                return it;
+        }
+        return m_items.end();
+    }
+
+    const auto it = std::lower_bound(m_items.begin(), m_items.end(), symbol,
+        [](const value_type &item, Symbol key) { return item.first < key; });
+    return (it != m_items.end() && it->first == symbol) ? it : m_items.end();
+}
+
+bool Schema::object::insert(value_type item) {
+    const auto it = std::lower_bound(m_items.begin(), m_items.end(), item.first,
+        [](const value_type &existing, Symbol key) { return existing.first < key; });
+    if (it != m_items.end() && it->first == item.first)
+        return false;
+    m_items.insert(it, move(item));
+    return true;
+}
+
+/* * * * * * * * * * * * * * * * * * * *
+ * Accessors
+ */
+
+Schema::Type Schema::type()                           const { return m_ptr->type();         }
+// double Schema::number_value()                       const { return m_ptr->number_value(); }
+// int Schema::int_value()                             const { return m_ptr->int_value();    }
+// bool Schema::bool_value()                           const { return m_ptr->bool_value();   }
+// const string & Schema::string_value()               const { return m_ptr->string_value(); }
+// const vector<Schema> & Schema::array_items()          const { return m_ptr->array_items();  }
+const Schema::object & Schema::object_items()         const { return m_ptr->object_items(); }
+const Schema & Schema::operator[] (size_t i)          const { return (*m_ptr)[i];           }
+const Schema & Schema::operator[] (const string &key) const { return (*m_ptr)[key];         }
+
+// double                    SchemaValue::number_value()              const { return 0; }
+// int                       SchemaValue::int_value()                 const { return 0; }
+// bool                      SchemaValue::bool_value()                const { return false; }
+// const string &            SchemaValue::string_value()              const { return statics().empty_string; }
+// const vector<Schema> &      SchemaValue::array_items()               const { return statics().empty_vector; }
+const Schema::object &      SchemaValue::object_items()              const { return statics().empty_object; }
+const Schema &              SchemaValue::operator[] (size_t)         const { return static_null(); }
+const Schema &              SchemaValue::operator[] (const string &) const { return static_null(); }
+
+const Schema & SchemaObject::operator[] (const string &key) const {
+    const Schema *field = find(key);
+    return field ? *field : static_null();
+}
+// const Schema & SchemaArray::operator[] (size_t i) const {
+//     if (i >= m_value.size()) return static_null();
+//     else return m_value[i];
+// }
+
+/* * * * * * * * * * * * * * * * * * * *
+ * Comparison
+ */
+
+bool Schema::operator== (const Schema &other) const {
+    if (m_ptr->type() != other.m_ptr->type())
+        return false;
+
+    return m_ptr->equals(other.m_ptr.get());
+}
+
+bool Schema::operator< (const Schema &other) const {
+    if (m_ptr->type() != other.m_ptr->type())
+        return m_ptr->type() < other.m_ptr->type();
+
+    return m_ptr->less(other.m_ptr.get());
+}
+
+void Schema::from_json(const json11::Json &json) const
+{
+	m_ptr->from_json(json);
+}
+
+void Schema::to_json(json11::Json &json) const
+{
+	m_ptr->to_json(json);
+}
+
+bool Schema::merge_patch(const json11::Json &patch, string &err) const
+{
+	return m_ptr->merge_patch(patch, nullptr, err);
+}
+
+bool Schema::merge_patch(const json11::Json &patch, DirtyMask &dirty, string &err) const
+{
+	return m_ptr->merge_patch(patch, &dirty, err);
+}
+
+/* * * * * * * * * * * * * * * * * * * *
+ * Dirty masks
+ */
+
+void DirtyMask::resize(size_t n)
+{
+	if (n <= m_size)
+		return;
+	m_words.resize((n + 63) / 64);
+	m_size = n;
+}
+
+void DirtyMask::set_all(size_t n)
+{
+	resize(n);
+	for (size_t i = 0; i < n / 64; i++)
+		m_words[i] = ~uint64_t(0);
+	if (n % 64)
+		m_words[n / 64] |= (uint64_t(1) << (n % 64)) - 1;
+}
+
+void DirtyMask::clear()
+{
+	std::fill(m_words.begin(), m_words.end(), 0);
+}
+
+bool DirtyMask::any() const
+{
+	for (uint64_t word : m_words)
+		if (word)
+			return true;
+	return false;
+}
+
+size_t DirtyMask::count() const
+{
+	size_t result = 0;
+	for (uint64_t word : m_words)
+		result += std::bitset<64>(word).count();
+	return result;
+}
+
+/* * * * * * * * * * * * * * * * * * * *
+ * Compilation
+ */
+
+CompiledSchema Schema::compile() const
+{
+	return CompiledSchema(*this);
+}
+
+CompiledSchema::CompiledSchema(const Schema &schema) : m_schema(schema), m_program(1)
+{
+	compile(m_schema, 0);
+}
+
+void CompiledSchema::compile(const Schema &schema, size_t index)
+{
+	schema.m_ptr->compile(m_program[index]);
+	if (m_program[index].op != OBJECT)
+		return;
+
+	// Lay the fields out contiguously before compiling them, so that nested objects
+	// append their own fields after this range.
+	const auto &items = schema.object_items();
+	const size_t first = m_program.size();
+	m_program.resize(first + items.size());
+	m_program[index].first_child = static_cast<uint32_t>(first);
+	m_program[index].end_child = static_cast<uint32_t>(first + items.size());
+
+	size_t child = first;
+	for (const auto &item : items) {
+		m_program[child].key = item.first;
+		compile(item.second, child);
+		child++;
+	}
+}
+
+void CompiledSchema::from_json(const Json &json) const
+{
+	run(0, json);
+}
+
+void CompiledSchema::run(size_t index, const Json &json) const
+{
+	const Instruction &instruction = m_program[index];
+	switch (instruction.op) {
+	case NUL:
+		break;
+	case INT:
+		primitive_from_json(ValueConverter::INT, instruction.target, json);
+		break;
+	case BOOL:
+		primitive_from_json(ValueConverter::BOOL, instruction.target, json);
+		break;
+	case FLOAT:
+		primitive_from_json(ValueConverter::FLOAT, instruction.target, json);
+		break;
+	case DOUBLE:
+		primitive_from_json(ValueConverter::DOUBLE, instruction.target, json);
+		break;
+	case STRING:
+		primitive_from_json(ValueConverter::STRING, instruction.target, json);
+		break;
+	case CUSTOM:
+		instruction.converter->from_json(json);
+		break;
+	case ARRAY:
+		array_from_json(*instruction.array, json);
+		break;
+	case OBJECT:
+		merge_fields(m_program.begin() + instruction.first_child, m_program.begin() + instruction.end_child,
+			[](const Instruction &child) -> const string & { return child.key.str(); },
+			json,
+			[this](const Instruction &child, const Json &childJson) { run(&child - m_program.data(), childJson); });
+		break;
+	}
+}
+
+/* * * * * * * * * * * * * * * * * * * *
+ * Type schemas
+ */
+
+constexpr ValueConverter::Kind PrimitiveKind<int>::kind;
+constexpr Schema::Type PrimitiveKind<int>::type;
+constexpr ValueConverter::Kind PrimitiveKind<bool>::kind;
+constexpr Schema::Type PrimitiveKind<bool>::type;
+constexpr ValueConverter::Kind PrimitiveKind<float>::kind;
+constexpr Schema::Type PrimitiveKind<float>::type;
+constexpr ValueConverter::Kind PrimitiveKind<double>::kind;
+constexpr Schema::Type PrimitiveKind<double>::type;
+constexpr ValueConverter::Kind PrimitiveKind<string>::kind;
+constexpr Schema::Type PrimitiveKind<string>::type;
+
+static bool field_less(const std::shared_ptr<const TypeSchemaBase::Field> &lhs,
+                       const std::shared_ptr<const TypeSchemaBase::Field> &rhs) {
+    return lhs->key < rhs->key;
+}
+
+static vector<Symbol> field_keys(const TypeSchemaBase::fields_type &fields) {
+    vector<Symbol> keys;
+    keys.reserve(fields.size());
+    for (const auto &field : fields)
+        keys.push_back(field->key);
+    return keys;
+}
+
+TypeSchemaBase::TypeSchemaBase(fields_type fields)
+{
+	std::stable_sort(fields.begin(), fields.end(), field_less);
+	m_fields = make_shared<const fields_type>(move(fields));
+	m_keys = make_shared<const KeyTable>(field_keys(*m_fields));
+}
+
+const TypeSchemaBase::Field *TypeSchemaBase::find(const char *key, size_t length) const
+{
+	const int slot = m_keys->find(key, length);
+	return slot < 0 ? nullptr : (*m_fields)[slot].get();
+}
+
+/* field_from_json(field, object, value)
+ *
+ * Decode value into one field of object, replacing its previous contents.
+ */
+static void field_from_json(const TypeSchemaBase::Field &field, void *object, const Json &value) {
+	switch (field.type) {
+	case Schema::OBJECT:
+		field.schema->from_json(field.target(object), value);
+		break;
+	case Schema::ARRAY:
+		field.clear(object);
+		field.reserve(object, value.array_items().size());
+		for (const auto &itemJson : value.array_items()) {
+			void *element = field.append(object);
+			if (field.schema)
+				field.schema->from_json(element, itemJson);
+			else
+				primitive_from_json(field.kind, element, itemJson);
+		}
+		break;
+	default:
+		primitive_from_json(field.kind, field.target(object), value);
+		break;
+	}
+}
+
+void TypeSchemaBase::from_json(void *object, const Json &json) const
+{
+	merge_fields(m_fields->begin(), m_fields->end(),
+		[](const std::shared_ptr<const Field> &field) -> const string & { return field->key.str(); },
+		json,
+		[object](const std::shared_ptr<const Field> &field, const Json &value) {
+			field_from_json(*field, object, value);
+		});
+}
+
+void TypeSchemaBase::merge_patch(void *object, const Json &patch, DirtyMask *dirty) const
+{
+	if (!patch.is_object()) {
+		from_json(object, patch);
+		if (dirty)
+			dirty->set_all(m_fields->size());
+		return;
+	}
+
+	if (dirty)
+		dirty->resize(m_fields->size());
+	for (const auto &item : patch.object_items()) {
+		const int slot = m_keys->find(item.first.data(), item.first.size());
+		if (slot < 0)
+			continue;
+		const Field &field = *(*m_fields)[slot];
+		if (field.type == Schema::OBJECT && item.second.is_object())
+			field.schema->merge_patch(field.target(object), item.second, nullptr);
+		else
+			field_from_json(field, object, item.second);
+		if (dirty)
+			dirty->set(slot);
+	}
+}
+
+/* field_to_json(field, object, value)
+ *
+ * Encode one field of object into value.
+ */
+static void field_to_json(const TypeSchemaBase::Field &field, const void *object, Json &value) {
+	// Fields only read through the object, so dropping const here is safe.
+	void *mutable_object = const_cast<void *>(object);
+	switch (field.type) {
+	case Schema::OBJECT:
+		field.schema->to_json(field.target(mutable_object), value);
+		break;
+	case Schema::ARRAY: {
+		Json::array elements(field.size(mutable_object));
+		for (size_t i = 0; i < elements.size(); i++) {
+			void *element = field.element(mutable_object, i);
+			if (field.schema)
+				field.schema->to_json(element, elements[i]);
+			else
+				primitive_to_json(field.kind, element, elements[i]);
+		}
+		value = Json(move(elements));
+		break;
+	}
+	default:
+		primitive_to_json(field.kind, field.target(mutable_object), value);
+		break;
+	}
+}
+
+void TypeSchemaBase::to_json(const void *object, Json &json) const
+{
+	Json::object items;
+	for (const auto &field : *m_fields) {
+		Json value;
+		field_to_json(*field, object, value);
+		items.emplace_hint(items.end(), field->key.str(), move(value));
+	}
+	json = Json(move(items));
+}
+
+/* field_dump(field, object, out)
+ *
+ * Append the JSON text of one field of object to out.
+ */
+static void field_dump(const TypeSchemaBase::Field &field, const void *object, string &out) {
+	void *mutable_object = const_cast<void *>(object);
+	switch (field.type) {
+	case Schema::OBJECT:
+		field.schema->dump(field.target(mutable_object), out);
+		break;
+	case Schema::ARRAY: {
+		const size_t size = field.size(mutable_object);
+		out += "[";
+		for (size_t i = 0; i < size; i++) {
+			if (i)
+				out += ", ";
+			void *element = field.element(mutable_object, i);
+			if (field.schema)
+				field.schema->dump(element, out);
+			else
+				primitive_dump(field.kind, element, out);
+		}
+		out += "]";
+		break;
+	}
+	default:
+		primitive_dump(field.kind, field.target(mutable_object), out);
+		break;
+	}
+}
+
+void TypeSchemaBase::dump(const void *object, string &out) const
+{
+	bool first = true;
+	out += "{";
+	for (const auto &field : *m_fields) {
+		if (!first)
+			out += ", ";
+		schema11::dump(field->key.str(), out);
+		out += ": ";
+		field_dump(*field, object, out);
+		first = false;
+	}
+	out += "}";
+}
+
+size_t TypeSchemaBase::dump_size(const void *object) const
+{
+	void *mutable_object = const_cast<void *>(object);
+	size_t size = 2 + (m_fields->empty() ? 0 : 2 * (m_fields->size() - 1));
+	for (const auto &field : *m_fields) {
+		size += schema11::dump_size(field->key.str()) + 2;
+		switch (field->type) {
+		case Schema::OBJECT:
+			size += field->schema->dump_size(field->target(mutable_object));
+			break;
+		case Schema::ARRAY: {
+			const size_t count = field->size(mutable_object);
+			size += 2 + (count ? 2 * (count - 1) : 0);
+			for (size_t i = 0; i < count; i++) {
+				void *element = field->element(mutable_object, i);
+				if (field->schema)
+					size += field->schema->dump_size(element);
+				else
+					size += primitive_dump_size(field->kind, element);
+			}
+			break;
+		}
+		default:
+			size += primitive_dump_size(field->kind, field->target(mutable_object));
+			break;
+		}
+	}
+	return size;
+}
+
+/* * * * * * * * * * * * * * * * * * * *
+ * Delta encoding
+ */
+
+// Whether json is written as null: json11 writes numbers that are not finite as null.
+static bool encodes_as_null(const Json &json) {
+    return json.is_null() || (json.is_number() && !std::isfinite(json.number_value()));
+}
+
+/* DeltaEncoder
+ *
+ * Walks a schema alongside its DeltaBaseline, comparing each value against what was last
+ * sent and building a merge patch of the ones that changed.
+ */
+struct DeltaEncoder {
+    string scratch;     // The encoding of the value being hashed
+
+    static uint64_t hash(const string &text) {
+        uint64_t result = 14695981039346656037u;
+        for (char c : text) {
+            result ^= static_cast<uint8_t>(c);
+            result *= 1099511628211u;
+        }
+        return result;
+    }
+
+    // Hash a value as dump(out) encodes it. If that differs from baseline, record it and
+    // encode the value into patch with to_json(patch). A value that encodes as null (a
+    // null field, or a NaN) would delete its field from the receiver's copy, so it is
+    // left out, and baseline kept, until it changes to something else.
+    template <class Dump, class ToJson>
+    bool value(DeltaBaseline &baseline, Dump dump, ToJson to_json, Json &patch) {
+        scratch.clear();
+        dump(scratch);
+        if (scratch == "null")
+            return false;
+        const uint64_t value_hash = hash(scratch);
+        if (baseline.m_sent && baseline.m_hash == value_hash)
+            return false;
+        baseline.m_sent = true;
+        baseline.m_hash = value_hash;
+        to_json(patch);
+        return true;
+    }
+
+    // Objects behind custom converters keep their last JSON, so that a member they drop
+    // can be sent as a null.
+    bool custom(const ValueConverter &converter, DeltaBaseline &baseline, Json &patch) {
+        auto json = make_shared<Json>();
+        converter.to_json(*json);
+        if (baseline.m_json && *baseline.m_json == *json)
+            return false;
+        patch = baseline.m_json ? merge_diff_json(*baseline.m_json, *json) : *json;
+        baseline.m_sent = true;
+        baseline.m_json = move(json);
+        return true;
+    }
+
+    bool schema(const Schema &schema, DeltaBaseline &baseline, Json &patch) {
+        return schema.m_ptr->delta(*this, baseline, patch);
+    }
+
+    // Collect the fields in [begin, end) for which fn(field, field_baseline, field_patch)
+    // reports a change. An object that was never sent counts as changed even if empty.
+    template <typename Iter, typename KeyOf, typename Fn>
+    bool object(Iter begin, Iter end, KeyOf key_of, DeltaBaseline &baseline, Json &patch, Fn fn) {
+        const bool first = !baseline.m_sent;
+        baseline.m_sent = true;
+        baseline.m_fields.resize(end - begin);
+
+        Json::object items;
+        auto field_baseline = baseline.m_fields.begin();
+        for (auto field = begin; field != end; ++field, ++field_baseline) {
+            Json value;
+            if (fn(*field, *field_baseline, value))
+                items.emplace_hint(items.end(), key_of(*field), move(value));
+        }
+        const bool changed = first || !items.empty();
+        patch = Json(move(items));
+        return changed;
+    }
+
+    bool typed(const TypeSchemaBase &schema, const void *object, DeltaBaseline &baseline, Json &patch) {
+        // Fields only read through the object, so dropping const here is safe.
+        void *mutable_object = const_cast<void *>(object);
+        return this->object(schema.fields().begin(), schema.fields().end(),
+            [](const std::shared_ptr<const TypeSchemaBase::Field> &field) -> const string & { return field->key.str(); },
+            baseline, patch,
+            [this, mutable_object](const std::shared_ptr<const TypeSchemaBase::Field> &field,
+                                   DeltaBaseline &field_baseline, Json &field_patch) {
+                if (field->type == Schema::OBJECT)
+                    return typed(*field->schema, field->target(mutable_object), field_baseline, field_patch);
+                return value(field_baseline,
+                    [&field, mutable_object](string &out) { field_dump(*field, mutable_object, out); },
+                    [&field, mutable_object](Json &json) { field_to_json(*field, mutable_object, json); },
+                    field_patch);
+            });
+    }
+};
+
+template <Schema::Type tag>
+bool Value<tag>::delta(DeltaEncoder &encoder, DeltaBaseline &baseline, Json &patch) const {
+    if (tag == Schema::OBJECT && m_valueConverter.kind == ValueConverter::CUSTOM)
+        return encoder.custom(m_valueConverter, baseline, patch);
+    return encoder.value(baseline,
+        [this](string &out) { dump(out); },
+        [this](Json &json) { to_json(json); },
+        patch);
+}
+
+// Only objects have fields to mark dirty, so any other value has nothing to send.
+template <Schema::Type tag>
+void Value<tag>::delta(const DirtyMask &, Json &patch) const {
+    patch = Json(Json::object());
+}
+
+bool SchemaObject::delta(DeltaEncoder &encoder, DeltaBaseline &baseline, Json &patch) const {
+    return encoder.object(m_value.begin(), m_value.end(),
+        [](const Schema::object::value_type &value) -> const string & { return value.first.str(); },
+        baseline, patch,
+        [&encoder](const Schema::object::value_type &value, DeltaBaseline &field_baseline, Json &field_patch) {
+            return encoder.schema(value.second, field_baseline, field_patch);
+        });
+}
+
+bool SchemaTyped::delta(DeltaEncoder &encoder, DeltaBaseline &baseline, Json &patch) const {
+    return encoder.typed(m_schema, m_object, baseline, patch);
+}
+
+// As in DeltaEncoder::value, fields whose value is null are left out.
+void SchemaObject::delta(const DirtyMask &dirty, Json &patch) const {
+    Json::object items;
+    size_t slot = 0;
+    for (const auto &field : m_value) {
+        if (dirty.test(slot++)) {
+            Json value;
+            field.second.to_json(value);
+            if (!encodes_as_null(value))
+                items.emplace_hint(items.end(), field.first.str(), move(value));
+        }
+    }
+    patch = Json(move(items));
+}
+
+void SchemaTyped::delta(const DirtyMask &dirty, Json &patch) const {
+    m_schema.to_json_delta(m_object, dirty, patch);
+}
+
+bool Schema::to_json_delta(DeltaBaseline &baseline, Json &patch) const {
+    DeltaEncoder encoder;
+    if (encoder.schema(*this, baseline, patch))
+        return true;
+    patch = Json(Json::object());
+    return false;
+}
+
+void Schema::to_json_delta(const DirtyMask &dirty, Json &patch) const {
+    m_ptr->delta(dirty, patch);
+}
+
+bool TypeSchemaBase::to_json_delta(const void *object, DeltaBaseline &baseline, Json &patch) const {
+    DeltaEncoder encoder;
+    return encoder.typed(*this, object, baseline, patch);
+}
+
+void TypeSchemaBase::to_json_delta(const void *object, const DirtyMask &dirty, Json &patch) const {
+    Json::object items;
+    for (size_t slot = 0; slot < m_fields->size(); slot++) {
+        if (dirty.test(slot)) {
+            const Field &field = *(*m_fields)[slot];
+            Json value;
+            field_to_json(field, object, value);
+            if (!encodes_as_null(value))
+                items.emplace_hint(items.end(), field.key.str(), move(value));
+        }
+    }
+    patch = Json(move(items));
+}
+
+/* * * * * * * * * * * * * * * * * * * *
+ * Structural index
+ */
+
+/* StructuralBlock
+ *
+ * One 64-byte block of input, classified: bit n of each mask is set if byte n is a quote,
+ * a backslash, or one of '{', '}', '[', ']', ':' and ',', respectively.
+ */
+struct StructuralBlock {
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t structural;
+};
+
+typedef void (*ClassifyBlock)(const char *block, StructuralBlock &out);
+
+static void classify_scalar(const char *block, StructuralBlock &out) {
+    out = StructuralBlock { 0, 0, 0 };
+    for (unsigned n = 0; n < 64; n++) {
+        const char ch = block[n];
+        const char folded = static_cast<char>(ch | 0x20);
+        const uint64_t bit = uint64_t(1) << n;
+        if (ch == '"')
+            out.quote |= bit;
+        else if (ch == '\\')
+            out.backslash |= bit;
+        else if (folded == '{' || folded == '}' || ch == ':' || ch == ',')
+            out.structural |= bit;
+    }
+}
+
+#if defined(__SSE2__) || defined(_M_X64)
+static void classify_sse2(const char *block, StructuralBlock &out) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    const __m128i open = _mm_set1_epi8('{');
+    const __m128i close = _mm_set1_epi8('}');
+    const __m128i colon = _mm_set1_epi8(':');
+    const __m128i comma = _mm_set1_epi8(',');
+    out = StructuralBlock { 0, 0, 0 };
+    for (unsigned n = 0; n < 64; n += 16) {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + n));
+        const __m128i folded = _mm_or_si128(chunk, case_bit);
+        const __m128i structural = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(folded, open), _mm_cmpeq_epi8(folded, close)),
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, colon), _mm_cmpeq_epi8(chunk, comma)));
+        out.quote |= uint64_t(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, quote)))) << n;
+        out.backslash |= uint64_t(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, backslash)))) << n;
+        out.structural |= uint64_t(static_cast<uint16_t>(_mm_movemask_epi8(structural))) << n;
+    }
+}
+#endif
+
+// AVX2 is compiled in whenever the compiler can target it, and used only if the CPU
+// running the code supports it.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCHEMA11_HAVE_AVX2 1
+#define SCHEMA11_TARGET_AVX2 __attribute__((target("avx2")))
+static bool cpu_has_avx2() { return __builtin_cpu_supports("avx2"); }
+#elif defined(__AVX2__)
+#define SCHEMA11_HAVE_AVX2 1
+#define SCHEMA11_TARGET_AVX2
+static bool cpu_has_avx2() { return true; }
+#endif
+
+#if defined(SCHEMA11_HAVE_AVX2)
+SCHEMA11_TARGET_AVX2
+static void classify_avx2(const char *block, StructuralBlock &out) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i case_bit = _mm256_set1_epi8(0x20);
+    const __m256i open = _mm256_set1_epi8('{');
+    const __m256i close = _mm256_set1_epi8('}');
+    const __m256i colon = _mm256_set1_epi8(':');
+    const __m256i comma = _mm256_set1_epi8(',');
+    out = StructuralBlock { 0, 0, 0 };
+    for (unsigned n = 0; n < 64; n += 32) {
+        const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block + n));
+        const __m256i folded = _mm256_or_si256(chunk, case_bit);
+        const __m256i structural = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(folded, open), _mm256_cmpeq_epi8(folded, close)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, colon), _mm256_cmpeq_epi8(chunk, comma)));
+        out.quote |= uint64_t(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, quote)))) << n;
+        out.backslash |= uint64_t(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, backslash)))) << n;
+        out.structural |= uint64_t(static_cast<uint32_t>(_mm256_movemask_epi8(structural))) << n;
+    }
+}
+#endif
+
+StructuralIndex::Implementation StructuralIndex::best() {
+#if defined(SCHEMA11_HAVE_AVX2)
+    static const bool avx2 = cpu_has_avx2();
+    if (avx2)
+        return AVX2;
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+    return SSE2;
+#else
+    return SCALAR;
+#endif
+}
+
+static ClassifyBlock classifier(StructuralIndex::Implementation implementation) {
+    const StructuralIndex::Implementation supported = StructuralIndex::best();
+    if (implementation == StructuralIndex::AUTO || implementation > supported)
+        implementation = supported;
+    switch (implementation) {
+#if defined(SCHEMA11_HAVE_AVX2)
+    case StructuralIndex::AVX2:
+        return classify_avx2;
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+    case StructuralIndex::SSE2:
+        return classify_sse2;
+#endif
+    default:
+        return classify_scalar;
+    }
+}
+
+/* escaped_bits(backslash, carry)
+ *
+ * Return the mask of bytes in a block that are escaped by a backslash. A backslash that
+ * is itself escaped escapes nothing, so runs of them pair up. carry is the escape pending
+ * from the end of the previous block on entry, and the one pending from the end of this
+ * block on return. Backslashes are rare outside pathological input, so they are paired
+ * one at a time rather than with the carry arithmetic simdjson uses.
+ */
+static inline uint64_t escaped_bits(uint64_t backslash, bool &carry) {
+    uint64_t escaped = carry ? 1 : 0;
+    backslash &= ~escaped;
+    carry = false;
+    while (backslash) {
+        const unsigned n = trailing_zeros(backslash);
+        if (n == 63) {
+            carry = true;
+            break;
+        }
+        escaped |= uint64_t(2) << n;
+        backslash &= ~(uint64_t(3) << n);
+    }
+    return escaped;
+}
+
+/* prefix_xor(bits)
+ *
+ * Bit n of the result is the parity of bits 0 through n: given the unescaped quotes of a
+ * block, the bytes from each opening quote up to (not including) its closing quote.
+ */
+static inline uint64_t prefix_xor(uint64_t bits) {
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    bits ^= bits << 32;
+    return bits;
+}
+
+/* StructuralScanner
+ *
+ * Builds a structural index incrementally, carrying the escape and in-string state from
+ * one 64-byte block to the next. start() must be given an offset outside any string.
+ * Positions are offsets into data, which must be shorter than 4 GiB.
+ */
+struct StructuralScanner {
+    const char *data = nullptr;
+    size_t len = 0;
+    size_t offset = 0;          // Indexed up to here
+    bool escape = false;        // The byte at offset is escaped
+    uint64_t in_string = 0;     // All ones if offset is inside a string
+    ClassifyBlock classify = classify_scalar;
+
+    void start(const char *data_, size_t len_, size_t offset_, ClassifyBlock classify_) {
+        data = data_;
+        len = len_;
+        offset = offset_;
+        escape = false;
+        in_string = 0;
+        classify = classify_;
+    }
+
+    // Index up to bytes more input, rounded up to a whole block, appending the positions
+    // found to out. Return false if the input was already fully indexed.
+    bool scan(size_t bytes, vector<uint32_t> &out) {
+        if (offset >= len)
+            return false;
+        const size_t end = std::min(len, offset + bytes);
+        for (; offset < end; offset += 64) {
+            const char *block = data + offset;
+            char tail[64];
+            if (len - offset < 64) {
+                std::memset(tail, ' ', sizeof(tail));
+                std::memcpy(tail, block, len - offset);
+                block = tail;
+            }
+
+            StructuralBlock bits;
+            classify(block, bits);
+            const uint64_t quotes = bits.quote & ~escaped_bits(bits.backslash, escape);
+            const uint64_t string_bits = prefix_xor(quotes) ^ in_string;
+            in_string = 0 - (string_bits >> 63);
+
+            uint64_t found = (bits.structural & ~string_bits) | (quotes & string_bits);
+            while (found) {
+                out.push_back(static_cast<uint32_t>(offset + trailing_zeros(found)));
+                found &= found - 1;
+            }
+        }
+        offset = std::min(offset, len);
+        return true;
+    }
+};
+
+bool StructuralIndex::build(const char *data, size_t len) {
+    m_positions.clear();
+    if (len > std::numeric_limits<uint32_t>::max())
+        return false;
+
+    StructuralScanner scanner;
+    scanner.start(data, len, 0, classifier(m_implementation));
+    scanner.scan(len, m_positions);
+    return !scanner.in_string;
+}
+
+/* * * * * * * * * * * * * * * * * * * *
+ * Parsing
+ */
+
+/* esc(c)
+ *
+ * Format char c suitable for printing in an error message.
+ */
+static inline string esc(char c) {
+    char buf[12];
+    if (static_cast<uint8_t>(c) >= 0x20 && static_cast<uint8_t>(c) <= 0x7f) {
+        snprintf(buf, sizeof buf, "'%c' (%d)", c, c);
+    } else {
+        snprintf(buf, sizeof buf, "(%d)", c);
+    }
+    return string(buf);
+}
+
+static inline bool in_range(long x, long lower, long upper) {
+    return (x >= lower && x <= upper);
+}
+
+/* find_structural(data, i, n)
+ *
+ * Return the index of the first '"', '[', ']', '{' or '}' in [i, n), or n. Used to skip
+ * unbound values: everything else in between can be stepped over without looking at it.
+ * '[' | 0x20 == '{' and ']' | 0x20 == '}', so three compares cover all five.
+ */
+static inline size_t find_structural(const char *data, size_t i, size_t n) {
+#if defined(__SSE2__) || defined(_M_X64)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    const __m128i open = _mm_set1_epi8('{');
+    const __m128i close = _mm_set1_epi8('}');
+    for (; i + 16 <= n; i += 16) {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        const __m128i folded = _mm_or_si128(chunk, case_bit);
+        const __m128i special = _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+            _mm_or_si128(_mm_cmpeq_epi8(folded, open), _mm_cmpeq_epi8(folded, close)));
+        const uint32_t bits = static_cast<uint32_t>(_mm_movemask_epi8(special));
+        if (bits)
+            return i + trailing_zeros(bits);
+    }
+#endif
+    for (; i < n; i++) {
+        const char folded = static_cast<char>(data[i] | 0x20);
+        if (data[i] == '"' || folded == '{' || folded == '}')
+            return i;
+    }
+    return n;
+}
+
+/* find_quote(data, i, n)
+ *
+ * Return the index of the first '"' or '\\' in [i, n), or n.
+ */
+static inline size_t find_quote(const char *data, size_t i, size_t n) {
+#if defined(__SSE2__) || defined(_M_X64)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    for (; i + 16 <= n; i += 16) {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        const __m128i special = _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash));
+        const uint32_t bits = static_cast<uint32_t>(_mm_movemask_epi8(special));
+        if (bits)
+            return i + trailing_zeros(bits);
+    }
+#endif
+    for (; i < n; i++) {
+        if (data[i] == '"' || data[i] == '\\')
+            return i;
+    }
+    return n;
+}
+
+// Inputs at least this long skip unbound containers through a structural index, built
+// min_scan_chunk bytes at first and up to max_scan_chunk bytes at a time after that.
+static const size_t index_threshold = 64 * 1024;
+static const size_t min_scan_chunk = 256;
+static const size_t max_scan_chunk = 64 * 1024;
+
+/* SchemaParser
+ *
+ * Object that tracks all state of an in-progress parse. Unlike json11's parser, it does
+ * not produce a tree: values are written into the targets bound by the schema as they
+ * are read, and everything else is validated and skipped.
+ */
+struct SchemaParser {
+
+    /* State
+     */
+    const char *str;
+    size_t len;
+    size_t i;
+    string &err;
+    bool failed;
+    string key;
+    string scratch;     // Escaped strings bound to string_views, decoded
+    bool copy_views = false;    // The input is released after parsing, so views cannot point into it
+
+    // Structural index of the input past the first container skipped, for large inputs.
+    // Positions before next_structural have been walked.
+    StructuralScanner scanner;
+    vector<uint32_t> structurals;
+    size_t next_structural = 0;
+    size_t scan_chunk = 0;
+
+    SchemaParser(const char *str, size_t len, string &err)
+        : str(str), len(len), i(0), err(err), failed(false) {}
+
+    /* fail(msg, err_ret = false)
+     *
+     * Mark this parse as failed.
+     */
+    bool fail(string &&msg) {
+        return fail(move(msg), false);
+    }
+
+    template <typename T>
+    T fail(string &&msg, const T err_ret) {
+        if (!failed)
+            err = std::move(msg);
+        failed = true;
+        return err_ret;
+    }
+
+    /* peek(), peek(n)
+     *
+     * Return the character at the current position (or n past it), or 0 past the end of
+     * the input. The input is not required to be NUL-terminated.
+     */
+    char peek() const {
+        return i < len ? str[i] : 0;
+    }
+
+    char peek(size_t n) const {
+        return i + n < len ? str[i + n] : 0;
+    }
+
+    /* consume_whitespace()
+     *
+     * Advance until the current character is non-whitespace.
+     */
+    void consume_whitespace() {
+        while (i < len && (str[i] == ' ' || str[i] == '\r' || str[i] == '\n' || str[i] == '\t'))
+            i++;
+    }
+
+    /* get_next_token()
+     *
+     * Return the next non-whitespace character. If the end of the input is reached,
+     * flag an error and return 0.
+     */
+    char get_next_token() {
+        consume_whitespace();
+        if (i == len)
+            return fail("unexpected end of input", 0);
+
+        return str[i++];
+    }
+
+    /* encode_utf8(pt, out)
+     *
+     * Encode pt as UTF-8 and add it to out.
+     */
+    void encode_utf8(long pt, string & out) {
+        if (pt < 0)
+            return;
+
+        if (pt < 0x80) {
+            out += static_cast<char>(pt);
+        } else if (pt < 0x800) {
+            out += static_cast<char>((pt >> 6) | 0xC0);
+            out += static_cast<char>((pt & 0x3F) | 0x80);
+        } else if (pt < 0x10000) {
+            out += static_cast<char>((pt >> 12) | 0xE0);
+            out += static_cast<char>(((pt >> 6) & 0x3F) | 0x80);
+            out += static_cast<char>((pt & 0x3F) | 0x80);
+        } else {
+            out += static_cast<char>((pt >> 18) | 0xF0);
+            out += static_cast<char>(((pt >> 12) & 0x3F) | 0x80);
+            out += static_cast<char>(((pt >> 6) & 0x3F) | 0x80);
+            out += static_cast<char>((pt & 0x3F) | 0x80);
+        }
+    }
+
+    /* parse_hex4()
+     *
+     * Parse the four hex digits of a \u escape, starting at the current position.
+     */
+    long parse_hex4() {
+        if (len - i < 4)
+            return fail("bad \\u escape: " + string(str + i, len - i), -1L);
+        long codepoint = 0;
+        for (int j = 0; j < 4; j++) {
+            const char ch = str[i + j];
+            long digit;
+            if (in_range(ch, '0', '9'))
+                digit = ch - '0';
+            else if (in_range(ch, 'a', 'f'))
+                digit = ch - 'a' + 10;
+            else if (in_range(ch, 'A', 'F'))
+                digit = ch - 'A' + 10;
+            else
+                return fail("bad \\u escape: " + string(str + i, 4), -1L);
+            codepoint = (codepoint << 4) | digit;
+        }
+        i += 4;
+        return codepoint;
+    }
+
+    /* parse_string(out)
+     *
+     * Parse a string into out, starting just after the opening quote. The previous
+     * contents of out are replaced, but its storage is reused.
+     */
+    bool parse_string(string &out) {
+        out.clear();
+        long last_escaped_codepoint = -1;
+        while (true) {
+            if (i == len)
+                return fail("unexpected end of input in string");
+
+            // The usual case: a run of non-escaped characters
+            const size_t start = i;
+            while (i < len && str[i] != '"' && str[i] != '\\' && !in_range(str[i], 0, 0x1f))
+                i++;
+            if (i != start) {
+                encode_utf8(last_escaped_codepoint, out);
+                last_escaped_codepoint = -1;
+                out.append(str + start, i - start);
+                continue;
+            }
+
+            char ch = str[i++];
+
+            if (ch == '"') {
+                encode_utf8(last_escaped_codepoint, out);
+                return true;
+            }
+
+            if (in_range(ch, 0, 0x1f))
+                return fail("unescaped " + esc(ch) + " in string");
+
+            // Handle escapes
+            if (i == len)
+                return fail("unexpected end of input in string");
+
+            ch = str[i++];
+
+            if (ch == 'u') {
+                long codepoint = parse_hex4();
+                if (failed)
+                    return false;
+
+                // JSON specifies that characters outside the BMP shall be encoded as a pair
+                // of 4-hex-digit \u escapes encoding their surrogate pair components. Check
+                // whether we're in the middle of such a beast: the previous codepoint was an
+                // escaped lead (high) surrogate, and this is a trail (low) surrogate.
+                if (in_range(last_escaped_codepoint, 0xD800, 0xDBFF)
+                        && in_range(codepoint, 0xDC00, 0xDFFF)) {
+                    // Reassemble the two surrogate pairs into one astral-plane character, per
+                    // the UTF-16 algorithm.
+                    encode_utf8((((last_escaped_codepoint - 0xD800) << 10)
+                                 | (codepoint - 0xDC00)) + 0x10000, out);
+                    last_escaped_codepoint = -1;
+                } else {
+                    encode_utf8(last_escaped_codepoint, out);
+                    last_escaped_codepoint = codepoint;
+                }
+                continue;
+            }
+
+            encode_utf8(last_escaped_codepoint, out);
+            last_escaped_codepoint = -1;
+
+            if (ch == 'b') {
+                out += '\b';
+            } else if (ch == 'f') {
+                out += '\f';
+            } else if (ch == 'n') {
+                out += '\n';
+            } else if (ch == 'r') {
+                out += '\r';
+            } else if (ch == 't') {
+                out += '\t';
+            } else if (ch == '"' || ch == '\\' || ch == '/') {
+                out += ch;
+            } else {
+                return fail("invalid escape character " + esc(ch));
+            }
+        }
+    }
+
+    /* parse_string_view(out)
+     *
+     * Parse a string into out, starting just after the opening quote. A string without
+     * escapes is pointed to where it lies in the input, unless copy_views is set; any
+     * other is decoded into the current SchemaArena.
+     */
+    bool parse_string_view(std::string_view &out) {
+        const size_t start = i;
+        while (i < len && str[i] != '"' && str[i] != '\\' && !in_range(str[i], 0, 0x1f))
+            i++;
+        if (i < len && str[i] == '"') {
+            i++;
+            if (!copy_views) {
+                out = std::string_view(str + start, i - 1 - start);
+                return true;
+            }
+            return arena_view(str + start, i - 1 - start, out);
+        }
+
+        i = start;
+        if (!parse_string(scratch))
+            return false;
+        return arena_view(scratch.data(), scratch.size(), out);
+    }
+
+    /* arena_view(data, size, out)
+     *
+     * Point out at a copy of data in the current SchemaArena.
+     */
+    bool arena_view(const char *data, size_t size, std::string_view &out) {
+        SchemaArena *arena = SchemaArena::current();
+        if (!arena) {
+            return fail(copy_views ? "string bound to a string_view needs a SchemaArena scope when parsing a file"
+                                   : "escaped string bound to a string_view needs a SchemaArena scope");
+        }
+        char *copy = static_cast<char *>(arena->allocate(size, 1));
+        std::memcpy(copy, data, size);
+        out = std::string_view(copy, size);
+        return true;
+    }
+
+    /* skip_string()
+     *
+     * Validate a string, starting just after the opening quote, without storing it.
+     */
+    bool skip_string() {
+        while (true) {
+            if (i == len)
+                return fail("unexpected end of input in string");
+
+            char ch = str[i++];
+
+            if (ch == '"')
+                return true;
+
+            if (in_range(ch, 0, 0x1f))
+                return fail("unescaped " + esc(ch) + " in string");
+
+            if (ch != '\\')
+                continue;
+
+            if (i == len)
+                return fail("unexpected end of input in string");
+
+            ch = str[i++];
+
+            if (ch == 'u') {
+                parse_hex4();
+                if (failed)
+                    return false;
+            } else if (ch != 'b' && ch != 'f' && ch != 'n' && ch != 'r' && ch != 't'
+                       && ch != '"' && ch != '\\' && ch != '/') {
+                return fail("invalid escape character " + esc(ch));
+            }
+        }
+    }
+
+    /* Number
+     *
+     * A scanned number, split into its sign, up to 19 significant decimal digits and a
+     * decimal exponent, so that it can be converted to the bound type without going
+     * through a double.
+     */
+    struct Number {
+        size_t start;
+        size_t end;
+        bool negative = false;
+        bool is_integer = true;
+        bool truncated = false;     // more than 19 significant digits
+        uint64_t mantissa = 0;
+        int exponent = 0;
+    };
+
+    /* scan_number(number)
+     *
+     * Validate a number starting at the current position, advance past it, and accumulate
+     * its digits into number.
+     */
+    bool scan_number(Number &number) {
+        static const uint64_t max_mantissa = 1000000000000000000u;   // 10^18
+        number.start = i;
+        if (peek() == '-') {
+            number.negative = true;
+            i++;
+        }
+
+        // Integer part
+        if (peek() == '0') {
+            i++;
+            if (in_range(peek(), '0', '9'))
+                return fail("leading 0s not permitted in numbers");
+        } else if (in_range(peek(), '1', '9')) {
+            while (in_range(peek(), '0', '9')) {
+                if (number.mantissa < max_mantissa)
+                    number.mantissa = number.mantissa * 10 + (str[i] - '0');
+                else {
+                    number.truncated |= str[i] != '0';
+                    number.exponent++;
+                }
+                i++;
+            }
+        } else {
+            return fail("invalid " + esc(peek()) + " in number");
+        }
+
+        // Decimal part
+        if (peek() == '.') {
+            number.is_integer = false;
+            i++;
+            if (!in_range(peek(), '0', '9'))
+                return fail("at least one digit required in fractional part");
+
+            while (in_range(peek(), '0', '9')) {
+                if (number.mantissa < max_mantissa) {
+                    number.mantissa = number.mantissa * 10 + (str[i] - '0');
+                    number.exponent--;
+                } else {
+                    number.truncated |= str[i] != '0';
+                }
+                i++;
+            }
+        }
+
+        // Exponent part
+        if (peek() == 'e' || peek() == 'E') {
+            number.is_integer = false;
+            i++;
+
+            bool negative_exponent = false;
+            if (peek() == '+' || peek() == '-')
+                negative_exponent = str[i++] == '-';
+
+            if (!in_range(peek(), '0', '9'))
+                return fail("at least one digit required in exponent");
+
+            int exponent = 0;
+            while (in_range(peek(), '0', '9')) {
+                if (exponent < 100000)
+                    exponent = exponent * 10 + (str[i] - '0');
+                i++;
+            }
+            number.exponent += negative_exponent ? -exponent : exponent;
+        }
+
+        number.end = i;
+        return true;
+    }
+
+    /* fast_value(number, value)
+     *
+     * Convert number exactly when both its mantissa and the power of ten are exactly
+     * representable in FloatType, so that a single multiplication or division rounds
+     * correctly (Clinger's fast path). Return false if the slow path is needed.
+     */
+    template <class FloatType>
+    static bool fast_value(const Number &number, FloatType &value) {
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+        static const FloatType powers[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+        const int digits = std::numeric_limits<FloatType>::digits;
+        const int max_exponent = digits == 24 ? 10 : 22;
+        if (number.truncated || number.mantissa > (uint64_t(1) << digits)
+            || number.exponent < -max_exponent || number.exponent > max_exponent)
+            return false;
+
+        value = static_cast<FloatType>(number.mantissa);
+        if (number.exponent < 0)
+            value /= powers[-number.exponent];
+        else
+            value *= powers[number.exponent];
+        if (number.negative)
+            value = -value;
+        return true;
+#else
+        (void)number;
+        (void)value;
+        return false;
+#endif
+    }
+
+    /* parse_number(value)
+     *
+     * Parse a number starting at the current position into a double, a float or an int.
+     * Numbers that take the fast path are converted exactly; the rest fall back to strtod
+     * or strtof, which round correctly too. As with json11's int_value(), a non-integral
+     * number bound to an int is truncated; one out of range is clamped.
+     */
+    bool parse_number(double &value) {
+        Number number;
+        if (!scan_number(number))
+            return false;
+
+        if (!fast_value(number, value)) {
+            // The input need not be NUL-terminated, so strtod gets a terminated copy.
+            const string text(str + number.start, number.end - number.start);
+            value = std::strtod(text.c_str(), nullptr);
+        }
+        return true;
+    }
+
+    bool parse_number(float &value) {
+        Number number;
+        if (!scan_number(number))
+            return false;
+
+        // Use strtof rather than narrowing a double, which could round twice.
+        if (!fast_value(number, value)) {
+            const string text(str + number.start, number.end - number.start);
+            value = std::strtof(text.c_str(), nullptr);
+        }
+        return true;
+    }
+
+    bool parse_number(int &value) {
+        Number number;
+        if (!scan_number(number))
+            return false;
+
+        const uint64_t limit = number.negative
+            ? static_cast<uint64_t>(std::numeric_limits<int>::max()) + 1
+            : static_cast<uint64_t>(std::numeric_limits<int>::max());
+        if (number.is_integer && !number.truncated && number.exponent == 0) {
+            if (number.mantissa <= limit) {
+                value = number.negative ? static_cast<int>(0 - number.mantissa)
+                                        : static_cast<int>(number.mantissa);
+            } else {
+                value = number.negative ? std::numeric_limits<int>::min() : std::numeric_limits<int>::max();
+            }
+            return true;
+        }
+
+        double real;
+        if (!fast_value(number, real)) {
+            const string text(str + number.start, number.end - number.start);
+            real = std::strtod(text.c_str(), nullptr);
+        }
+        if (!(real > std::numeric_limits<int>::min() - 1.0))
+            value = std::numeric_limits<int>::min();
+        else if (!(real < std::numeric_limits<int>::max() + 1.0))
+            value = std::numeric_limits<int>::max();
+        else
+            value = static_cast<int>(real);
+        return true;
+    }
+
+    /* expect(expected)
+     *
+     * Expect that 'expected' starts at the character that was just read. If it does,
+     * advance the input. If not, flag an error.
+     */
+    bool expect(const char *expected) {
+        assert(i != 0);
+        i--;
+        const size_t expected_len = strlen(expected);
+        if (len - i >= expected_len && memcmp(str + i, expected, expected_len) == 0) {
+            i += expected_len;
+            return true;
+        } else {
+            return fail(string("parse error: expected ") + expected + ", got "
+                        + string(str + i, std::min(expected_len, len - i)));
+        }
+    }
+
+    /* skip_value(depth)
+     *
+     * Skip the next JSON value, which nothing is bound to, as cheaply as possible. A scalar
+     * is validated as usual, but a container is only matched bracket for bracket and quote
+     * for quote: escapes are not decoded, numbers are not converted and nothing is
+     * allocated. Unbalanced or mismatched brackets and unterminated strings are still
+     * reported; malformed scalars inside a skipped container are not.
+     */
+    bool skip_value(int depth) {
+        consume_whitespace();
+        if (peek() != '{' && peek() != '[')
+            return skip_json(depth);
+        if (len >= index_threshold && len <= std::numeric_limits<uint32_t>::max())
+            return skip_indexed(depth);
+
+        // The brackets still open, innermost last
+        char open[max_depth];
+        int open_count = 0;
+        while (true) {
+            i = find_structural(str, i, len);
+            if (i == len)
+                return fail("unexpected end of input");
+
+            const char ch = str[i++];
+            if (ch == '"') {
+                while (true) {
+                    i = find_quote(str, i, len);
+                    if (i == len)
+                        return fail("unexpected end of input in string");
+                    if (str[i++] == '"')
+                        break;
+                    i++;    // The escaped character, which may be a quote
+                }
+            } else if (ch == '[' || ch == '{') {
+                if (depth + open_count >= max_depth)
+                    return fail("exceeded maximum nesting depth");
+                open[open_count++] = ch;
+            } else {
+                if (open[open_count - 1] != (ch == ']' ? '[' : '{'))
+                    return fail("mismatched " + esc(ch));
+                if (--open_count == 0)
+                    return true;
+            }
+        }
+    }
+
+    /* next_structural_position(pos)
+     *
+     * Step to the next position in the structural index, indexing more of the input when
+     * the walk runs past the end of what has been indexed so far. Each chunk is twice the
+     * size of the last, so that a short skip does not index far beyond its end. Return
+     * false at the end of the input.
+     */
+    bool next_structural_position(size_t &pos) {
+        while (next_structural == structurals.size()) {
+            structurals.clear();
+            next_structural = 0;
+            if (!scanner.scan(scan_chunk, structurals))
+                return false;
+            scan_chunk = std::min(scan_chunk * 2, max_scan_chunk);
+        }
+        pos = structurals[next_structural++];
+        return true;
+    }
+
+    /* skip_indexed(depth)
+     *
+     * skip_value for large inputs: the container starting at the current position is
+     * matched by walking the structural index rather than the bytes. The index is kept
+     * across skips, and restarted here, outside any string, if this skip starts past the
+     * end of it.
+     */
+    bool skip_indexed(int depth) {
+        while (next_structural < structurals.size() && structurals[next_structural] < i)
+            next_structural++;
+        if (next_structural == structurals.size() || structurals[next_structural] != i) {
+            static const ClassifyBlock classify = classifier(StructuralIndex::AUTO);
+            scanner.start(str, len, i, classify);
+            structurals.clear();
+            next_structural = 0;
+            scan_chunk = min_scan_chunk;
+        }
+
+        // The brackets still open, innermost last
+        char open[max_depth];
+        int open_count = 0;
+        size_t pos;
+        while (next_structural_position(pos)) {
+            const char ch = str[pos];
+            if (ch == '[' || ch == '{') {
+                if (depth + open_count >= max_depth)
+                    return fail("exceeded maximum nesting depth");
+                open[open_count++] = ch;
+            } else if (ch == ']' || ch == '}') {
+                if (open_count == 0 || open[open_count - 1] != (ch == ']' ? '[' : '{'))
+                    return fail("mismatched " + esc(ch));
+                if (--open_count == 0) {
+                    i = pos + 1;
+                    return true;
+                }
+            }
+        }
+        i = len;
+        return fail(scanner.in_string ? "unexpected end of input in string" : "unexpected end of input");
+    }
+
+    /* skip_json(depth)
+     *
+     * Validate the next JSON value without storing it anywhere.
+     */
+    bool skip_json(int depth) {
+        if (depth > max_depth) {
+            return fail("exceeded maximum nesting depth");
+        }
+
+        char ch = get_next_token();
+        if (failed)
+            return false;
+
+        if (ch == '-' || (ch >= '0' && ch <= '9')) {
+            i--;
+            Number number;
+            return scan_number(number);
+        }
+
+        if (ch == 't')
+            return expect("true");
+
+        if (ch == 'f')
+            return expect("false");
+
+        if (ch == 'n')
+            return expect("null");
+
+        if (ch == '"')
+            return skip_string();
+
+        if (ch == '{') {
+            ch = get_next_token();
+            if (ch == '}')
+                return true;
+
+            while (1) {
+                if (ch != '"')
+                    return fail("expected '\"' in object, got " + esc(ch));
+
+                if (!skip_string())
+                    return false;
+
+                ch = get_next_token();
+                if (ch != ':')
+                    return fail("expected ':' in object, got " + esc(ch));
+
+                if (!skip_json(depth + 1))
+                    return false;
+
+                ch = get_next_token();
+                if (ch == '}')
+                    return true;
+                if (ch != ',')
+                    return fail("expected ',' in object, got " + esc(ch));
+
+                ch = get_next_token();
+            }
+        }
+
+        if (ch == '[') {
+            ch = get_next_token();
+            if (ch == ']')
+                return true;
+
+            while (1) {
+                i--;
+                if (!skip_json(depth + 1))
+                    return false;
+
+                ch = get_next_token();
+                if (ch == ']')
+                    return true;
+                if (ch != ',')
+                    return fail("expected ',' in list, got " + esc(ch));
+
+                ch = get_next_token();
+                (void)ch;
+            }
+        }
+
+        return fail("expected value, got " + esc(ch));
+    }
+
+    /* parse_json(json, depth)
+     *
+     * Parse the next JSON value into a json11::Json. This is the fallback for values
+     * bound through a custom ValueConverter, which only understands json11 types.
+     */
+    bool parse_json(Json &json, int depth) {
+        consume_whitespace();
+        const size_t start_pos = i;
+        if (!skip_json(depth))
+            return false;
+
+        string parse_err;
+        json = Json::parse(string(str + start_pos, i - start_pos), parse_err);
+        if (!parse_err.empty())
+            return fail(move(parse_err));
+        return true;
+    }
+
+    /* finish()
+     *
+     * Check for any trailing garbage after the top-level value.
+     */
+    bool finish() {
+        if (failed)
+            return false;
+
+        consume_whitespace();
+        if (i != len)
+            return fail("unexpected trailing " + esc(str[i]));
+
+        return true;
+    }
+
+    /* parse_schema(schema, depth)
+     *
+     * Parse the next JSON value into the values bound by schema.
+     */
+    void parse_schema(const Schema &schema, int depth) {
+        if (depth > max_depth) {
+            fail("exceeded maximum nesting depth");
+            return;
+        }
+        schema.m_ptr->parse(*this, depth);
+    }
+
+    /* parse_value(converter, depth)
+     *
+     * Parse the next JSON value into the target of a primitive converter. A value of the
+     * wrong type leaves the target with the same default that json11 would produce.
+     */
+    void parse_value(const ValueConverter &converter, int depth) {
+        if (converter.kind == ValueConverter::CUSTOM) {
+            Json json;
+            if (parse_json(json, depth))
+                converter.from_json(json);
+            return;
+        }
+        parse_primitive(converter.kind, converter.target, depth);
+    }
+
+    /* parse_primitive(kind, target, depth)
+     *
+     * Parse the next JSON value into the primitive of the given kind at target.
+     */
+    void parse_primitive(ValueConverter::Kind kind, void *target, int depth) {
+        consume_whitespace();
+        const char ch = peek();
+
+        switch (kind) {
+        case ValueConverter::INT:
+            if (ch == '-' || in_range(ch, '0', '9')) {
+                parse_number(*static_cast<int *>(target));
+                return;
+            }
+            *static_cast<int *>(target) = 0;
+            break;
+        case ValueConverter::FLOAT:
+            if (ch == '-' || in_range(ch, '0', '9')) {
+                parse_number(*static_cast<float *>(target));
+                return;
+            }
+            *static_cast<float *>(target) = 0;
+            break;
+        case ValueConverter::DOUBLE:
+            if (ch == '-' || in_range(ch, '0', '9')) {
+                parse_number(*static_cast<double *>(target));
+                return;
+            }
+            *static_cast<double *>(target) = 0;
+            break;
+        case ValueConverter::BOOL:
+            if (ch == 't' || ch == 'f') {
+                i++;
+                *static_cast<bool *>(target) = (ch == 't');
+                expect(ch == 't' ? "true" : "false");
+                return;
+            }
+            *static_cast<bool *>(target) = false;
+            break;
+        case ValueConverter::STRING:
+            if (ch == '"') {
+                i++;
+                parse_string(*static_cast<string *>(target));
+                return;
+            }
+            static_cast<string *>(target)->clear();
+            break;
+        case ValueConverter::STRING_VIEW:
+            if (ch == '"') {
+                i++;
+                parse_string_view(*static_cast<std::string_view *>(target));
+                return;
+            }
+            *static_cast<std::string_view *>(target) = std::string_view();
+            break;
+        case ValueConverter::CUSTOM:
+            break;
+        }
+
+        skip_value(depth);
+    }
+
+    /* parse_typed(schema, object, depth)
+     *
+     * Parse the next JSON value into object, as described by a TypeSchema.
+     */
+    void parse_typed(const TypeSchemaBase &schema, void *object, int depth) {
+        if (depth > max_depth) {
+            fail("exceeded maximum nesting depth");
+            return;
+        }
+
+        consume_whitespace();
+        if (peek() != '{') {
+            skip_value(depth);
+            return;
+        }
+        i++;
+
+        char ch = get_next_token();
+        if (ch == '}')
+            return;
+
+        while (1) {
+            if (ch != '"') {
+                fail("expected '\"' in object, got " + esc(ch));
+                return;
+            }
+
+            if (!parse_string(key))
+                return;
+
+            ch = get_next_token();
+            if (ch != ':') {
+                fail("expected ':' in object, got " + esc(ch));
+                return;
+            }
+
+            const TypeSchemaBase::Field *field = schema.find(key.data(), key.size());
+            if (!field) {
+                skip_value(depth + 1);
+            } else if (field->type == Schema::OBJECT) {
+                parse_typed(*field->schema, field->target(object), depth + 1);
+            } else if (field->type == Schema::ARRAY) {
+                parse_typed_array(*field, object, depth + 1);
+            } else {
+                parse_primitive(field->kind, field->target(object), depth + 1);
+            }
+            if (failed)
+                return;
+
+            ch = get_next_token();
+            if (ch == '}')
+                return;
+            if (ch != ',') {
+                fail("expected ',' in object, got " + esc(ch));
+                return;
+            }
+
+            ch = get_next_token();
+        }
+    }
+
+    /* parse_typed_array(field, object, depth)
+     *
+     * Parse the next JSON value into the vector described by an array field of a
+     * TypeSchema, replacing its contents.
+     */
+    void parse_typed_array(const TypeSchemaBase::Field &field, void *object, int depth) {
+        consume_whitespace();
+        if (peek() != '[') {
+            skip_value(depth);
+            return;
+        }
+        i++;
+        field.clear(object);
+
+        char ch = get_next_token();
+        if (ch == ']')
+            return;
+
+        while (1) {
+            i--;
+            void *element = field.append(object);
+            if (field.schema)
+                parse_typed(*field.schema, element, depth + 1);
+            else
+                parse_primitive(field.kind, element, depth + 1);
+            if (failed)
+                return;
+
+            ch = get_next_token();
+            if (ch == ']')
+                return;
+            if (ch != ',') {
+                fail("expected ',' in list, got " + esc(ch));
+                return;
+            }
+
+            ch = get_next_token();
+            (void)ch;
+        }
+    }
+};
+
+template <Schema::Type tag>
+void Value<tag>::parse(SchemaParser &parser, int depth) const {
+    parser.parse_value(m_valueConverter, depth);
+}
+
+void SchemaArray::parse(SchemaParser &parser, int depth) const {
+    parser.consume_whitespace();
+    if (parser.peek() != '[') {
+        parser.skip_value(depth);
+        return;
+    }
+    parser.i++;
+
+    char ch = parser.get_next_token();
+    if (ch == ']')
+        return;
+
+    while (1) {
+        parser.i--;
+        if (m_value.element_schema) {
+            parser.parse_typed(*m_value.element_schema, m_value.append_element(), depth + 1);
+        } else if (m_value.element_kind != ValueConverter::CUSTOM) {
+            parser.parse_primitive(m_value.element_kind, m_value.append_element(), depth + 1);
+        } else {
+            parser.parse_schema(m_value.append(), depth + 1);
+        }
+        if (parser.failed)
+            return;
+
+        ch = parser.get_next_token();
+        if (ch == ']')
+            return;
+        if (ch != ',') {
+            parser.fail("expected ',' in list, got " + esc(ch));
+            return;
+        }
+
+        ch = parser.get_next_token();
+        (void)ch;
+    }
+}
+
+void SchemaObject::parse(SchemaParser &parser, int depth) const {
+    parser.consume_whitespace();
+    if (parser.peek() != '{') {
+        parser.skip_value(depth);
+        return;
+    }
+    parser.i++;
+
+    char ch = parser.get_next_token();
+    if (ch == '}')
+        return;
+
+    while (1) {
+        if (ch != '"') {
+            parser.fail("expected '\"' in object, got " + esc(ch));
+            return;
+        }
+
+        if (!parser.parse_string(parser.key))
+            return;
+
+        ch = parser.get_next_token();
+        if (ch != ':') {
+            parser.fail("expected ':' in object, got " + esc(ch));
+            return;
+        }
+
+        const Schema *field = find(parser.key);
+        if (field) {
+            parser.parse_schema(*field, depth + 1);
+        } else {
+            parser.skip_value(depth + 1);
+        }
+        if (parser.failed)
+            return;
+
+        ch = parser.get_next_token();
+        if (ch == '}')
+            return;
+        if (ch != ',') {
+            parser.fail("expected ',' in object, got " + esc(ch));
+            return;
+        }
+
+        ch = parser.get_next_token();
+    }
+}
+
+void SchemaNull::parse(SchemaParser &parser, int depth) const {
+    parser.skip_value(depth);
+}
+
+void SchemaTyped::parse(SchemaParser &parser, int depth) const {
+    parser.parse_typed(m_schema, m_object, depth);
+}
+
+bool Schema::parse_into(const char *data, size_t len, string &err) const {
+    if (!data) {
+        err = "null input";
+        return false;
+    }
+
+    SchemaParser parser(data, len, err);
+    parser.parse_schema(*this, 0);
+    return parser.finish();
+}
+
+bool TypeSchemaBase::parse_into(void *object, const char *data, size_t len, string &err) const {
+    if (!data) {
+        err = "null input";
+        return false;
+    }
+
+    SchemaParser parser(data, len, err);
+    parser.parse_typed(*this, object, 0);
+    return parser.finish();
+}
+
+/* * * * * * * * * * * * * * * * * * * *
+ * MessagePack and CBOR
+ */
+
+/* BinaryWriter
+ *
+ * Appends values to out in MessagePack or CBOR, integers and lengths each in their
+ * shortest encoding. Floats and doubles keep their width.
+ */
+struct BinaryWriter {
+    const BinaryFormat format;
+    string &out;
+    bool failed = false;
+    string error;
+
+    BinaryWriter(BinaryFormat format, string &out) : format(format), out(out) {}
+
+    void fail(string &&msg) {
+        if (!failed)
+            error = move(msg);
+        failed = true;
+    }
+
+    void put(uint8_t byte) {
+        out += static_cast<char>(byte);
+    }
+
+    // Append the low size bytes of value, most significant first.
+    void put_big_endian(uint64_t value, unsigned size) {
+        for (unsigned shift = size * 8; shift;) {
+            shift -= 8;
+            out += static_cast<char>(value >> shift);
+        }
+    }
+
+    // CBOR: the head of an item of the given major type, with its argument.
+    void cbor_head(uint8_t major, uint64_t argument) {
+        major = static_cast<uint8_t>(major << 5);
+        if (argument < 24) {
+            put(static_cast<uint8_t>(major | argument));
+        } else if (argument <= 0xff) {
+            put(major | 24);
+            put_big_endian(argument, 1);
+        } else if (argument <= 0xffff) {
+            put(major | 25);
+            put_big_endian(argument, 2);
+        } else if (argument <= 0xffffffff) {
+            put(major | 26);
+            put_big_endian(argument, 4);
+        } else {
+            put(major | 27);
+            put_big_endian(argument, 8);
+        }
+    }
+
+    // MessagePack: the head of a string, array or map, as a fixed-size type if count is
+    // below fixed_limit, and otherwise with a 1 (if first_size is 1), 2 or 4-byte count.
+    void msgpack_head(uint8_t fixed, uint64_t fixed_limit, uint8_t first, unsigned first_size, uint64_t count) {
+        if (count > 0xffffffff) {
+            fail("too many bytes or items for MessagePack: " + std::to_string(count));
+            return;
+        }
+        if (count < fixed_limit) {
+            put(static_cast<uint8_t>(fixed | count));
+            return;
+        }
+        for (unsigned size = first_size; size <= 4; size *= 2, first++) {
+            if (size == 4 || count < (uint64_t(1) << (size * 8))) {
+                put(first);
+                put_big_endian(count, size);
+                return;
+            }
+        }
+    }
+
+    void nil() {
+        put(format == MSGPACK ? 0xc0 : 0xf6);
+    }
+
+    void boolean(bool value) {
+        if (format == MSGPACK)
+            put(value ? 0xc3 : 0xc2);
+        else
+            put(value ? 0xf5 : 0xf4);
+    }
+
+    void integer(int64_t value) {
+        if (format == CBOR) {
+            if (value >= 0)
+                cbor_head(0, static_cast<uint64_t>(value));
+            else
+                cbor_head(1, static_cast<uint64_t>(-1 - value));
+            return;
+        }
+
+        if (value >= 0 && value < 0x80) {
+            put(static_cast<uint8_t>(value));           // positive fixint
+        } else if (value < 0 && value >= -32) {
+            put(static_cast<uint8_t>(value));           // negative fixint
+        } else if (value > 0) {
+            const unsigned size = value <= 0xff ? 1 : value <= 0xffff ? 2 : value <= 0xffffffff ? 4 : 8;
+            put(static_cast<uint8_t>(size == 1 ? 0xcc : size == 2 ? 0xcd : size == 4 ? 0xce : 0xcf));
+            put_big_endian(static_cast<uint64_t>(value), size);
+        } else {
+            const unsigned size = value >= INT8_MIN ? 1 : value >= INT16_MIN ? 2 : value >= INT32_MIN ? 4 : 8;
+            put(static_cast<uint8_t>(size == 1 ? 0xd0 : size == 2 ? 0xd1 : size == 4 ? 0xd2 : 0xd3));
+            put_big_endian(static_cast<uint64_t>(value), size);
+        }
+    }
+
+    void real(float value) {
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof bits);
+        put(format == MSGPACK ? 0xca : 0xfa);
+        put_big_endian(bits, 4);
+    }
+
+    void real(double value) {
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof bits);
+        put(format == MSGPACK ? 0xcb : 0xfb);
+        put_big_endian(bits, 8);
+    }
+
+    void text(const char *data, size_t size) {
+        if (format == CBOR)
+            cbor_head(3, size);
+        else
+            msgpack_head(0xa0, 32, 0xd9, 1, size);
+        if (!failed)
+            out.append(data, size);
+    }
+
+    void array(size_t count) {
+        if (format == CBOR)
+            cbor_head(4, count);
+        else
+            msgpack_head(0x90, 16, 0xdc, 2, count);
+    }
+
+    void map(size_t count) {
+        if (format == CBOR)
+            cbor_head(5, count);
+        else
+            msgpack_head(0x80, 16, 0xde, 2, count);
+    }
+
+    void primitive(ValueConverter::Kind kind, const void *target) {
+        switch (kind) {
+        case ValueConverter::INT:
+            integer(*static_cast<const int *>(target));
+            break;
+        case ValueConverter::BOOL:
+            boolean(*static_cast<const bool *>(target));
+            break;
+        case ValueConverter::FLOAT:
+            real(*static_cast<const float *>(target));
+            break;
+        case ValueConverter::DOUBLE:
+            real(*static_cast<const double *>(target));
+            break;
+        case ValueConverter::STRING: {
+            const string &value = *static_cast<const string *>(target);
+            text(value.data(), value.size());
+            break;
+        }
+        case ValueConverter::STRING_VIEW: {
+            const std::string_view value = *static_cast<const std::string_view *>(target);
+            text(value.data(), value.size());
+            break;
+        }
+        case ValueConverter::CUSTOM:
+            nil();
+            break;
+        }
+    }
+
+    // A json11 value, as produced by a custom converter. Integral numbers are written as
+    // integers, since json11 does not keep track of which numbers were.
+    void json(const Json &value) {
+        switch (value.type()) {
+        case Json::NUL:
+            nil();
+            break;
+        case Json::NUMBER: {
+            const double number = value.number_value();
+            if (number == std::floor(number) && number >= -9223372036854775808.0 && number < 9223372036854775808.0)
+                integer(static_cast<int64_t>(number));
+            else
+                real(number);
+            break;
+        }
+        case Json::BOOL:
+            boolean(value.bool_value());
+            break;
+        case Json::STRING:
+            text(value.string_value().data(), value.string_value().size());
+            break;
+        case Json::ARRAY:
+            array(value.array_items().size());
+            for (const Json &item : value.array_items())
+                json(item);
+            break;
+        case Json::OBJECT:
+            map(value.object_items().size());
+            for (const auto &item : value.object_items()) {
+                text(item.first.data(), item.first.size());
+                json(item.second);
+            }
+            break;
+        }
+    }
+
+    void value(const ValueConverter &converter) {
+        if (converter.kind != ValueConverter::CUSTOM) {
+            primitive(converter.kind, converter.target);
+            return;
+        }
+        Json value;
+        converter.to_json(value);
+        json(value);
+    }
+
+    void schema(const Schema &schema) {
+        schema.m_ptr->pack(*this);
+    }
+
+    void elements(const Schema::array &desc) {
+        const size_t size = desc.size ? desc.size() : 0;
+        array(size);
+        for (size_t i = 0; i < size && !failed; i++) {
+            if (desc.element_schema)
+                typed(*desc.element_schema, desc.element(i));
+            else if (desc.element_kind != ValueConverter::CUSTOM)
+                primitive(desc.element_kind, desc.element(i));
+            else
+                schema(desc.at(i));
+        }
+    }
+
+    void typed(const TypeSchemaBase &schema, const void *object) {
+        // Fields only read through the object, so dropping const here is safe.
+        void *mutable_object = const_cast<void *>(object);
+        map(schema.fields().size());
+        for (const auto &field : schema.fields()) {
+            text(field->key.str().data(), field->key.str().size());
+            switch (field->type) {
+            case Schema::OBJECT:
+                typed(*field->schema, field->target(mutable_object));
+                break;
+            case Schema::ARRAY: {
+                const size_t size = field->size(mutable_object);
+                array(size);
+                for (size_t i = 0; i < size && !failed; i++) {
+                    void *element = field->element(mutable_object, i);
+                    if (field->schema)
+                        typed(*field->schema, element);
+                    else
+                        primitive(field->kind, element);
+                }
+                break;
+            }
+            default:
+                primitive(field->kind, field->target(mutable_object));
+                break;
+            }
+        }
+    }
+};
+
+/* BinaryItem
+ *
+ * The head of one MessagePack or CBOR item. The bytes of a TEXT or BYTES item follow
+ * it; the entries of an ARRAY or MAP are the items that follow. Integers that do not fit
+ * an int64_t are read as REAL, which is all a bound value could hold them as anyway.
+ */
+struct BinaryItem {
+    enum Kind { NIL, BOOL, INT, REAL, TEXT, BYTES, ARRAY, MAP };
+    Kind kind = NIL;
+    bool boolean = false;
+    int64_t integer = 0;
+    double real = 0;
+    uint64_t size = 0;      // TEXT and BYTES: length in bytes; ARRAY and MAP: entries
+};
+
+static double half_to_double(uint16_t half) {
+    const int exponent = (half >> 10) & 0x1f;
+    const int mantissa = half & 0x3ff;
+    double value;
+    if (exponent == 0)
+        value = std::ldexp(mantissa, -24);
+    else if (exponent != 31)
+        value = std::ldexp(mantissa + 1024, exponent - 25);
+    else
+        value = mantissa == 0 ? std::numeric_limits<double>::infinity() : std::numeric_limits<double>::quiet_NaN();
+    return (half & 0x8000) ? -value : value;
+}
+
+/* BinaryReader
+ *
+ * Decodes MessagePack or CBOR into the values bound by a schema, the way SchemaParser
+ * does for JSON text. CBOR tags are read past, undefined and other simple values read as
+ * nil, and indefinite-length CBOR items are rejected.
+ */
+struct BinaryReader {
+    const BinaryFormat format;
+    const char *data;
+    size_t len;
+    size_t i;
+    string &err;
+    bool failed;
+
+    bool fail(string &&msg) {
+        if (!failed)
+            err = std::move(msg);
+        failed = true;
+        return false;
+    }
+
+    // Read a size-byte big-endian unsigned integer.
+    bool get_big_endian(unsigned size, uint64_t &value) {
+        if (len - i < size)
+            return fail("unexpected end of input");
+        value = 0;
+        for (unsigned n = 0; n < size; n++)
+            value = (value << 8) | static_cast<uint8_t>(data[i++]);
+        return true;
+    }
+
+    bool set_integer(BinaryItem &item, int64_t value) {
+        item.kind = BinaryItem::INT;
+        item.integer = value;
+        return true;
+    }
+
+    bool set_unsigned(BinaryItem &item, uint64_t value) {
+        if (value <= static_cast<uint64_t>(std::numeric_limits<int64_t>::max()))
+            return set_integer(item, static_cast<int64_t>(value));
+        item.kind = BinaryItem::REAL;
+        item.real = static_cast<double>(value);
+        return true;
+    }
+
+    bool set_real(BinaryItem &item, double value) {
+        item.kind = BinaryItem::REAL;
+        item.real = value;
+        return true;
+    }
+
+    // Every entry takes at least a byte, so a size or count larger than what is left of
+    // the input is rejected before anything is reserved for it.
+    bool set_sized(BinaryItem &item, BinaryItem::Kind kind, uint64_t size) {
+        const uint64_t bytes = kind == BinaryItem::MAP ? size * 2 : size;
+        if (size > len - i || bytes > len - i)
+            return fail("unexpected end of input");
+        item.kind = kind;
+        item.size = size;
+        return true;
+    }
+
+    bool read_item(BinaryItem &item) {
+        return format == MSGPACK ? read_msgpack(item) : read_cbor(item);
+    }
+
+    bool read_msgpack(BinaryItem &item) {
+        if (i == len)
+            return fail("unexpected end of input");
+        const uint8_t byte = static_cast<uint8_t>(data[i++]);
+        uint64_t value;
+
+        if (byte <= 0x7f)
+            return set_integer(item, byte);
+        if (byte >= 0xe0)
+            return set_integer(item, static_cast<int8_t>(byte));
+        if ((byte & 0xf0) == 0x80)
+            return set_sized(item, BinaryItem::MAP, byte & 0x0f);
+        if ((byte & 0xf0) == 0x90)
+            return set_sized(item, BinaryItem::ARRAY, byte & 0x0f);
+        if ((byte & 0xe0) == 0xa0)
+            return set_sized(item, BinaryItem::TEXT, byte & 0x1f);
+
+        switch (byte) {
+        case 0xc0:
+            item.kind = BinaryItem::NIL;
+            return true;
+        case 0xc2:
+        case 0xc3:
+            item.kind = BinaryItem::BOOL;
+            item.boolean = (byte == 0xc3);
+            return true;
+        case 0xc4: case 0xc5: case 0xc6:        // bin 8, 16, 32
+            return get_big_endian(1u << (byte - 0xc4), value) && set_sized(item, BinaryItem::BYTES, value);
+        case 0xc7: case 0xc8: case 0xc9:        // ext 8, 16, 32: the type byte, then the data
+            return get_big_endian(1u << (byte - 0xc7), value) && set_sized(item, BinaryItem::BYTES, value + 1);
+        case 0xca: {
+            if (!get_big_endian(4, value))
+                return false;
+            const uint32_t bits = static_cast<uint32_t>(value);
+            float real;
+            std::memcpy(&real, &bits, sizeof real);
+            return set_real(item, real);
+        }
+        case 0xcb: {
+            if (!get_big_endian(8, value))
+                return false;
+            double real;
+            std::memcpy(&real, &value, sizeof real);
+            return set_real(item, real);
+        }
+        case 0xcc: case 0xcd: case 0xce: case 0xcf:
+            return get_big_endian(1u << (byte - 0xcc), value) && set_unsigned(item, value);
+        case 0xd0:
+            return get_big_endian(1, value) && set_integer(item, static_cast<int8_t>(value));
+        case 0xd1:
+            return get_big_endian(2, value) && set_integer(item, static_cast<int16_t>(value));
+        case 0xd2:
+            return get_big_endian(4, value) && set_integer(item, static_cast<int32_t>(value));
+        case 0xd3:
+            return get_big_endian(8, value) && set_integer(item, static_cast<int64_t>(value));
+        case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8:     // fixext 1 to 16
+            return set_sized(item, BinaryItem::BYTES, 1 + (1u << (byte - 0xd4)));
+        case 0xd9: case 0xda: case 0xdb:
+            return get_big_endian(1u << (byte - 0xd9), value) && set_sized(item, BinaryItem::TEXT, value);
+        case 0xdc: case 0xdd:
+            return get_big_endian(byte == 0xdc ? 2 : 4, value) && set_sized(item, BinaryItem::ARRAY, value);
+        case 0xde: case 0xdf:
+            return get_big_endian(byte == 0xde ? 2 : 4, value) && set_sized(item, BinaryItem::MAP, value);
+        default:
+            return fail("invalid MessagePack byte 0xc1");
+        }
+    }
+
+    bool read_cbor(BinaryItem &item) {
+        while (true) {
+            if (i == len)
+                return fail("unexpected end of input");
+            const uint8_t byte = static_cast<uint8_t>(data[i++]);
+            const uint8_t major = byte >> 5;
+            const uint8_t info = byte & 0x1f;
+
+            uint64_t argument = info;
+            if (info >= 24 && info <= 27) {
+                if (!get_big_endian(1u << (info - 24), argument))
+                    return false;
+            } else if (info == 31) {
+                return fail(major == 7 ? "unexpected CBOR break" : "indefinite-length CBOR items are not supported");
+            } else if (info > 27) {
+                return fail("invalid CBOR byte " + std::to_string(byte));
+            }
+
+            switch (major) {
+            case 0:
+                return set_unsigned(item, argument);
+            case 1:
+                if (argument <= static_cast<uint64_t>(std::numeric_limits<int64_t>::max()))
+                    return set_integer(item, -1 - static_cast<int64_t>(argument));
+                return set_real(item, -1.0 - static_cast<double>(argument));
+            case 2:
+                return set_sized(item, BinaryItem::BYTES, argument);
+            case 3:
+                return set_sized(item, BinaryItem::TEXT, argument);
+            case 4:
+                return set_sized(item, BinaryItem::ARRAY, argument);
+            case 5:
+                return set_sized(item, BinaryItem::MAP, argument);
+            case 6:
+                continue;       // A tag: the item it applies to follows
+            default:
+                if (info == 20 || info == 21) {
+                    item.kind = BinaryItem::BOOL;
+                    item.boolean = (info == 21);
+                    return true;
+                }
+                if (info == 25)
+                    return set_real(item, half_to_double(static_cast<uint16_t>(argument)));
+                if (info == 26) {
+                    const uint32_t bits = static_cast<uint32_t>(argument);
+                    float real;
+                    std::memcpy(&real, &bits, sizeof real);
+                    return set_real(item, real);
+                }
+                if (info == 27) {
+                    double real;
+                    std::memcpy(&real, &argument, sizeof real);
+                    return set_real(item, real);
+                }
+                item.kind = BinaryItem::NIL;
+                return true;
+            }
+        }
+    }
+
+    /* skip_contents(item, depth)
+     *
+     * Read past the bytes or entries of an item whose head has been read.
+     */
+    bool skip_contents(const BinaryItem &item, int depth) {
+        switch (item.kind) {
+        case BinaryItem::TEXT:
+        case BinaryItem::BYTES:
+            i += item.size;
+            return true;
+        case BinaryItem::ARRAY:
+        case BinaryItem::MAP: {
+            if (depth >= max_depth)
+                return fail("exceeded maximum nesting depth");
+            const uint64_t count = item.kind == BinaryItem::MAP ? item.size * 2 : item.size;
+            for (uint64_t n = 0; n < count; n++) {
+                BinaryItem entry;
+                if (!read_item(entry) || !skip_contents(entry, depth + 1))
+                    return false;
+            }
+            return true;
+        }
+        default:
+            return true;
+        }
+    }
+
+    bool skip(int depth) {
+        BinaryItem item;
+        return read_item(item) && skip_contents(item, depth);
+    }
+
+    /* read_key(key, depth)
+     *
+     * Read the key of a map entry. Return false if it is not a string, after reading past
+     * it; check failed to tell that apart from an error.
+     */
+    bool read_key(std::string_view &key, int depth) {
+        BinaryItem item;
+        if (!read_item(item))
+            return false;
+        if (item.kind != BinaryItem::TEXT) {
+            skip_contents(item, depth);
+            return false;
+        }
+        key = std::string_view(data + i, item.size);
+        i += item.size;
+        return true;
+    }
+
+    /* read_json(item, json, depth)
+     *
+     * Read the rest of an item into a json11 value, for custom converters. Byte strings
+     * have no JSON equivalent and read as null, as do map entries whose key is not a
+     * string.
+     */
+    bool read_json(const BinaryItem &item, Json &json, int depth) {
+        switch (item.kind) {
+        case BinaryItem::NIL:
+            json = Json();
+            return true;
+        case BinaryItem::BOOL:
+            json = Json(item.boolean);
+            return true;
+        case BinaryItem::INT:
+            if (item.integer >= std::numeric_limits<int>::min() && item.integer <= std::numeric_limits<int>::max())
+                json = Json(static_cast<int>(item.integer));
+            else
+                json = Json(static_cast<double>(item.integer));
+            return true;
+        case BinaryItem::REAL:
+            json = Json(item.real);
+            return true;
+        case BinaryItem::TEXT:
+            json = Json(string(data + i, item.size));
+            i += item.size;
+            return true;
+        case BinaryItem::BYTES:
+            json = Json();
+            i += item.size;
+            return true;
+        case BinaryItem::ARRAY: {
+            if (depth >= max_depth)
+                return fail("exceeded maximum nesting depth");
+            Json::array items(item.size);
+            for (auto &element : items) {
+                BinaryItem head;
+                if (!read_item(head) || !read_json(head, element, depth + 1))
+                    return false;
+            }
+            json = Json(move(items));
+            return true;
+        }
+        case BinaryItem::MAP: {
+            if (depth >= max_depth)
+                return fail("exceeded maximum nesting depth");
+            Json::object items;
+            for (uint64_t n = 0; n < item.size; n++) {
+                std::string_view key;
+                if (!read_key(key, depth + 1)) {
+                    if (failed || !skip(depth + 1))
+                        return false;
+                    continue;
+                }
+                BinaryItem head;
+                if (!read_item(head) || !read_json(head, items[string(key)], depth + 1))
+                    return false;
+            }
+            json = Json(move(items));
+            return true;
+        }
+        }
+        return true;
+    }
+
+    bool finish() {
+        if (failed)
+            return false;
+        if (i != len)
+            return fail("unexpected trailing bytes");
+        return true;
+    }
+
+    void unpack_schema(const Schema &schema, int depth) {
+        if (depth > max_depth) {
+            fail("exceeded maximum nesting depth");
+            return;
+        }
+        schema.m_ptr->unpack(*this, depth);
+    }
+
+    void unpack_value(const ValueConverter &converter, int depth) {
+        if (converter.kind == ValueConverter::CUSTOM) {
+            BinaryItem item;
+            Json json;
+            if (read_item(item) && read_json(item, json, depth))
+                converter.from_json(json);
+            return;
+        }
+        unpack_primitive(converter.kind, converter.target, depth);
+    }
+
+    /* unpack_primitive(kind, target, depth)
+     *
+     * Read the next item into the primitive of the given kind at target. Numbers convert
+     * between integers and reals, with integers clamped to the range of int; an item of
+     * any other type resets the target, as parse_primitive does.
+     */
+    void unpack_primitive(ValueConverter::Kind kind, void *target, int depth) {
+        BinaryItem item;
+        if (!read_item(item))
+            return;
+        const bool number = item.kind == BinaryItem::INT || item.kind == BinaryItem::REAL;
+        const double real = item.kind == BinaryItem::INT ? static_cast<double>(item.integer) : item.real;
+
+        switch (kind) {
+        case ValueConverter::INT: {
+            int &value = *static_cast<int *>(target);
+            if (item.kind == BinaryItem::INT)
+                value = static_cast<int>(std::min<int64_t>(std::max<int64_t>(item.integer, std::numeric_limits<int>::min()),
+                                                           std::numeric_limits<int>::max()));
+            else if (item.kind != BinaryItem::REAL)
+                value = 0;
+            else if (!(real > std::numeric_limits<int>::min() - 1.0))
+                value = std::numeric_limits<int>::min();
+            else if (!(real < std::numeric_limits<int>::max() + 1.0))
+                value = std::numeric_limits<int>::max();
+            else
+                value = static_cast<int>(real);
+            break;
+        }
+        case ValueConverter::FLOAT:
+            *static_cast<float *>(target) = number ? static_cast<float>(real) : 0;
+            break;
+        case ValueConverter::DOUBLE:
+            *static_cast<double *>(target) = number ? real : 0;
+            break;
+        case ValueConverter::BOOL:
+            *static_cast<bool *>(target) = item.kind == BinaryItem::BOOL && item.boolean;
+            break;
+        case ValueConverter::STRING:
+            if (item.kind == BinaryItem::TEXT) {
+                static_cast<string *>(target)->assign(data + i, item.size);
+                i += item.size;
+                return;
+            }
+            static_cast<string *>(target)->clear();
+            break;
+        case ValueConverter::STRING_VIEW:
+            if (item.kind == BinaryItem::TEXT) {
+                *static_cast<std::string_view *>(target) = std::string_view(data + i, item.size);
+                i += item.size;
+                return;
+            }
+            *static_cast<std::string_view *>(target) = std::string_view();
+            break;
+        case ValueConverter::CUSTOM:
+            break;
+        }
+        skip_contents(item, depth);
+    }
+
+    /* unpack_typed(schema, object, depth)
+     *
+     * Read the next item into object, as described by a TypeSchema.
+     */
+    void unpack_typed(const TypeSchemaBase &schema, void *object, int depth) {
+        if (depth > max_depth) {
+            fail("exceeded maximum nesting depth");
+            return;
+        }
+
+        BinaryItem item;
+        if (!read_item(item))
+            return;
+        if (item.kind != BinaryItem::MAP) {
+            skip_contents(item, depth);
+            return;
+        }
+
+        for (uint64_t n = 0; n < item.size && !failed; n++) {
+            std::string_view key;
+            const TypeSchemaBase::Field *field = nullptr;
+            if (read_key(key, depth + 1))
+                field = schema.find(key.data(), key.size());
+            if (failed)
+                return;
+
+            if (!field)
+                skip(depth + 1);
+            else if (field->type == Schema::OBJECT)
+                unpack_typed(*field->schema, field->target(object), depth + 1);
+            else if (field->type == Schema::ARRAY)
+                unpack_typed_array(*field, object, depth + 1);
+            else
+                unpack_primitive(field->kind, field->target(object), depth + 1);
+        }
+    }
+
+    /* unpack_typed_array(field, object, depth)
+     *
+     * Read the next item into the vector described by an array field of a TypeSchema,
+     * replacing its contents.
+     */
+    void unpack_typed_array(const TypeSchemaBase::Field &field, void *object, int depth) {
+        BinaryItem item;
+        if (!read_item(item))
+            return;
+        if (item.kind != BinaryItem::ARRAY) {
+            skip_contents(item, depth);
+            return;
+        }
+
+        field.clear(object);
+        field.reserve(object, item.size);
+        for (uint64_t n = 0; n < item.size && !failed; n++) {
+            void *element = field.append(object);
+            if (field.schema)
+                unpack_typed(*field.schema, element, depth + 1);
+            else
+                unpack_primitive(field.kind, element, depth + 1);
+        }
+    }
+};
+
+template <Schema::Type tag>
+void Value<tag>::pack(BinaryWriter &writer) const {
+    writer.value(m_valueConverter);
+}
+
+template <Schema::Type tag>
+void Value<tag>::unpack(BinaryReader &reader, int depth) const {
+    reader.unpack_value(m_valueConverter, depth);
+}
+
+void SchemaArray::pack(BinaryWriter &writer) const {
+    writer.elements(m_value);
+}
+
+void SchemaArray::unpack(BinaryReader &reader, int depth) const {
+    BinaryItem item;
+    if (!reader.read_item(item))
+        return;
+    if (item.kind != BinaryItem::ARRAY) {
+        reader.skip_contents(item, depth);
+        return;
+    }
+
+    if (m_value.reserve)
+        m_value.reserve(item.size);
+    for (uint64_t n = 0; n < item.size && !reader.failed; n++) {
+        if (m_value.element_schema)
+            reader.unpack_typed(*m_value.element_schema, m_value.append_element(), depth + 1);
+        else if (m_value.element_kind != ValueConverter::CUSTOM)
+            reader.unpack_primitive(m_value.element_kind, m_value.append_element(), depth + 1);
+        else
+            reader.unpack_schema(m_value.append(), depth + 1);
+    }
+}
+
+void SchemaObject::pack(BinaryWriter &writer) const {
+    writer.map(m_value.size());
+    for (const auto &field : m_value) {
+        writer.text(field.first.str().data(), field.first.str().size());
+        writer.schema(field.second);
+    }
+}
+
+void SchemaObject::unpack(BinaryReader &reader, int depth) const {
+    BinaryItem item;
+    if (!reader.read_item(item))
+        return;
+    if (item.kind != BinaryItem::MAP) {
+        reader.skip_contents(item, depth);
+        return;
+    }
+
+    for (uint64_t n = 0; n < item.size && !reader.failed; n++) {
+        std::string_view key;
+        const Schema *field = nullptr;
+        if (reader.read_key(key, depth + 1))
+            field = find(key.data(), key.size());
+        if (reader.failed)
+            return;
+
+        if (field)
+            reader.unpack_schema(*field, depth + 1);
+        else
+            reader.skip(depth + 1);
+    }
+}
+
+void SchemaNull::pack(BinaryWriter &writer) const {
+    writer.nil();
+}
+
+void SchemaNull::unpack(BinaryReader &reader, int depth) const {
+    reader.skip(depth);
+}
+
+void SchemaTyped::pack(BinaryWriter &writer) const {
+    writer.typed(m_schema, m_object);
+}
+
+void SchemaTyped::unpack(BinaryReader &reader, int depth) const {
+    reader.unpack_typed(m_schema, m_object, depth);
+}
+
+// On failure the partial output is dropped, leaving out as it was.
+bool Schema::pack(BinaryFormat format, string &out, string &err) const {
+    const size_t start = out.size();
+    BinaryWriter writer(format, out);
+    writer.schema(*this);
+    if (!writer.failed)
+        return true;
+    out.resize(start);
+    err = move(writer.error);
+    return false;
+}
+
+bool Schema::unpack(BinaryFormat format, const char *data, size_t len, string &err) const {
+    if (!data) {
+        err = "null input";
+        return false;
+    }
+
+    BinaryReader reader { format, data, len, 0, err, false };
+    reader.unpack_schema(*this, 0);
+    return reader.finish();
+}
+
+bool TypeSchemaBase::pack(const void *object, BinaryFormat format, string &out, string &err) const {
+    const size_t start = out.size();
+    BinaryWriter writer(format, out);
+    writer.typed(*this, object);
+    if (!writer.failed)
+        return true;
+    out.resize(start);
+    err = move(writer.error);
+    return false;
+}
+
+bool TypeSchemaBase::unpack(void *object, BinaryFormat format, const char *data, size_t len, string &err) const {
+    if (!data) {
+        err = "null input";
+        return false;
+    }
+
+    BinaryReader reader { format, data, len, 0, err, false };
+    reader.unpack_typed(*this, object, 0);
+    return reader.finish();
+}
+
+/* * * * * * * * * * * * * * * * * * * *
+ * Snapshots
+ */
+
+/* snapshot_run_size(kind)
+ *
+ * The size of one element of the given kind, if arrays of it are stored as a single run
+ * copied straight to and from memory, or 0.
+ */
+static size_t snapshot_run_size(ValueConverter::Kind kind) {
+    switch (kind) {
+    case ValueConverter::INT:    return sizeof(int);
+    case ValueConverter::FLOAT:  return sizeof(float);
+    case ValueConverter::DOUBLE: return sizeof(double);
+    default:                     return 0;
+    }
+}
+
+/* SnapshotShape
+ *
+ * Hashes (64-bit FNV-1a) the shape of a schema: its keys, the nesting of its objects and
+ * arrays, and the kind of each primitive, which together determine the snapshot layout.
+ * A string has the same shape whether it is bound to a string or a string_view.
+ */
+struct SnapshotShape {
+    uint64_t hash = 14695981039346656037u;
+
+    void add(const void *data, size_t size) {
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        for (size_t i = 0; i < size; i++) {
+            hash ^= bytes[i];
+            hash *= 1099511628211u;
+        }
+    }
+
+    void tag(char tag) {
+        add(&tag, 1);
+    }
+
+    void count(uint64_t count) {
+        add(&count, sizeof count);
+    }
+
+    void key(const string &key) {
+        count(key.size());
+        add(key.data(), key.size());
+    }
+
+    void primitive(ValueConverter::Kind kind) {
+        tag('p');
+        tag(static_cast<char>(kind == ValueConverter::STRING_VIEW ? ValueConverter::STRING : kind));
+    }
+
+    void schema(const Schema &schema) {
+        schema.m_ptr->shape(*this);
+    }
+
+    void elements(const Schema::array &desc) {
+        tag('a');
+        if (desc.element_schema)
+            typed(*desc.element_schema);
+        else if (desc.element_kind != ValueConverter::CUSTOM)
+            primitive(desc.element_kind);
+        else
+            tag('d');       // Each element is prefixed with its own shape
+    }
+
+    void typed(const TypeSchemaBase &schema) {
+        tag('o');
+        count(schema.fields().size());
+        for (const auto &field : schema.fields()) {
+            key(field->key.str());
+            switch (field->type) {
+            case Schema::OBJECT:
+                typed(*field->schema);
+                break;
+            case Schema::ARRAY:
+                tag('a');
+                if (field->schema)
+                    typed(*field->schema);
+                else
+                    primitive(field->kind);
+                break;
+            default:
+                primitive(field->kind);
+                break;
+            }
+        }
+    }
+};
+
+/* SnapshotHeader
+ *
+ * The start of every snapshot, in the writer's byte order.
+ */
+struct SnapshotHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;    // snapshot_byte_order, as the writer stored it
+    uint32_t reserved;
+    uint64_t fingerprint;
+    uint64_t length;        // Of the values that follow
+};
+
+static const char snapshot_magic[4] = { 'S', '1', '1', 'S' };
+static const uint32_t snapshot_version = 2;      // 2: 64-bit string lengths
+static const uint32_t snapshot_byte_order = 0x01020304;
+
+/* SnapshotWriter
+ *
+ * Appends the bound values to out in the snapshot layout.
+ */
+struct SnapshotWriter {
+    string &out;
+
+    template <class T>
+    void put(const T &value) {
+        out.append(reinterpret_cast<const char *>(&value), sizeof value);
+    }
+
+    void text(const char *data, size_t size) {
+        put(static_cast<uint64_t>(size));
+        out.append(data, size);
+    }
+
+    void primitive(ValueConverter::Kind kind, const void *target) {
+        switch (kind) {
+        case ValueConverter::INT:
+            put(*static_cast<const int *>(target));
+            break;
+        case ValueConverter::BOOL:
+            put(static_cast<uint8_t>(*static_cast<const bool *>(target)));
+            break;
+        case ValueConverter::FLOAT:
+            put(*static_cast<const float *>(target));
+            break;
+        case ValueConverter::DOUBLE:
+            put(*static_cast<const double *>(target));
+            break;
+        case ValueConverter::STRING: {
+            const string &value = *static_cast<const string *>(target);
+            text(value.data(), value.size());
+            break;
+        }
+        case ValueConverter::STRING_VIEW: {
+            const std::string_view value = *static_cast<const std::string_view *>(target);
+            text(value.data(), value.size());
+            break;
+        }
+        case ValueConverter::CUSTOM:
+            break;
+        }
+    }
+
+    // Custom converters are stored as the JSON text of what they produce.
+    void value(const ValueConverter &converter) {
+        if (converter.kind != ValueConverter::CUSTOM) {
+            primitive(converter.kind, converter.target);
+            return;
+        }
+        Json json;
+        converter.to_json(json);
+        const string dumped = json.dump();
+        text(dumped.data(), dumped.size());
+    }
+
+    void schema(const Schema &schema) {
+        schema.m_ptr->save(*this);
+    }
+
+    // A run of count numbers, count * size bytes starting at first.
+    void run(const void *first, size_t count, size_t size) {
+        if (count)
+            out.append(static_cast<const char *>(first), count * size);
+    }
+
+    void elements(const Schema::array &desc) {
+        const size_t count = desc.size ? desc.size() : 0;
+        put(static_cast<uint64_t>(count));
+        const size_t run_size = snapshot_run_size(desc.element_kind);
+        if (desc.element_schema) {
+            for (size_t i = 0; i < count; i++)
+                typed(*desc.element_schema, desc.element(i));
+        } else if (run_size && desc.contiguous) {
+            run(count ? desc.element(0) : nullptr, count, run_size);
+        } else if (desc.element_kind != ValueConverter::CUSTOM) {
+            for (size_t i = 0; i < count; i++)
+                primitive(desc.element_kind, desc.element(i));
+        } else {
+            for (size_t i = 0; i < count; i++) {
+                const Schema element = desc.at(i);
+                SnapshotShape shape;
+                shape.schema(element);
+                put(shape.hash);
+                schema(element);
+            }
+        }
+    }
+
+    void typed(const TypeSchemaBase &schema, const void *object) {
+        // Fields only read through the object, so dropping const here is safe.
+        void *mutable_object = const_cast<void *>(object);
+        for (const auto &field : schema.fields()) {
+            switch (field->type) {
+            case Schema::OBJECT:
+                typed(*field->schema, field->target(mutable_object));
+                break;
+            case Schema::ARRAY: {
+                const size_t count = field->size(mutable_object);
+                put(static_cast<uint64_t>(count));
+                const size_t run_size = snapshot_run_size(field->kind);
+                if (field->schema) {
+                    for (size_t i = 0; i < count; i++)
+                        typed(*field->schema, field->element(mutable_object, i));
+                } else if (run_size) {
+                    run(count ? field->element(mutable_object, 0) : nullptr, count, run_size);
+                } else {
+                    for (size_t i = 0; i < count; i++)
+                        primitive(field->kind, field->element(mutable_object, i));
+                }
+                break;
+            }
+            default:
+                primitive(field->kind, field->target(mutable_object));
+                break;
+            }
+        }
+    }
+
+    // Write a header for the given fingerprint, then the values written by body.
+    template <class Body>
+    void write(uint64_t fingerprint, Body body) {
+        const size_t start = out.size();
+        out.resize(start + sizeof(SnapshotHeader));
+        body();
+
+        SnapshotHeader header;
+        std::memcpy(header.magic, snapshot_magic, sizeof header.magic);
+        header.version = snapshot_version;
+        header.byte_order = snapshot_byte_order;
+        header.reserved = 0;
+        header.fingerprint = fingerprint;
+        header.length = out.size() - start - sizeof header;
+        std::memcpy(&out[start], &header, sizeof header);
+    }
+};
+
+/* SnapshotReader
+ *
+ * Reads a snapshot into the bound values. Everything is bounds-checked, but beyond the
+ * header a snapshot is trusted to have been written by a schema of the same shape.
  */
+struct SnapshotReader {
+    const char *data;
+    size_t len;
+    size_t i;
+    string &err;
+    bool failed;
+    bool copy_views;    // The input is released after reading, so views cannot point into it
+
+    SnapshotReader(const char *data, size_t len, string &err, bool copy_views = false)
+        : data(data), len(len), i(0), err(err), failed(false), copy_views(copy_views) {}
+
+    bool fail(string &&msg) {
+        if (!failed)
+            err = std::move(msg);
+        failed = true;
+        return false;
+    }
+
+    bool take(size_t size, const char *&bytes) {
+        if (len - i < size)
+            return fail("unexpected end of snapshot");
+        bytes = data + i;
+        i += size;
+        return true;
+    }
+
+    template <class T>
+    bool get(T &value) {
+        const char *bytes;
+        if (!take(sizeof value, bytes))
+            return false;
+        std::memcpy(&value, bytes, sizeof value);
+        return true;
+    }
+
+    // Point view at a copy of itself in the current SchemaArena.
+    bool arena_view(std::string_view &view) {
+        SchemaArena *arena = SchemaArena::current();
+        if (!arena)
+            return fail("string bound to a string_view needs a SchemaArena scope when reading a snapshot file");
+        char *copy = static_cast<char *>(arena->allocate(view.size(), 1));
+        std::memcpy(copy, view.data(), view.size());
+        view = std::string_view(copy, view.size());
+        return true;
+    }
+
+    bool text(std::string_view &value) {
+        uint64_t size;
+        const char *bytes;
+        if (!get(size))
+            return false;
+        if (size > len - i)
+            return fail("unexpected end of snapshot");
+        take(static_cast<size_t>(size), bytes);
+        value = std::string_view(bytes, static_cast<size_t>(size));
+        return true;
+    }
+
+    // Read the count of an array, and the run of count numbers of size bytes that follows
+    // if size is not 0.
+    bool count(uint64_t &count, size_t size, const char *&first) {
+        if (!get(count))
+            return false;
+        if (size && count > (len - i) / size)
+            return fail("unexpected end of snapshot");
+        first = data + i;
+        i += size * count;
+        return true;
+    }
+
+    void primitive(ValueConverter::Kind kind, void *target) {
+        std::string_view view;
+        switch (kind) {
+        case ValueConverter::INT:
+            get(*static_cast<int *>(target));
+            break;
+        case ValueConverter::BOOL: {
+            uint8_t value = 0;
+            get(value);
+            *static_cast<bool *>(target) = value != 0;
+            break;
+        }
+        case ValueConverter::FLOAT:
+            get(*static_cast<float *>(target));
+            break;
+        case ValueConverter::DOUBLE:
+            get(*static_cast<double *>(target));
+            break;
+        case ValueConverter::STRING:
+            if (text(view))
+                static_cast<string *>(target)->assign(view.data(), view.size());
+            break;
+        case ValueConverter::STRING_VIEW:
+            if (text(view) && (!copy_views || arena_view(view)))
+                *static_cast<std::string_view *>(target) = view;
+            break;
+        case ValueConverter::CUSTOM:
+            break;
+        }
+    }
+
+    void value(const ValueConverter &converter) {
+        if (converter.kind != ValueConverter::CUSTOM) {
+            primitive(converter.kind, converter.target);
+            return;
+        }
+        std::string_view view;
+        if (!text(view))
+            return;
+        string parse_err;
+        const Json json = Json::parse(string(view), parse_err);
+        if (!parse_err.empty()) {
+            fail("bad custom value in snapshot: " + parse_err);
+            return;
+        }
+        converter.from_json(json);
+    }
 
-Schema::Schema() noexcept                  : m_ptr(statics().null) {}
-Schema::Schema(std::nullptr_t) noexcept    : m_ptr(statics().null) {}
-Schema::Schema(int &value) : m_ptr(make_shared<SchemaNumber>(PrimitiveConverter(value))) {}
-Schema::Schema(float &value) : m_ptr(make_shared<SchemaNumber>(PrimitiveConverter(value))) {}
-Schema::Schema(double &value) : m_ptr(make_shared<SchemaNumber>(PrimitiveConverter(value))) {}
-Schema::Schema(bool &value) : m_ptr(make_shared<SchemaBoolean>(PrimitiveConverter(value))) {}
-Schema::Schema(std::string &value) : m_ptr(make_shared<SchemaString>(PrimitiveConverter(value))) {}
-Schema::Schema(const Schema::array &desc)  : m_ptr(make_shared<SchemaArray>(desc)) {}
-Schema::Schema(const Schema::object &values) : m_ptr(make_shared<SchemaObject>(values)) {}
-Schema::Schema(Schema::object &&values)      : m_ptr(make_shared<SchemaObject>(move(values))) {}
+    void schema(const Schema &schema) {
+        schema.m_ptr->load(*this);
+    }
 
-/* * * * * * * * * * * * * * * * * * * *
- * Accessors
- */
+    void elements(const Schema::array &desc) {
+        const size_t run_size = desc.contiguous && desc.append_elements ? snapshot_run_size(desc.element_kind) : 0;
+        uint64_t n;
+        const char *first;
+        if (!count(n, run_size, first))
+            return;
 
-Schema::Type Schema::type()                           const { return m_ptr->type();         }
-// double Schema::number_value()                       const { return m_ptr->number_value(); }
-// int Schema::int_value()                             const { return m_ptr->int_value();    }
-// bool Schema::bool_value()                           const { return m_ptr->bool_value();   }
-// const string & Schema::string_value()               const { return m_ptr->string_value(); }
-// const vector<Schema> & Schema::array_items()          const { return m_ptr->array_items();  }
-const map<string, Schema> & Schema::object_items()    const { return m_ptr->object_items(); }
-const Schema & Schema::operator[] (size_t i)          const { return (*m_ptr)[i];           }
-const Schema & Schema::operator[] (const string &key) const { return (*m_ptr)[key];         }
+        if (run_size) {
+            if (n) {
+                const size_t start = desc.size();
+                desc.append_elements(n);
+                std::memcpy(desc.element(start), first, n * run_size);
+            }
+            return;
+        }
 
-// double                    SchemaValue::number_value()              const { return 0; }
-// int                       SchemaValue::int_value()                 const { return 0; }
-// bool                      SchemaValue::bool_value()                const { return false; }
-// const string &            SchemaValue::string_value()              const { return statics().empty_string; }
-// const vector<Schema> &      SchemaValue::array_items()               const { return statics().empty_vector; }
-const map<string, Schema> & SchemaValue::object_items()              const { return statics().empty_map; }
-const Schema &              SchemaValue::operator[] (size_t)         const { return static_null(); }
-const Schema &              SchemaValue::operator[] (const string &) const { return static_null(); }
+        if (desc.reserve)
+            desc.reserve(std::min<uint64_t>(n, len - i));
+        for (uint64_t e = 0; e < n && !failed; e++) {
+            if (desc.element_schema) {
+                typed(*desc.element_schema, desc.append_element());
+            } else if (desc.element_kind != ValueConverter::CUSTOM) {
+                primitive(desc.element_kind, desc.append_element());
+            } else {
+                uint64_t hash;
+                if (!get(hash))
+                    return;
+                const Schema element = desc.append();
+                SnapshotShape shape;
+                shape.schema(element);
+                if (shape.hash != hash) {
+                    fail("snapshot array element written under a different schema");
+                    return;
+                }
+                schema(element);
+            }
+        }
+    }
 
-const Schema & SchemaObject::operator[] (const string &key) const {
-    auto iter = m_value.find(key);
-    return (iter == m_value.end()) ? static_null() : iter->second;
+    void typed(const TypeSchemaBase &schema, void *object) {
+        for (const auto &field : schema.fields()) {
+            if (failed)
+                return;
+            switch (field->type) {
+            case Schema::OBJECT:
+                typed(*field->schema, field->target(object));
+                break;
+            case Schema::ARRAY: {
+                const size_t run_size = field->schema ? 0 : snapshot_run_size(field->kind);
+                uint64_t n;
+                const char *first;
+                if (!count(n, run_size, first))
+                    return;
+                field->clear(object);
+                if (run_size) {
+                    field->resize(object, n);
+                    if (n)
+                        std::memcpy(field->element(object, 0), first, n * run_size);
+                    break;
+                }
+                field->reserve(object, std::min<uint64_t>(n, len - i));
+                for (uint64_t e = 0; e < n && !failed; e++) {
+                    void *element = field->append(object);
+                    if (field->schema)
+                        typed(*field->schema, element);
+                    else
+                        primitive(field->kind, element);
+                }
+                break;
+            }
+            default:
+                primitive(field->kind, field->target(object));
+                break;
+            }
+        }
+    }
+
+    // Check the header against the reader's fingerprint, then read the values with body.
+    template <class Body>
+    bool read(uint64_t fingerprint, Body body) {
+        SnapshotHeader header;
+        if (len < sizeof header || std::memcmp(data, snapshot_magic, sizeof header.magic) != 0)
+            return fail("not a snapshot");
+        std::memcpy(&header, data, sizeof header);
+        if (header.byte_order != snapshot_byte_order)
+            return fail("snapshot written with a different byte order");
+        if (header.version != snapshot_version)
+            return fail("unsupported snapshot version " + std::to_string(header.version));
+        if (header.fingerprint != fingerprint)
+            return fail("snapshot written under a different schema");
+        if (header.length != len - sizeof header)
+            return fail(header.length > len - sizeof header ? "unexpected end of snapshot"
+                                                            : "unexpected trailing bytes in snapshot");
+
+        i = sizeof header;
+        body();
+        if (failed)
+            return false;
+        if (i != len)
+            return fail("unexpected trailing bytes in snapshot");
+        return true;
+    }
+};
+
+template <Schema::Type tag>
+void Value<tag>::save(SnapshotWriter &writer) const {
+    writer.value(m_valueConverter);
+}
+
+template <Schema::Type tag>
+void Value<tag>::load(SnapshotReader &reader) const {
+    reader.value(m_valueConverter);
+}
+
+template <Schema::Type tag>
+void Value<tag>::shape(SnapshotShape &shape) const {
+    if (m_valueConverter.kind != ValueConverter::CUSTOM) {
+        shape.primitive(m_valueConverter.kind);
+        return;
+    }
+    shape.tag('c');
+    shape.tag(static_cast<char>(tag));
+}
+
+void SchemaArray::save(SnapshotWriter &writer) const {
+    writer.elements(m_value);
+}
+
+void SchemaArray::load(SnapshotReader &reader) const {
+    reader.elements(m_value);
+}
+
+void SchemaArray::shape(SnapshotShape &shape) const {
+    shape.elements(m_value);
+}
+
+void SchemaObject::save(SnapshotWriter &writer) const {
+    for (const auto &field : m_value)
+        writer.schema(field.second);
+}
+
+void SchemaObject::load(SnapshotReader &reader) const {
+    for (const auto &field : m_value) {
+        if (reader.failed)
+            return;
+        reader.schema(field.second);
+    }
+}
+
+void SchemaObject::shape(SnapshotShape &shape) const {
+    shape.tag('o');
+    shape.count(m_value.size());
+    for (const auto &field : m_value) {
+        shape.key(field.first.str());
+        shape.schema(field.second);
+    }
+}
+
+void SchemaNull::save(SnapshotWriter &) const {}
+
+void SchemaNull::load(SnapshotReader &) const {}
+
+void SchemaNull::shape(SnapshotShape &shape) const {
+    shape.tag('n');
+}
+
+void SchemaTyped::save(SnapshotWriter &writer) const {
+    writer.typed(m_schema, m_object);
+}
+
+void SchemaTyped::load(SnapshotReader &reader) const {
+    reader.typed(m_schema, m_object);
+}
+
+void SchemaTyped::shape(SnapshotShape &shape) const {
+    shape.typed(m_schema);
+}
+
+uint64_t Schema::fingerprint() const {
+    SnapshotShape shape;
+    shape.schema(*this);
+    return shape.hash;
+}
+
+void Schema::write_snapshot(string &out) const {
+    SnapshotWriter writer { out };
+    writer.write(fingerprint(), [&] { writer.schema(*this); });
+}
+
+bool Schema::read_snapshot(const char *data, size_t len, string &err) const {
+    if (!data) {
+        err = "null input";
+        return false;
+    }
+
+    SnapshotReader reader(data, len, err);
+    return reader.read(fingerprint(), [&] { reader.schema(*this); });
+}
+
+uint64_t TypeSchemaBase::fingerprint() const {
+    SnapshotShape shape;
+    shape.typed(*this);
+    return shape.hash;
+}
+
+void TypeSchemaBase::write_snapshot(const void *object, string &out) const {
+    SnapshotWriter writer { out };
+    writer.write(fingerprint(), [&] { writer.typed(*this, object); });
+}
+
+bool TypeSchemaBase::read_snapshot(void *object, const char *data, size_t len, string &err) const {
+    if (!data) {
+        err = "null input";
+        return false;
+    }
+
+    SnapshotReader reader(data, len, err);
+    return reader.read(fingerprint(), [&] { reader.typed(*this, object); });
 }
-// const Schema & SchemaArray::operator[] (size_t i) const {
-//     if (i >= m_value.size()) return static_null();
-//     else return m_value[i];
-// }
 
 /* * * * * * * * * * * * * * * * * * * *
- * Comparison
+ * Mapped files
  */
 
-bool Schema::operator== (const Schema &other) const {
-    if (m_ptr->type() != other.m_ptr->type())
+MappedFile::~MappedFile() {
+    close();
+}
+
+MappedFile::MappedFile(MappedFile &&other) noexcept
+    : m_data(other.m_data), m_size(other.m_size), m_mapped(other.m_mapped) {
+    other.m_data = nullptr;
+    other.m_size = 0;
+    other.m_mapped = false;
+}
+
+MappedFile &MappedFile::operator=(MappedFile &&other) noexcept {
+    if (this != &other) {
+        close();
+        std::swap(m_data, other.m_data);
+        std::swap(m_size, other.m_size);
+        std::swap(m_mapped, other.m_mapped);
+    }
+    return *this;
+}
+
+bool MappedFile::open(const string &path, string &err) {
+    close();
+
+    int fd;
+    do {
+        fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    } while (fd < 0 && errno == EINTR);
+    if (fd < 0) {
+        err = "cannot open " + path + ": " + strerror(errno);
         return false;
+    }
 
-    return m_ptr->equals(other.m_ptr.get());
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        err = "cannot stat " + path + ": " + strerror(errno);
+        ::close(fd);
+        return false;
+    }
+
+    // An empty file cannot be mapped, but is still a valid (empty) input
+    m_size = static_cast<size_t>(info.st_size);
+    if (m_size == 0) {
+        m_data = "";
+        ::close(fd);
+        return true;
+    }
+
+    void *data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    const int map_errno = errno;
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        err = "cannot map " + path + ": " + strerror(map_errno);
+        m_size = 0;
+        return false;
+    }
+
+#if defined(MADV_SEQUENTIAL)
+    // A failed hint does no harm
+    madvise(data, m_size, MADV_SEQUENTIAL);
+#endif
+    m_data = static_cast<const char *>(data);
+    m_mapped = true;
+    return true;
 }
 
-bool Schema::operator< (const Schema &other) const {
-    if (m_ptr->type() != other.m_ptr->type())
-        return m_ptr->type() < other.m_ptr->type();
+void MappedFile::close() {
+    if (m_mapped)
+        munmap(const_cast<char *>(m_data), m_size);
+    m_data = nullptr;
+    m_size = 0;
+    m_mapped = false;
+}
 
-    return m_ptr->less(other.m_ptr.get());
+// The mapping is released on return, so the parser copies strings bound to string_views.
+bool Schema::from_file(const string &path, string &err) const {
+    MappedFile file;
+    if (!file.open(path, err))
+        return false;
+
+    SchemaParser parser(file.data(), file.size(), err);
+    parser.copy_views = true;
+    parser.parse_schema(*this, 0);
+    return parser.finish();
 }
 
-void Schema::from_json(const json11::Json &json) const
-{
-	m_ptr->from_json(json);
+bool TypeSchemaBase::from_file(void *object, const string &path, string &err) const {
+    MappedFile file;
+    if (!file.open(path, err))
+        return false;
+
+    SchemaParser parser(file.data(), file.size(), err);
+    parser.copy_views = true;
+    parser.parse_typed(*this, object, 0);
+    return parser.finish();
 }
 
-void Schema::to_json(json11::Json &json) const
-{
-	m_ptr->to_json(json);
+bool Schema::read_snapshot_file(const string &path, string &err) const {
+    MappedFile file;
+    if (!file.open(path, err))
+        return false;
+
+    SnapshotReader reader(file.data(), file.size(), err, true);
+    return reader.read(fingerprint(), [&] { reader.schema(*this); });
+}
+
+bool TypeSchemaBase::read_snapshot_file(void *object, const string &path, string &err) const {
+    MappedFile file;
+    if (!file.open(path, err))
+        return false;
+
+    SnapshotReader reader(file.data(), file.size(), err, true);
+    return reader.read(fingerprint(), [&] { reader.typed(*this, object); });
 }
 
 /* * * * * * * * * * * * * * * * * * * *
- * Parsing
+ * JSON Lines
  */
 
-/* esc(c)
+JsonLinesReader::JsonLinesReader(std::istream &input, size_t buffer_size)
+    : m_stream(&input), m_buffer(std::max<size_t>(buffer_size, 1)) {}
+
+JsonLinesReader::JsonLinesReader(int fd, size_t buffer_size)
+    : m_fd(fd), m_buffer(std::max<size_t>(buffer_size, 1)) {}
+
+/* fill()
  *
- * Format char c suitable for printing in an error message.
+ * Move the unread data to the front of the buffer, growing it if a single line fills it
+ * completely, and read more after it. Return false once nothing more can be read.
  */
-// static inline string esc(char c) {
-//     char buf[12];
-//     if (static_cast<uint8_t>(c) >= 0x20 && static_cast<uint8_t>(c) <= 0x7f) {
-//         snprintf(buf, sizeof buf, "'%c' (%d)", c, c);
-//     } else {
-//         snprintf(buf, sizeof buf, "(%d)", c);
-//     }
-//     return string(buf);
-// }
-//
-// static inline bool in_range(long x, long lower, long upper) {
-//     return (x >= lower && x <= upper);
-// }
-//
-// /* SchemaParser
-//  *
-//  * Object that tracks all state of an in-progress parse.
-//  */
-// struct SchemaParser {
-//
-//     /* State
-//      */
-//     const string &str;
-//     size_t i;
-//     string &err;
-//     bool failed;
-//     const SchemaParse strategy;
-//
-//     /* fail(msg, err_ret = Schema())
-//      *
-//      * Mark this parse as failed.
-//      */
-//     Schema fail(string &&msg) {
-//         return fail(move(msg), Schema());
-//     }
-//
-//     template <typename T>
-//     T fail(string &&msg, const T err_ret) {
-//         if (!failed)
-//             err = std::move(msg);
-//         failed = true;
-//         return err_ret;
-//     }
-//
-//     /* consume_whitespace()
-//      *
-//      * Advance until the current character is non-whitespace.
-//      */
-//     void consume_whitespace() {
-//         while (str[i] == ' ' || str[i] == '\r' || str[i] == '\n' || str[i] == '\t')
-//             i++;
-//     }
-//
-//     /* consume_comment()
-//      *
-//      * Advance comments (c-style inline and multiline).
-//      */
-//     bool consume_comment() {
-//       bool comment_found = false;
-//       if (str[i] == '/') {
-//         i++;
-//         if (i == str.size())
-//           return fail("unexpected end of input inside comment", 0);
-//         if (str[i] == '/') { // inline comment
-//           i++;
-//           if (i == str.size())
-//             return fail("unexpected end of input inside inline comment", 0);
-//           // advance until next line
-//           while (str[i] != '\n') {
-//             i++;
-//             if (i == str.size())
-//               return fail("unexpected end of input inside inline comment", 0);
-//           }
-//           comment_found = true;
-//         }
-//         else if (str[i] == '*') { // multiline comment
-//           i++;
-//           if (i > str.size()-2)
-//             return fail("unexpected end of input inside multi-line comment", 0);
-//           // advance until closing tokens
-//           while (!(str[i] == '*' && str[i+1] == '/')) {
-//             i++;
-//             if (i > str.size()-2)
-//               return fail(
-//                 "unexpected end of input inside multi-line comment", 0);
-//           }
-//           i += 2;
-//           if (i == str.size())
-//             return fail(
-//               "unexpected end of input inside multi-line comment", 0);
-//           comment_found = true;
-//         }
-//         else
-//           return fail("malformed comment", 0);
-//       }
-//       return comment_found;
-//     }
-//
-//     /* consume_garbage()
-//      *
-//      * Advance until the current character is non-whitespace and non-comment.
-//      */
-//     void consume_garbage() {
-//       consume_whitespace();
-//       if(strategy == SchemaParse::COMMENTS) {
-//         bool comment_found = false;
-//         do {
-//           comment_found = consume_comment();
-//           consume_whitespace();
-//         }
-//         while(comment_found);
-//       }
-//     }
-//
-//     /* get_next_token()
-//      *
-//      * Return the next non-whitespace character. If the end of the input is reached,
-//      * flag an error and return 0.
-//      */
-//     char get_next_token() {
-//         consume_garbage();
-//         if (i == str.size())
-//             return fail("unexpected end of input", 0);
-//
-//         return str[i++];
-//     }
-//
-//     /* encode_utf8(pt, out)
-//      *
-//      * Encode pt as UTF-8 and add it to out.
-//      */
-//     void encode_utf8(long pt, string & out) {
-//         if (pt < 0)
-//             return;
-//
-//         if (pt < 0x80) {
-//             out += static_cast<char>(pt);
-//         } else if (pt < 0x800) {
-//             out += static_cast<char>((pt >> 6) | 0xC0);
-//             out += static_cast<char>((pt & 0x3F) | 0x80);
-//         } else if (pt < 0x10000) {
-//             out += static_cast<char>((pt >> 12) | 0xE0);
-//             out += static_cast<char>(((pt >> 6) & 0x3F) | 0x80);
-//             out += static_cast<char>((pt & 0x3F) | 0x80);
-//         } else {
-//             out += static_cast<char>((pt >> 18) | 0xF0);
-//             out += static_cast<char>(((pt >> 12) & 0x3F) | 0x80);
-//             out += static_cast<char>(((pt >> 6) & 0x3F) | 0x80);
-//             out += static_cast<char>((pt & 0x3F) | 0x80);
-//         }
-//     }
-//
-//     /* parse_string()
-//      *
-//      * Parse a string, starting at the current position.
-//      */
-//     string parse_string() {
-//         string out;
-//         long last_escaped_codepoint = -1;
-//         while (true) {
-//             if (i == str.size())
-//                 return fail("unexpected end of input in string", "");
-//
-//             char ch = str[i++];
-//
-//             if (ch == '"') {
-//                 encode_utf8(last_escaped_codepoint, out);
-//                 return out;
-//             }
-//
-//             if (in_range(ch, 0, 0x1f))
-//                 return fail("unescaped " + esc(ch) + " in string", "");
-//
-//             // The usual case: non-escaped characters
-//             if (ch != '\\') {
-//                 encode_utf8(last_escaped_codepoint, out);
-//                 last_escaped_codepoint = -1;
-//                 out += ch;
-//                 continue;
-//             }
-//
-//             // Handle escapes
-//             if (i == str.size())
-//                 return fail("unexpected end of input in string", "");
-//
-//             ch = str[i++];
-//
-//             if (ch == 'u') {
-//                 // Extract 4-byte escape sequence
-//                 string esc = str.substr(i, 4);
-//                 // Explicitly check length of the substring. The following loop
-//                 // relies on std::string returning the terminating NUL when
-//                 // accessing str[length]. Checking here reduces brittleness.
-//                 if (esc.length() < 4) {
-//                     return fail("bad \\u escape: " + esc, "");
-//                 }
-//                 for (int j = 0; j < 4; j++) {
-//                     if (!in_range(esc[j], 'a', 'f') && !in_range(esc[j], 'A', 'F')
-//                             && !in_range(esc[j], '0', '9'))
-//                         return fail("bad \\u escape: " + esc, "");
-//                 }
-//
-//                 long codepoint = strtol(esc.data(), nullptr, 16);
-//
-//                 // JSON specifies that characters outside the BMP shall be encoded as a pair
-//                 // of 4-hex-digit \u escapes encoding their surrogate pair components. Check
-//                 // whether we're in the middle of such a beast: the previous codepoint was an
-//                 // escaped lead (high) surrogate, and this is a trail (low) surrogate.
-//                 if (in_range(last_escaped_codepoint, 0xD800, 0xDBFF)
-//                         && in_range(codepoint, 0xDC00, 0xDFFF)) {
-//                     // Reassemble the two surrogate pairs into one astral-plane character, per
-//                     // the UTF-16 algorithm.
-//                     encode_utf8((((last_escaped_codepoint - 0xD800) << 10)
-//                                  | (codepoint - 0xDC00)) + 0x10000, out);
-//                     last_escaped_codepoint = -1;
-//                 } else {
-//                     encode_utf8(last_escaped_codepoint, out);
-//                     last_escaped_codepoint = codepoint;
-//                 }
-//
-//                 i += 4;
-//                 continue;
-//             }
-//
-//             encode_utf8(last_escaped_codepoint, out);
-//             last_escaped_codepoint = -1;
-//
-//             if (ch == 'b') {
-//                 out += '\b';
-//             } else if (ch == 'f') {
-//                 out += '\f';
-//             } else if (ch == 'n') {
-//                 out += '\n';
-//             } else if (ch == 'r') {
-//                 out += '\r';
-//             } else if (ch == 't') {
-//                 out += '\t';
-//             } else if (ch == '"' || ch == '\\' || ch == '/') {
-//                 out += ch;
-//             } else {
-//                 return fail("invalid escape character " + esc(ch), "");
-//             }
-//         }
-//     }
-//
-//     /* parse_number()
-//      *
-//      * Parse a double.
-//      */
-//     Schema parse_number() {
-//         size_t start_pos = i;
-//
-//         if (str[i] == '-')
-//             i++;
-//
-//         // Integer part
-//         if (str[i] == '0') {
-//             i++;
-//             if (in_range(str[i], '0', '9'))
-//                 return fail("leading 0s not permitted in numbers");
-//         } else if (in_range(str[i], '1', '9')) {
-//             i++;
-//             while (in_range(str[i], '0', '9'))
-//                 i++;
-//         } else {
-//             return fail("invalid " + esc(str[i]) + " in number");
-//         }
-//
-//         if (str[i] != '.' && str[i] != 'e' && str[i] != 'E'
-//                 && (i - start_pos) <= static_cast<size_t>(std::numeric_limits<int>::digits10)) {
-//             return std::atoi(str.c_str() + start_pos);
-//         }
-//
-//         // Decimal part
-//         if (str[i] == '.') {
-//             i++;
-//             if (!in_range(str[i], '0', '9'))
-//                 return fail("at least one digit required in fractional part");
-//
-//             while (in_range(str[i], '0', '9'))
-//                 i++;
-//         }
-//
-//         // Exponent part
-//         if (str[i] == 'e' || str[i] == 'E') {
-//             i++;
-//
-//             if (str[i] == '+' || str[i] == '-')
-//                 i++;
-//
-//             if (!in_range(str[i], '0', '9'))
-//                 return fail("at least one digit required in exponent");
-//
-//             while (in_range(str[i], '0', '9'))
-//                 i++;
-//         }
-//
-//         return std::strtod(str.c_str() + start_pos, nullptr);
-//     }
-//
-//     /* expect(str, res)
-//      *
-//      * Expect that 'str' starts at the character that was just read. If it does, advance
-//      * the input and return res. If not, flag an error.
-//      */
-//     Schema expect(const string &expected, Schema res) {
-//         assert(i != 0);
-//         i--;
-//         if (str.compare(i, expected.length(), expected) == 0) {
-//             i += expected.length();
-//             return res;
-//         } else {
-//             return fail("parse error: expected " + expected + ", got " + str.substr(i, expected.length()));
-//         }
-//     }
-//
-//     /* parse_json()
-//      *
-//      * Parse a JSON object.
-//      */
-//     Schema parse_json(int depth) {
-//         if (depth > max_depth) {
-//             return fail("exceeded maximum nesting depth");
-//         }
-//
-//         char ch = get_next_token();
-//         if (failed)
-//             return Schema();
-//
-//         if (ch == '-' || (ch >= '0' && ch <= '9')) {
-//             i--;
-//             return parse_number();
-//         }
-//
-//         if (ch == 't')
-//             return expect("true", true);
-//
-//         if (ch == 'f')
-//             return expect("false", false);
-//
-//         if (ch == 'n')
-//             return expect("null", Schema());
-//
-//         if (ch == '"')
-//             return parse_string();
-//
-//         if (ch == '{') {
-//             map<string, Schema> data;
-//             ch = get_next_token();
-//             if (ch == '}')
-//                 return data;
-//
-//             while (1) {
-//                 if (ch != '"')
-//                     return fail("expected '\"' in object, got " + esc(ch));
-//
-//                 string key = parse_string();
-//                 if (failed)
-//                     return Schema();
-//
-//                 ch = get_next_token();
-//                 if (ch != ':')
-//                     return fail("expected ':' in object, got " + esc(ch));
-//
-//                 data[std::move(key)] = parse_json(depth + 1);
-//                 if (failed)
-//                     return Schema();
-//
-//                 ch = get_next_token();
-//                 if (ch == '}')
-//                     break;
-//                 if (ch != ',')
-//                     return fail("expected ',' in object, got " + esc(ch));
-//
-//                 ch = get_next_token();
-//             }
-//             return data;
-//         }
-//
-//         if (ch == '[') {
-//             vector<Schema> data;
-//             ch = get_next_token();
-//             if (ch == ']')
-//                 return data;
-//
-//             while (1) {
-//                 i--;
-//                 data.push_back(parse_json(depth + 1));
-//                 if (failed)
-//                     return Schema();
-//
-//                 ch = get_next_token();
-//                 if (ch == ']')
-//                     break;
-//                 if (ch != ',')
-//                     return fail("expected ',' in list, got " + esc(ch));
-//
-//                 ch = get_next_token();
-//                 (void)ch;
-//             }
-//             return data;
-//         }
-//
-//         return fail("expected value, got " + esc(ch));
-//     }
-// };
-//
-// Schema Schema::parse(const string &in, string &err, SchemaParse strategy) {
-//     SchemaParser parser { in, 0, err, false, strategy };
-//     Schema result = parser.parse_json(0);
-//
-//     // Check for any trailing garbage
-//     parser.consume_garbage();
-//     if (parser.i != in.size())
-//         return parser.fail("unexpected trailing " + esc(in[parser.i]));
-//
-//     return result;
-// }
-//
-// // Documented in schema11.hpp
-// vector<Schema> Schema::parse_multi(const string &in,
-//                                string &err,
-//                                SchemaParse strategy) {
-//     SchemaParser parser { in, 0, err, false, strategy };
-//
-//     vector<Schema> json_vec;
-//     while (parser.i != in.size() && !parser.failed) {
-//         json_vec.push_back(parser.parse_json(0));
-//         // Check for another object
-//         parser.consume_garbage();
-//     }
-//     return json_vec;
-// }
-//
+bool JsonLinesReader::fill() {
+    if (m_eof)
+        return false;
+
+    if (m_begin > 0) {
+        std::memmove(m_buffer.data(), m_buffer.data() + m_begin, m_end - m_begin);
+        m_end -= m_begin;
+        m_begin = 0;
+    }
+    if (m_end == m_buffer.size())
+        m_buffer.resize(m_buffer.size() * 2);
+
+    char *data = m_buffer.data() + m_end;
+    const size_t size = m_buffer.size() - m_end;
+    size_t count = 0;
+    if (m_stream) {
+        m_stream->read(data, static_cast<std::streamsize>(size));
+        count = static_cast<size_t>(m_stream->gcount());
+        if (m_stream->bad())
+            m_error = "read error";
+    } else {
+        ssize_t result;
+        do {
+            result = ::read(m_fd, data, size);
+        } while (result < 0 && errno == EINTR);
+        if (result < 0)
+            m_error = string("read error: ") + strerror(errno);
+        else
+            count = static_cast<size_t>(result);
+    }
+
+    m_end += count;
+    if (count == 0 || !m_error.empty())
+        m_eof = true;
+    return count > 0;
+}
+
+bool JsonLinesReader::next(const char *&data, size_t &length) {
+    size_t scanned = m_begin;
+    while (true) {
+        const char *newline = static_cast<const char *>(
+            memchr(m_buffer.data() + scanned, '\n', m_end - scanned));
+        size_t line_end;
+        if (newline) {
+            line_end = newline - m_buffer.data();
+        } else {
+            // Everything pending has been scanned; fill() may move it to the front
+            const size_t pending = m_end - m_begin;
+            if (fill()) {
+                scanned = m_begin + pending;
+                continue;
+            }
+            if (m_begin == m_end)
+                return false;
+            line_end = m_end;   // The last line need not end with a newline
+        }
+
+        // fill() may have moved the line, so only take its address now
+        m_line++;
+        data = m_buffer.data() + m_begin;
+        length = line_end - m_begin;
+        m_begin = std::min(line_end + 1, m_end);
+        scanned = m_begin;
+
+        // Skip blank lines, including the \r of a bare CRLF
+        bool blank = true;
+        for (size_t i = 0; i < length && blank; i++)
+            blank = data[i] == ' ' || data[i] == '\t' || data[i] == '\r';
+        if (!blank)
+            return true;
+    }
+}
+
+size_t JsonLinesReader::read_lines(const LineParser &parse, const std::function<void()> &on_record,
+                                   const ErrorHandler &on_error) {
+    size_t records = 0;
+    const char *data;
+    size_t length;
+    string err;
+    while (next(data, length)) {
+        err.clear();
+        if (parse(data, length, err)) {
+            records++;
+            on_record();
+        } else {
+            on_error(m_line, err);
+        }
+    }
+    if (!m_error.empty())
+        on_error(m_line + 1, m_error);
+    return records;
+}
+
+size_t JsonLinesReader::read(const Schema &schema, const std::function<void()> &on_record,
+                             const ErrorHandler &on_error) {
+    return read_lines([&schema](const char *data, size_t length, string &err) {
+        return schema.parse_into(data, length, err);
+    }, on_record, on_error);
+}
+
 // /* * * * * * * * * * * * * * * * * * * *
 //  * Shape-checking
 //  */
@@ -801,37 +5409,43 @@ void Schema::to_json(json11::Json &json) const
 //     return true;
 // }
 
+/* primitive_converter<T>(value)
+ *
+ * Bind value through the built-in conversion for its kind, which needs no allocation.
+ */
 template <typename T>
-ValueConverter PrimitiveConverter(T & value, std::function<T(const json11::Json &)> fromJson)
+static ValueConverter primitive_converter(T & value)
 {
-	return ValueConverter {
-		.from_json = [&value, fromJson](const Json & json) {
-			value = fromJson(json);
-		},
-		.to_json = [&value](Json &json) {
-			json = Json(value);
-		}
-	};
+	ValueConverter converter;
+	converter.kind = PrimitiveKind<T>::kind;
+	converter.target = &value;
+	converter.from_json = { [](void *target, const Json &json) { primitive_from_json(PrimitiveKind<T>::kind, target, json); }, &value };
+	converter.to_json = { [](void *target, Json &json) { primitive_to_json(PrimitiveKind<T>::kind, target, json); }, &value };
+	return converter;
 }
 ValueConverter PrimitiveConverter(int & value)
 {
-	return PrimitiveConverter<int>(value, &json11::Json::int_value);
+	return primitive_converter(value);
 }
 ValueConverter PrimitiveConverter(bool & value)
 {
-	return PrimitiveConverter<bool>(value, &json11::Json::bool_value);
+	return primitive_converter(value);
 }
 ValueConverter PrimitiveConverter(float & value)
 {
-	return PrimitiveConverter<float>(value, &json11::Json::number_value);
+	return primitive_converter(value);
 }
 ValueConverter PrimitiveConverter(double & value)
 {
-	return PrimitiveConverter<double>(value, &json11::Json::number_value);
+	return primitive_converter(value);
 }
 ValueConverter PrimitiveConverter(string & value)
 {
-	return PrimitiveConverter<std::string>(value, &json11::Json::string_value);
+	return primitive_converter(value);
+}
+ValueConverter PrimitiveConverter(std::string_view & value)
+{
+	return primitive_converter(value);
 }
 
 } // namespace schema11
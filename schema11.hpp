@@ -1,11 +1,15 @@
 #pragma once
 
+#include <cstdint>
 #include <functional>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
 #include <memory>
+#include <type_traits>
 #include <initializer_list>
+#include <iosfwd>
 
 namespace json11 {
 	class Json;
@@ -14,11 +18,242 @@ namespace json11 {
 namespace schema11 {
     
 class SchemaValue;
+class CompiledSchema;
+class TypeSchemaBase;
+class KeyTable;
+struct SchemaParser;
+struct BinaryWriter;
+struct BinaryReader;
+struct SnapshotWriter;
+struct SnapshotReader;
+struct SnapshotShape;
+struct DeltaEncoder;
+
+// Thread safety
+//
+// Schemas are immutable once built, and decoding keeps its scratch state (parser position,
+// key buffers, partially built json11 values) on the calling thread's stack. So:
+//
+//  - A TypeSchema<T>, or a type with a StaticSchema, may be used to decode into and encode
+//    from different instances on any number of threads at once. This is the way to share
+//    one schema definition between worker threads.
+//  - A Schema or CompiledSchema is bound to particular variables. It may be used from
+//    several threads at once only to encode, or to decode into distinct variables; two
+//    threads decoding into the same variables race on them, as with any other write.
+//  - Custom ValueConverters and the callbacks of a Schema::array are called from the
+//    decoding thread (from several, for arrays decoded in parallel) and must be safe to
+//    call concurrently if the schema is used that way.
+//  - Building schemas is safe on any thread; interning keys takes a process-wide lock, and
+//    a SchemaArena scope applies to the thread that opened it.
+
+// Hash a field key (FNV-1a). Usable at compile time, so that static schemas can hash
+// their keys ahead of time.
+constexpr uint32_t KeyHash(const char *key, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= static_cast<uint8_t>(key[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Symbol
+ *
+ * An interned field key. Each distinct key is stored once, with its hash, in a process-wide
+ * table and never freed, so a Symbol is a single pointer: cheap to copy, and equal to
+ * another exactly when the pointers are. Interning takes a lock, so it happens when
+ * schemas are built rather than while decoding; decoders only look symbols up.
+ */
+class Symbol {
+public:
+    struct Entry {
+        std::string name;
+        uint32_t hash;
+    };
+
+    Symbol();                                   // The empty key
+    Symbol(const char *key);
+    Symbol(const std::string &key);
+    Symbol(const char *key, size_t length);
+
+    // Set symbol and return true if key has been interned; never adds to the table.
+    static bool Lookup(const char *key, size_t length, Symbol &symbol);
+
+    const std::string &str() const { return m_entry->name; }
+    operator const std::string &() const { return m_entry->name; }
+    uint32_t hash() const { return m_entry->hash; }
+
+    friend bool operator==(Symbol lhs, Symbol rhs) { return lhs.m_entry == rhs.m_entry; }
+    friend bool operator!=(Symbol lhs, Symbol rhs) { return lhs.m_entry != rhs.m_entry; }
+    // Symbols are ordered by their text, like the strings they stand for.
+    friend bool operator<(Symbol lhs, Symbol rhs) {
+        return lhs.m_entry != rhs.m_entry && lhs.m_entry->name < rhs.m_entry->name;
+    }
+
+private:
+    explicit Symbol(const Entry *entry) : m_entry(entry) {}
+
+    const Entry *m_entry;
+};
+
+/* SchemaArena
+ *
+ * A monotonic allocator for schema trees. While a SchemaArena::Scope is active on a thread,
+ * the nodes of every Schema constructed on that thread, and their reference counts and
+ * field tables, are carved out of the arena's blocks rather than allocated one by one.
+ * Nothing is freed until the arena is reset or destroyed, which releases it all at once.
+ *
+ *     SchemaArena arena;
+ *     {
+ *         SchemaArena::Scope scope(arena);
+ *         Schema schema = MakeRequestSchema(request);
+ *         schema.parse_into(body, err);
+ *     }
+ *
+ * The arena must outlive every Schema built in its scope. Schemas built outside a scope
+ * are allocated as usual. Strings with escapes that are parsed into a string_view while
+ * a scope is active are decoded into its arena too, and live as long as it does, as are
+ * all strings parsed into a string_view by from_file.
+ */
+class SchemaArena {
+public:
+    explicit SchemaArena(size_t block_size = 16 * 1024);
+    ~SchemaArena();
+    SchemaArena(const SchemaArena &) = delete;
+    SchemaArena &operator=(const SchemaArena &) = delete;
+
+    // Return size bytes aligned to alignment, which must be a power of two.
+    void *allocate(size_t size, size_t alignment);
+
+    // Release every block. No Schema built in the arena may still be alive.
+    void reset();
+
+    // The number of bytes handed out since construction or the last reset().
+    size_t allocated() const { return m_allocated; }
+
+    // The arena of the innermost active Scope on this thread, or nullptr.
+    static SchemaArena *current();
+
+    class Scope {
+    public:
+        explicit Scope(SchemaArena &arena);
+        ~Scope();
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+    private:
+        SchemaArena *m_previous;
+    };
+
+private:
+    struct Block;
+    Block *m_blocks = nullptr;
+    char *m_next = nullptr;
+    char *m_end = nullptr;
+    const size_t m_block_size;
+    size_t m_allocated = 0;
+};
+
+// The binary encodings that schemas can read and write besides JSON text.
+enum BinaryFormat {
+    MSGPACK,    // MessagePack
+    CBOR        // CBOR (RFC 8949)
+};
+
+/* DirtyMask
+ *
+ * One bit per field of an object, set by merge_patch for each field a patch wrote. Bits
+ * are numbered by the field's slot in key order, which is the order of both
+ * Schema::object_items and TypeSchemaBase::fields. They accumulate over any number of
+ * patches until clear is called.
+ */
+class DirtyMask {
+public:
+    size_t size() const { return m_size; }
+    bool test(size_t i) const {
+        return i < m_size && ((m_words[i / 64] >> (i % 64)) & 1);
+    }
+    void set(size_t i) {
+        m_words[i / 64] |= uint64_t(1) << (i % 64);
+    }
+
+    // Make room for n fields, keeping the bits already set.
+    void resize(size_t n);
+    // Set the bits of the first n fields.
+    void set_all(size_t n);
+    void clear();
+    bool any() const;
+    size_t count() const;
+
+private:
+    std::vector<uint64_t> m_words;
+    size_t m_size = 0;
+};
+
+/* DeltaBaseline
+ *
+ * What a delta encoder last sent of a schema's values: a hash of each field's encoding,
+ * and for nested objects, a baseline per field. A default-constructed or cleared
+ * baseline has sent nothing, so the next delta is the whole document.
+ */
+class DeltaBaseline {
+public:
+    void clear() {
+        m_sent = false;
+        m_fields.clear();
+        m_json.reset();
+    }
+
+private:
+    friend struct DeltaEncoder;
+    bool m_sent = false;
+    uint64_t m_hash = 0;
+    std::vector<DeltaBaseline> m_fields;            // Objects, by field slot
+    std::shared_ptr<const json11::Json> m_json;    // Objects behind custom converters
+};
 
 struct ValueConverter
 {
-	std::function<void(const json11::Json &)> from_json = [](const json11::Json &){};
-	std::function<void(json11::Json &)> to_json = [](json11::Json &){};
+	// The built-in primitive conversions record what they are bound to, so that the
+	// direct parser can write into the target without going through a json11::Json.
+	// Custom converters are only reachable through from_json/to_json.
+	enum Kind {
+		CUSTOM, INT, BOOL, FLOAT, DOUBLE, STRING, STRING_VIEW
+	};
+
+	// A conversion. The built-in ones are a plain function and the address it converts,
+	// so binding a primitive never allocates and converting is a direct call; anything
+	// else assigned to it is type-erased in a std::function.
+	template <class Arg>
+	class Conversion {
+	public:
+		typedef void (*Function)(void *target, Arg json);
+
+		Conversion() {}
+		Conversion(Function function, void *target) : m_function(function), m_target(target) {}
+		template <class F, class = typename std::enable_if<
+			!std::is_same<typename std::decay<F>::type, Conversion>::value
+			&& std::is_constructible<std::function<void(Arg)>, F>::value>::type>
+		Conversion(F custom) : m_custom(std::move(custom)) {}
+
+		void operator()(Arg json) const {
+			if (m_function)
+				m_function(m_target, json);
+			else if (m_custom)
+				m_custom(json);
+		}
+
+	private:
+		Function m_function = nullptr;
+		void *m_target = nullptr;
+		std::function<void(Arg)> m_custom;
+	};
+
+	Kind kind = CUSTOM;
+	void *target = nullptr;
+
+	Conversion<const json11::Json &> from_json;
+	Conversion<json11::Json &> to_json;
 };
 
 class Schema {
@@ -28,9 +263,68 @@ public:
         NUL, NUMBER, BOOL, STRING, ARRAY, OBJECT
     };
 
-    // Array and object typedefs
-    typedef std::pair<std::function<Schema()>, std::function<void()>> array; 
-    typedef std::map<std::string, Schema> object;
+    // Array descriptor, usually created by ArraySchema. Elements are constructed in place
+    // at the end of the bound container and then decoded: through element_schema when it
+    // is set, as a primitive of element_kind when that is not CUSTOM, and otherwise
+    // through the Schema returned by append.
+    // Existing elements are encoded the same way, through at or element.
+    struct array {
+        std::function<void(size_t)> reserve;        // Make room for n more elements
+        std::function<Schema()> append;             // Append an element, return its Schema
+        std::function<void *()> append_element;     // Append an element, return its address
+        std::function<size_t()> size;               // Return the number of elements
+        std::function<Schema(size_t)> at;           // Return the Schema of element i
+        std::function<void *(size_t)> element;      // Return the address of element i
+        std::function<void(size_t)> append_elements;  // Append n elements at once
+        std::function<void()> clear;                // Remove all elements
+        std::shared_ptr<const TypeSchemaBase> element_schema;
+        ValueConverter::Kind element_kind = ValueConverter::CUSTOM;
+        // Elements lie one after another, as in a std::vector, so that element(0) can be
+        // used to copy a run of numbers at once.
+        bool contiguous = false;
+
+        // Opt in to decoding arrays of at least this many elements on several threads
+        // (0, the default, never does). The elements are appended up front and each
+        // thread decodes its own chunks in place, so the result is the same as decoding
+        // them in order, as long as the element conversions do not share state. The
+        // threads are a pool started on first use, and an array nested in one already
+        // being decoded in parallel is decoded on the thread that reaches it.
+        // Applies to from_json, which has the whole array at hand.
+        size_t parallel_threshold = 0;
+    };
+    // The fields of an object, kept sorted by key in one contiguous vector. Schemas are
+    // built once and then searched and iterated many times, which suits a flat map better
+    // than a node per field. As with std::map, a duplicate key keeps its first value.
+    // Keys are interned Symbols.
+    class object {
+    public:
+        typedef std::pair<Symbol, Schema> value_type;
+        typedef std::vector<value_type>::const_iterator const_iterator;
+        typedef const_iterator iterator;
+
+        object() {}
+        object(std::initializer_list<value_type> items);
+        template <class It>
+        object(It first, It last) : m_items(first, last) { sort(); }
+
+        size_t size() const { return m_items.size(); }
+        bool empty() const { return m_items.empty(); }
+        const_iterator begin() const { return m_items.begin(); }
+        const_iterator end() const { return m_items.end(); }
+
+        // Return the field with the given key, or end().
+        const_iterator find(const std::string &key) const;
+        size_t count(const std::string &key) const { return find(key) != end() ? 1 : 0; }
+
+        // Add a field, keeping the fields sorted. Return false, and leave the object
+        // unchanged, if the key is already present.
+        bool insert(value_type item);
+
+    private:
+        void sort();
+
+        std::vector<value_type> m_items;
+    };
 
     // Constructors for the various types of JSON value.
     Schema() noexcept;                // NUL
@@ -40,9 +334,14 @@ public:
     Schema(double &value);
     Schema(bool &value);
     Schema(std::string &value);
+    // A string_view is pointed into the input it is decoded from, which must outlive it.
+    // Strings with escapes are decoded into the current SchemaArena instead.
+    Schema(std::string_view &value);
     Schema(const array &values);      // ARRAY
     Schema(const object &values);     // OBJECT
     Schema(object &&values);          // OBJECT
+    Schema(const TypeSchemaBase &schema, void *object);  // OBJECT, see TypeSchema<T>::bind
+    Schema(Type type, const ValueConverter &converter);  // Any type, converted by converter
 
     // Implicit constructor: anything with a to_json() function.
     template <class T, class = decltype(&T::to_json)>
@@ -87,7 +386,7 @@ public:
     // const std::string &string_value() const;
     // // Return the enclosed std::vector if this is an array, or an empty vector otherwise.
     // const array &array_items() const;
-    // Return the enclosed std::map if this is an object, or an empty map otherwise.
+    // Return the enclosed fields if this is an object, or an empty object otherwise.
     const object &object_items() const;
 
     // Return a reference to arr[i] if this is an array, Schema() otherwise.
@@ -98,10 +397,92 @@ public:
 	void from_json(const json11::Json &json) const;
 	void to_json(json11::Json &json) const;
 
-    // Serialize.
+	// Apply a JSON Merge Patch (RFC 7386) to the bound values. Only the fields present
+	// in patch are written, so a small patch to a large object costs only its own
+	// fields. Objects in the patch are merged recursively; a null resets its field, as
+	// an absent key does in from_json, since bound fields cannot be removed; anything
+	// else, arrays included, replaces the field. A patch that is not an object replaces
+	// the whole value. If dirty is given, the bit of each field of this object that the
+	// patch wrote is set in it. Replacing an array takes the clear callback of its
+	// descriptor; if one is missing, return false and assign an error message to err,
+	// leaving the array as it was and the fields patched before it with their new values.
+	bool merge_patch(const json11::Json &patch, std::string &err) const;
+	bool merge_patch(const json11::Json &patch, DirtyMask &dirty, std::string &err) const;
+
+	// Delta encoding, the other half of merge_patch: set patch to a merge patch holding
+	// only the values that changed since baseline was last updated, and update it. Each
+	// value is hashed as dump encodes it, and only changed ones are converted to JSON;
+	// arrays are sent whole when they change, and objects behind custom converters as a
+	// diff of their JSON. Values that encode as null, such as null fields and NaNs,
+	// are left out, since in a merge patch a null deletes its field; they are sent once
+	// they change to something else. Return false, with patch an empty object, if
+	// nothing changed.
+	bool to_json_delta(DeltaBaseline &baseline, json11::Json &patch) const;
+	// Or, without a baseline, set patch to the fields of this object marked in dirty.
+	void to_json_delta(const DirtyMask &dirty, json11::Json &patch) const;
+
+	// Parse JSON text straight into the bound values, without building a json11::Json
+	// tree first. Keys that are not part of the schema are skipped, and bound values
+	// whose key is absent from the input are left untouched. If parsing fails, return
+	// false and assign an error message to err; values parsed before the failure keep
+	// their new contents. Bound string_views point into data.
+	bool parse_into(const char *data, size_t len, std::string &err) const;
+	bool parse_into(const std::string &in, std::string &err) const {
+		return parse_into(in.data(), in.size(), err);
+	}
+	// Parse the file at path straight from a read-only memory mapping of it, without
+	// copying it into memory first. Errors opening the file are reported through err.
+	// The mapping is released on return, so bound string_views are copied into the
+	// current SchemaArena, and fail to parse if there is none; to point them into the
+	// file instead, open a MappedFile and parse_into its contents.
+	bool from_file(const std::string &path, std::string &err) const;
+
+	// Encode the bound values as MessagePack or CBOR, appending to out, or decode them
+	// from it, with no json11::Json in between except for custom converters. Objects
+	// are maps keyed by strings, and decoding follows parse_into: unknown keys are
+	// skipped, values of the wrong type reset their target, and bound string_views
+	// point into data. MessagePack cannot hold a string, array or map of more than
+	// 2^32 - 1 bytes or items; packing one returns false, leaving out as it was, and
+	// the overload returning a string returns an empty one.
+	bool pack(BinaryFormat format, std::string &out, std::string &err) const;
+	std::string pack(BinaryFormat format) const {
+		std::string out, err;
+		pack(format, out, err);
+		return out;
+	}
+	bool unpack(BinaryFormat format, const char *data, size_t len, std::string &err) const;
+	bool unpack(BinaryFormat format, const std::string &in, std::string &err) const {
+		return unpack(format, in.data(), in.size(), err);
+	}
+
+	// Snapshots: a compact binary image of the bound values, for reloading them quickly,
+	// say to warm a cache at startup. The layout follows the schema, so nothing but the
+	// values is stored: numbers as they are in memory (vectors of them in one run) and
+	// strings with a length prefix. The header carries the schema's fingerprint, a hash
+	// of its keys and types, and a snapshot is only read back under the same fingerprint
+	// and byte order. Values are read in as parse_into would; string_views point into
+	// data, except that read_snapshot_file, which releases its mapping on return, copies
+	// them into the current SchemaArena and fails without one.
+	void write_snapshot(std::string &out) const;
+	bool read_snapshot(const char *data, size_t len, std::string &err) const;
+	bool read_snapshot(const std::string &in, std::string &err) const {
+		return read_snapshot(in.data(), in.size(), err);
+	}
+	bool read_snapshot_file(const std::string &path, std::string &err) const;
+	uint64_t fingerprint() const;
+
+	// Flatten this schema into a CompiledSchema that decodes the same bound values
+	// without virtual dispatch. The compiled form shares this schema's nodes.
+	CompiledSchema compile() const;
+
+    // Serialize the bound values, appending to out. Nothing is built in between: each value
+    // is formatted straight into out. dump_size() returns the exact number of bytes dump()
+    // will append, so that out can be reserved up front and grown only once.
     void dump(std::string &out) const;
+    size_t dump_size() const;
     std::string dump() const {
         std::string out;
+        out.reserve(dump_size());
         dump(out);
         return out;
     }
@@ -142,19 +523,92 @@ public:
     // bool has_shape(const shape & types, std::string & err) const;
 
 private:
+    friend struct SchemaParser;
+    friend struct BinaryWriter;
+    friend struct BinaryReader;
+    friend struct SnapshotWriter;
+    friend struct SnapshotReader;
+    friend struct SnapshotShape;
+    friend struct DeltaEncoder;
+    friend class CompiledSchema;
     std::shared_ptr<SchemaValue> m_ptr;
 };
 
+/* CompiledSchema
+ *
+ * A Schema flattened into a contiguous instruction array. Each object's fields occupy
+ * a contiguous range of instructions, and primitive fields hold their target pointer
+ * directly, so from_json runs as a loop over the program with no virtual calls and no
+ * std::function calls. Array elements and custom converters still go through their
+ * type-erased callbacks, since their targets are only known at decode time.
+ */
+class CompiledSchema {
+public:
+    enum Op : uint8_t {
+        NUL, INT, BOOL, FLOAT, DOUBLE, STRING, CUSTOM, ARRAY, OBJECT
+    };
+
+    struct Instruction {
+        Op op = NUL;
+        Symbol key;                                 // Key in the parent object
+        void *target = nullptr;                     // INT, BOOL, FLOAT, DOUBLE, STRING
+        const ValueConverter *converter = nullptr;  // CUSTOM
+        const Schema::array *array = nullptr;       // ARRAY
+        uint32_t first_child = 0;                   // OBJECT: fields are
+        uint32_t end_child = 0;                     // [first_child, end_child)
+    };
+
+    explicit CompiledSchema(const Schema &schema);
+
+    void from_json(const json11::Json &json) const;
+
+    // Binary encodings go through the schema this was compiled from.
+    bool pack(BinaryFormat format, std::string &out, std::string &err) const {
+        return m_schema.pack(format, out, err);
+    }
+    bool unpack(BinaryFormat format, const char *data, size_t len, std::string &err) const {
+        return m_schema.unpack(format, data, len, err);
+    }
+
+    const std::vector<Instruction> &program() const { return m_program; }
+
+private:
+    void compile(const Schema &schema, size_t index);
+    void run(size_t index, const json11::Json &json) const;
+
+    Schema m_schema;
+    std::vector<Instruction> m_program;
+};
+
 // Internal class hierarchy - SchemaValue objects are not exposed to users of this API.
 class SchemaValue {
 protected:
     friend class Schema;
+    friend struct SchemaParser;
+    friend struct BinaryWriter;
+    friend struct BinaryReader;
+    friend struct SnapshotWriter;
+    friend struct SnapshotReader;
+    friend struct SnapshotShape;
+    friend struct DeltaEncoder;
+    friend class CompiledSchema;
     virtual Schema::Type type() const = 0;
     virtual bool equals(const SchemaValue * other) const = 0;
     virtual bool less(const SchemaValue * other) const = 0;
 	virtual void from_json(const json11::Json &json) const = 0;
 	virtual void to_json(json11::Json &json) const = 0;
+	virtual bool merge_patch(const json11::Json &patch, DirtyMask *dirty, std::string &err) const = 0;
+	virtual bool delta(DeltaEncoder &encoder, DeltaBaseline &baseline, json11::Json &patch) const = 0;
+	virtual void delta(const DirtyMask &dirty, json11::Json &patch) const = 0;
+	virtual void parse(SchemaParser &parser, int depth) const = 0;
+	virtual void compile(CompiledSchema::Instruction &instruction) const = 0;
     virtual void dump(std::string &out) const = 0;
+    virtual size_t dump_size() const = 0;
+    virtual void pack(BinaryWriter &writer) const = 0;
+    virtual void unpack(BinaryReader &reader, int depth) const = 0;
+    virtual void save(SnapshotWriter &writer) const = 0;
+    virtual void load(SnapshotReader &reader) const = 0;
+    virtual void shape(SnapshotShape &shape) const = 0;
 
 
     // virtual const Schema::array &array_items() const;
@@ -164,24 +618,510 @@ protected:
     virtual ~SchemaValue() {}
 };
 
+// Serialize a primitive value. These are shared with the header-only encoders.
+void dump(int value, std::string &out);
+void dump(double value, std::string &out);
+void dump(float value, std::string &out);
+void dump(bool value, std::string &out);
+void dump(std::string_view value, std::string &out);
+size_t dump_size(int value);
+size_t dump_size(double value);
+size_t dump_size(float value);
+size_t dump_size(bool value);
+size_t dump_size(std::string_view value);
+
 ValueConverter PrimitiveConverter(int & value);
 ValueConverter PrimitiveConverter(bool & value);
 ValueConverter PrimitiveConverter(float & value);
 ValueConverter PrimitiveConverter(double & value);
 ValueConverter PrimitiveConverter(std::string & value);
+ValueConverter PrimitiveConverter(std::string_view & value);
 
+// Bind a vector whose elements are described by a Schema-returning function. Elements are
+// appended to the vector.
 template <class T>
 Schema::array ArraySchema(std::vector<T> & array, std::function<Schema(T &)> schema)
 {
-    auto v = std::make_shared<T>();
-    return {
-        [=] {
-            return schema(*v);
-        },
-        [&array, v] {
-            array.push_back(*v);
+    Schema::array desc;
+    desc.reserve = [&array](size_t n) {
+        array.reserve(array.size() + n);
+    };
+    desc.append = [&array, schema] {
+        array.emplace_back();
+        return schema(array.back());
+    };
+    desc.clear = [&array] {
+        array.clear();
+    };
+    desc.append_elements = [&array](size_t n) {
+        array.resize(array.size() + n);
+    };
+    desc.size = [&array] {
+        return array.size();
+    };
+    desc.at = [&array, schema](size_t i) {
+        return schema(array[i]);
+    };
+    return desc;
+}
+
+// The elements of a vector<bool> are bits, which cannot be bound by reference, so each is
+// bound through a scratch bool copied back into the vector once it has been decoded. As
+// neighbouring bits share storage, these arrays must not be decoded in parallel.
+template <>
+Schema::array ArraySchema<bool>(std::vector<bool> & array, std::function<Schema(bool &)> schema);
+
+/* PrimitiveKind<T>
+ *
+ * Maps the primitive types that can be bound to their converter kind and schema type.
+ */
+template <class T> struct PrimitiveKind;
+template <> struct PrimitiveKind<int> {
+    static constexpr ValueConverter::Kind kind = ValueConverter::INT;
+    static constexpr Schema::Type type = Schema::NUMBER;
+};
+template <> struct PrimitiveKind<bool> {
+    static constexpr ValueConverter::Kind kind = ValueConverter::BOOL;
+    static constexpr Schema::Type type = Schema::BOOL;
+};
+template <> struct PrimitiveKind<float> {
+    static constexpr ValueConverter::Kind kind = ValueConverter::FLOAT;
+    static constexpr Schema::Type type = Schema::NUMBER;
+};
+template <> struct PrimitiveKind<double> {
+    static constexpr ValueConverter::Kind kind = ValueConverter::DOUBLE;
+    static constexpr Schema::Type type = Schema::NUMBER;
+};
+template <> struct PrimitiveKind<std::string> {
+    static constexpr ValueConverter::Kind kind = ValueConverter::STRING;
+    static constexpr Schema::Type type = Schema::STRING;
+};
+template <> struct PrimitiveKind<std::string_view> {
+    static constexpr ValueConverter::Kind kind = ValueConverter::STRING_VIEW;
+    static constexpr Schema::Type type = Schema::STRING;
+};
+
+/* TypeSchemaBase
+ *
+ * The type-erased part of a TypeSchema<T>. Each field knows how to find itself within an
+ * instance passed as a void pointer, so the conversion code is not a template and lives
+ * in schema11.cpp with the rest of the json11 handling. Copies share the same fields.
+ */
+class TypeSchemaBase {
+public:
+    struct Field {
+        Field(Symbol key, Schema::Type type, ValueConverter::Kind kind,
+              std::shared_ptr<const TypeSchemaBase> schema)
+            : key(key), type(type), kind(kind), schema(std::move(schema)) {}
+        virtual ~Field() {}
+
+        const Symbol key;
+        const Schema::Type type;                             // NUMBER, BOOL, STRING, ARRAY or OBJECT
+        const ValueConverter::Kind kind;                     // Primitive fields and array elements
+        const std::shared_ptr<const TypeSchemaBase> schema;  // Object fields and array elements
+
+        // Return a pointer to this field within object.
+        virtual void *target(void *object) const = 0;
+
+        // Array fields only: manage the elements of the vector within object.
+        virtual void clear(void *) const {}
+        virtual void reserve(void *, size_t) const {}
+        virtual void resize(void *, size_t) const {}
+        virtual void *append(void *) const { return nullptr; }
+        virtual size_t size(void *) const { return 0; }
+        virtual void *element(void *, size_t) const { return nullptr; }
+    };
+    typedef std::vector<std::shared_ptr<const Field>> fields_type;
+
+    // Fields are kept sorted by key.
+    const fields_type &fields() const { return *m_fields; }
+
+    // Return the field with the given key, or nullptr if there is none.
+    const Field *find(const char *key, size_t length) const;
+
+    void from_json(void *object, const json11::Json &json) const;
+    void to_json(const void *object, json11::Json &json) const;
+    void merge_patch(void *object, const json11::Json &patch, DirtyMask *dirty) const;
+    bool to_json_delta(const void *object, DeltaBaseline &baseline, json11::Json &patch) const;
+    void to_json_delta(const void *object, const DirtyMask &dirty, json11::Json &patch) const;
+    bool parse_into(void *object, const char *data, size_t len, std::string &err) const;
+    bool from_file(void *object, const std::string &path, std::string &err) const;
+    void dump(const void *object, std::string &out) const;
+    size_t dump_size(const void *object) const;
+    bool pack(const void *object, BinaryFormat format, std::string &out, std::string &err) const;
+    bool unpack(void *object, BinaryFormat format, const char *data, size_t len, std::string &err) const;
+    void write_snapshot(const void *object, std::string &out) const;
+    bool read_snapshot(void *object, const char *data, size_t len, std::string &err) const;
+    bool read_snapshot_file(void *object, const std::string &path, std::string &err) const;
+    uint64_t fingerprint() const;
+
+protected:
+    explicit TypeSchemaBase(fields_type fields);
+
+private:
+    std::shared_ptr<const fields_type> m_fields;
+    std::shared_ptr<const KeyTable> m_keys;
+};
+
+/* TypeSchema<T>
+ *
+ * A schema bound to a type rather than to one instance. It is built once from
+ * pointers-to-members and can then decode into any number of T instances, without
+ * building any Schema nodes per instance:
+ *
+ *     static const TypeSchema<Idea> schema {
+ *         { "id", &Idea::_Id },
+ *         { "imageLayers", &Idea::_ImageLayers, imageLayerSchema }
+ *     };
+ *     schema.from_json(json, idea);
+ *
+ * Members may be primitives, vectors of primitives, or nested objects and vectors of
+ * nested objects described by their own TypeSchema. Unlike ArraySchema, vectors are
+ * replaced rather than appended to. A TypeSchema is immutable, so one instance can be
+ * shared by every thread that decodes or encodes a T.
+ */
+template <class T>
+class TypeSchema : public TypeSchemaBase {
+    template <class M>
+    struct MemberField : Field {
+        MemberField(Symbol key, Schema::Type type, ValueConverter::Kind kind,
+                    std::shared_ptr<const TypeSchemaBase> schema, M T::*member)
+            : Field(key, type, kind, std::move(schema)), member(member) {}
+
+        void *target(void *object) const override {
+            return &(static_cast<T *>(object)->*member);
+        }
+
+        M T::*member;
+    };
+
+    template <class E>
+    struct ArrayField final : MemberField<std::vector<E>> {
+        using MemberField<std::vector<E>>::MemberField;
+
+        std::vector<E> &array(void *object) const {
+            return static_cast<T *>(object)->*this->member;
+        }
+        void clear(void *object) const override {
+            array(object).clear();
+        }
+        void reserve(void *object, size_t n) const override {
+            array(object).reserve(n);
+        }
+        void resize(void *object, size_t n) const override {
+            array(object).resize(n);
+        }
+        void *append(void *object) const override {
+            auto &elements = array(object);
+            elements.emplace_back();
+            return &elements.back();
+        }
+        size_t size(void *object) const override {
+            return array(object).size();
+        }
+        void *element(void *object, size_t i) const override {
+            return &array(object)[i];
         }
     };
+
+public:
+    class Member {
+    public:
+        template <class M>
+        Member(Symbol key, M T::*member)
+            : m_field(std::make_shared<MemberField<M>>(key, PrimitiveKind<M>::type,
+                                                       PrimitiveKind<M>::kind, nullptr, member)) {}
+
+        template <class N>
+        Member(Symbol key, N T::*member, const TypeSchema<N> &schema)
+            : m_field(std::make_shared<MemberField<N>>(key, Schema::OBJECT, ValueConverter::CUSTOM,
+                                                       std::make_shared<TypeSchemaBase>(schema), member)) {}
+
+        template <class E>
+        Member(Symbol key, std::vector<E> T::*member)
+            : m_field(std::make_shared<ArrayField<E>>(key, Schema::ARRAY,
+                                                      PrimitiveKind<E>::kind, nullptr, member)) {}
+
+        template <class E>
+        Member(Symbol key, std::vector<E> T::*member, const TypeSchema<E> &schema)
+            : m_field(std::make_shared<ArrayField<E>>(key, Schema::ARRAY, ValueConverter::CUSTOM,
+                                                      std::make_shared<TypeSchemaBase>(schema), member)) {}
+
+    private:
+        friend class TypeSchema;
+        std::shared_ptr<const Field> m_field;
+    };
+
+    TypeSchema(std::initializer_list<Member> members) : TypeSchemaBase(collect(members)) {}
+
+    void from_json(const json11::Json &json, T &value) const {
+        TypeSchemaBase::from_json(&value, json);
+    }
+
+    // Apply a JSON Merge Patch, as Schema::merge_patch does.
+    void merge_patch(const json11::Json &patch, T &value) const {
+        TypeSchemaBase::merge_patch(&value, patch, nullptr);
+    }
+    void merge_patch(const json11::Json &patch, T &value, DirtyMask &dirty) const {
+        TypeSchemaBase::merge_patch(&value, patch, &dirty);
+    }
+
+    bool parse_into(const char *data, size_t len, T &value, std::string &err) const {
+        return TypeSchemaBase::parse_into(&value, data, len, err);
+    }
+    bool parse_into(const std::string &in, T &value, std::string &err) const {
+        return TypeSchemaBase::parse_into(&value, in.data(), in.size(), err);
+    }
+    bool from_file(const std::string &path, T &value, std::string &err) const {
+        return TypeSchemaBase::from_file(&value, path, err);
+    }
+
+    void to_json(const T &value, json11::Json &json) const {
+        TypeSchemaBase::to_json(&value, json);
+    }
+
+    // Encode a merge patch of what changed, as Schema::to_json_delta does.
+    bool to_json_delta(const T &value, DeltaBaseline &baseline, json11::Json &patch) const {
+        return TypeSchemaBase::to_json_delta(&value, baseline, patch);
+    }
+    void to_json_delta(const T &value, const DirtyMask &dirty, json11::Json &patch) const {
+        TypeSchemaBase::to_json_delta(&value, dirty, patch);
+    }
+
+    void dump(const T &value, std::string &out) const {
+        TypeSchemaBase::dump(&value, out);
+    }
+    size_t dump_size(const T &value) const {
+        return TypeSchemaBase::dump_size(&value);
+    }
+
+    std::string dump(const T &value) const {
+        std::string out;
+        out.reserve(dump_size(value));
+        dump(value, out);
+        return out;
+    }
+
+    bool pack(BinaryFormat format, const T &value, std::string &out, std::string &err) const {
+        return TypeSchemaBase::pack(&value, format, out, err);
+    }
+    std::string pack(BinaryFormat format, const T &value) const {
+        std::string out, err;
+        pack(format, value, out, err);
+        return out;
+    }
+    bool unpack(BinaryFormat format, const char *data, size_t len, T &value, std::string &err) const {
+        return TypeSchemaBase::unpack(&value, format, data, len, err);
+    }
+    bool unpack(BinaryFormat format, const std::string &in, T &value, std::string &err) const {
+        return TypeSchemaBase::unpack(&value, format, in.data(), in.size(), err);
+    }
+
+    void write_snapshot(const T &value, std::string &out) const {
+        TypeSchemaBase::write_snapshot(&value, out);
+    }
+    bool read_snapshot(const char *data, size_t len, T &value, std::string &err) const {
+        return TypeSchemaBase::read_snapshot(&value, data, len, err);
+    }
+    bool read_snapshot(const std::string &in, T &value, std::string &err) const {
+        return TypeSchemaBase::read_snapshot(&value, in.data(), in.size(), err);
+    }
+    bool read_snapshot_file(const std::string &path, T &value, std::string &err) const {
+        return TypeSchemaBase::read_snapshot_file(&value, path, err);
+    }
+
+    // Return a Schema for one instance, to embed a TypeSchema within a Schema tree.
+    Schema bind(T &value) const {
+        return Schema(*this, &value);
+    }
+
+private:
+    static fields_type collect(std::initializer_list<Member> members) {
+        fields_type result;
+        result.reserve(members.size());
+        for (const auto &member : members)
+            result.push_back(member.m_field);
+        return result;
+    }
+};
+
+// Bind a vector of primitives. Elements are appended to the vector and decoded in place,
+// without building a Schema for each one.
+template <class T>
+Schema::array ArraySchema(std::vector<T> & array)
+{
+    Schema::array desc;
+    desc.reserve = [&array](size_t n) {
+        array.reserve(array.size() + n);
+    };
+    desc.append_element = [&array]() -> void * {
+        array.emplace_back();
+        return &array.back();
+    };
+    desc.clear = [&array] {
+        array.clear();
+    };
+    desc.size = [&array] {
+        return array.size();
+    };
+    desc.element = [&array](size_t i) -> void * {
+        return &array[i];
+    };
+    desc.append_elements = [&array](size_t n) {
+        array.resize(array.size() + n);
+    };
+    desc.element_kind = PrimitiveKind<T>::kind;
+    desc.contiguous = true;
+    return desc;
 }
 
-}
\ No newline at end of file
+// Bind a vector whose elements are described by a TypeSchema. Elements are appended to
+// the vector and decoded in place, without building a Schema for each one.
+template <class T>
+Schema::array ArraySchema(std::vector<T> & array, const TypeSchema<T> & schema)
+{
+    Schema::array desc;
+    desc.reserve = [&array](size_t n) {
+        array.reserve(array.size() + n);
+    };
+    desc.append_element = [&array]() -> void * {
+        array.emplace_back();
+        return &array.back();
+    };
+    desc.clear = [&array] {
+        array.clear();
+    };
+    desc.size = [&array] {
+        return array.size();
+    };
+    desc.element = [&array](size_t i) -> void * {
+        return &array[i];
+    };
+    desc.append_elements = [&array](size_t n) {
+        array.resize(array.size() + n);
+    };
+    desc.element_schema = std::make_shared<TypeSchemaBase>(schema);
+    desc.contiguous = true;
+    return desc;
+}
+
+/* StructuralIndex
+ *
+ * The positions of the structural characters of a JSON text: every '{', '}', '[', ']', ':'
+ * and ',' outside a string, and every opening quote. The input is classified 64 bytes at a
+ * time, with AVX2 or SSE2 where the CPU supports them, and quotes inside strings are told
+ * apart from the rest by tracking escapes and string boundaries across each block as bit
+ * masks, so a later pass can jump from structure to structure without reading the bytes in
+ * between. The parser indexes large inputs this way, a chunk at a time, to skip unbound
+ * values.
+ */
+class StructuralIndex {
+public:
+    enum Implementation { AUTO, SCALAR, SSE2, AVX2 };
+
+    // An implementation the CPU does not support falls back to the best one it does.
+    explicit StructuralIndex(Implementation implementation = AUTO) : m_implementation(implementation) {}
+
+    // Index len bytes of data, replacing any previous index. Return false if the input
+    // ends inside a string, or is longer than the 4 GiB that 32-bit positions can address.
+    bool build(const char *data, size_t len);
+
+    const std::vector<uint32_t> &positions() const { return m_positions; }
+
+    // The fastest implementation this CPU supports.
+    static Implementation best();
+
+private:
+    Implementation m_implementation;
+    std::vector<uint32_t> m_positions;
+};
+
+/* MappedFile
+ *
+ * A read-only memory mapping of a whole file, advised for sequential access, so that it
+ * can be parsed in place. Unmapped when destroyed.
+ */
+class MappedFile {
+public:
+    MappedFile() {}
+    ~MappedFile();
+    MappedFile(MappedFile &&other) noexcept;
+    MappedFile &operator=(MappedFile &&other) noexcept;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    // Map the file at path, replacing any current mapping. Return false and assign a
+    // message to err if it cannot be opened or mapped.
+    bool open(const std::string &path, std::string &err);
+    void close();
+
+    const char *data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    const char *m_data = nullptr;
+    size_t m_size = 0;
+    bool m_mapped = false;
+};
+
+/* JsonLinesReader
+ *
+ * Reads newline-delimited JSON (JSON Lines) from a std::istream or a file descriptor, one
+ * record per line, through a read-ahead buffer that is reused for every line. A file of
+ * any size streams through in memory bounded by the buffer size and the longest line.
+ *
+ *     JsonLinesReader reader(fd);
+ *     Idea idea;
+ *     reader.read(ideaSchema, idea, [&](Idea &idea) { Store(idea); },
+ *                 [](size_t line, const std::string &err) { Log(line, err); });
+ */
+class JsonLinesReader {
+public:
+    typedef std::function<void(size_t line, const std::string &err)> ErrorHandler;
+
+    explicit JsonLinesReader(std::istream &input, size_t buffer_size = 64 * 1024);
+    explicit JsonLinesReader(int fd, size_t buffer_size = 64 * 1024);
+
+    // Point data at the next line that is not blank, without its line break, and return
+    // true. Return false at the end of the input, or after a read error. The line stays
+    // valid until the next call.
+    bool next(const char *&data, size_t &length);
+
+    // The 1-based number of the line last returned by next().
+    size_t line() const { return m_line; }
+
+    // The error that ended the input early, or "" if it was read to the end.
+    const std::string &error() const { return m_error; }
+
+    // Parse each line into the values bound by schema, then call on_record. Values whose
+    // key is absent from a line keep what the previous line gave them. A line that fails
+    // to parse is passed to on_error instead, and reading carries on with the next one;
+    // so is a read error, which ends the input. Return the number of records decoded.
+    size_t read(const Schema &schema, const std::function<void()> &on_record, const ErrorHandler &on_error);
+
+    // Parse each line into record, reset to T() first, then call on_record(record).
+    template <class T, class OnRecord>
+    size_t read(const TypeSchema<T> &schema, T &record, OnRecord on_record, const ErrorHandler &on_error) {
+        return read_lines([&schema, &record](const char *data, size_t length, std::string &err) {
+            record = T();
+            return schema.parse_into(data, length, record, err);
+        }, [&on_record, &record] { on_record(record); }, on_error);
+    }
+
+private:
+    typedef std::function<bool(const char *data, size_t length, std::string &err)> LineParser;
+
+    size_t read_lines(const LineParser &parse, const std::function<void()> &on_record, const ErrorHandler &on_error);
+    bool fill();
+
+    std::istream *m_stream = nullptr;
+    int m_fd = -1;
+    std::vector<char> m_buffer;
+    size_t m_begin = 0;     // Unread data is [m_begin, m_end)
+    size_t m_end = 0;
+    bool m_eof = false;
+    size_t m_line = 0;
+    std::string m_error;
+};
+
+}
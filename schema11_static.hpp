@@ -0,0 +1,278 @@
+#pragma once
+
+#include <bitset>
+#include <cstring>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include "schema11.hpp"
+#include "third_party/json11/json11.hpp"
+
+// Compile-time schemas.
+//
+// A StaticSchema describes a struct's fields as a constexpr tuple of key/pointer-to-member
+// pairs. The decoder and encoder are then instantiated per type, so each field conversion
+// can be inlined, and the key lengths and hashes are computed at compile time. No schema
+// nodes are allocated and no std::function is involved.
+//
+//     SCHEMA11_STATIC_SCHEMA(ImageLayer,
+//         StaticMember("type", &ImageLayer::_Type),
+//         StaticMember("blobId", &ImageLayer::_BlobId))
+//
+//     StaticFromJson(json, imageLayer);
+//
+// Fields may be primitives, vectors, or other types that have a StaticSchema. Types with
+// private fields must befriend schema11::StaticSchema<T>. BindStaticSchema embeds a type
+// with a StaticSchema into an ordinary Schema tree, so types can be migrated one at a
+// time.
+
+namespace schema11 {
+
+// Specialized, usually through SCHEMA11_STATIC_SCHEMA, with a constexpr fields() function
+// returning a tuple of StaticFields.
+template <class T>
+struct StaticSchema {};
+
+template <class T, class M>
+struct StaticField {
+    const char *key;
+    size_t length;
+    uint32_t hash;
+    M T::*member;
+};
+
+template <class T, class M, size_t N>
+constexpr StaticField<T, M> StaticMember(const char (&key)[N], M T::*member) {
+    return StaticField<T, M> { key, N - 1, KeyHash(key, N - 1), member };
+}
+
+template <class T, class = void>
+struct HasStaticSchema : std::false_type {};
+
+template <class T>
+struct HasStaticSchema<T, decltype((void)StaticSchema<T>::fields())> : std::true_type {};
+
+/* StaticConverter<T>
+ *
+ * Converts a value of type T to and from JSON. Specialized for the primitives, vectors,
+ * and types with a StaticSchema.
+ */
+template <class T, class = void>
+struct StaticConverter;
+
+template <>
+struct StaticConverter<int> {
+    static void from_json(const json11::Json &json, int &value) { value = json.int_value(); }
+    static json11::Json to_json(int value) { return json11::Json(value); }
+    static void dump(int value, std::string &out) { schema11::dump(value, out); }
+};
+
+template <>
+struct StaticConverter<bool> {
+    static void from_json(const json11::Json &json, bool &value) { value = json.bool_value(); }
+    static json11::Json to_json(bool value) { return json11::Json(value); }
+    static void dump(bool value, std::string &out) { schema11::dump(value, out); }
+};
+
+template <>
+struct StaticConverter<float> {
+    static void from_json(const json11::Json &json, float &value) { value = static_cast<float>(json.number_value()); }
+    static json11::Json to_json(float value) { return json11::Json(value); }
+    static void dump(float value, std::string &out) { schema11::dump(value, out); }
+};
+
+template <>
+struct StaticConverter<double> {
+    static void from_json(const json11::Json &json, double &value) { value = json.number_value(); }
+    static json11::Json to_json(double value) { return json11::Json(value); }
+    static void dump(double value, std::string &out) { schema11::dump(value, out); }
+};
+
+template <>
+struct StaticConverter<std::string> {
+    static void from_json(const json11::Json &json, std::string &value) { value = json.string_value(); }
+    static json11::Json to_json(const std::string &value) { return json11::Json(value); }
+    static void dump(const std::string &value, std::string &out) { schema11::dump(value, out); }
+};
+
+template <class E>
+struct StaticConverter<std::vector<E>> {
+    static void from_json(const json11::Json &json, std::vector<E> &value) {
+        const auto &items = json.array_items();
+        value.clear();
+        value.reserve(items.size());
+        for (const auto &item : items) {
+            value.emplace_back();
+            StaticConverter<E>::from_json(item, value.back());
+        }
+    }
+
+    static json11::Json to_json(const std::vector<E> &value) {
+        json11::Json::array items;
+        items.reserve(value.size());
+        for (const auto &element : value)
+            items.push_back(StaticConverter<E>::to_json(element));
+        return json11::Json(std::move(items));
+    }
+
+    static void dump(const std::vector<E> &value, std::string &out) {
+        bool first = true;
+        out += "[";
+        for (const auto &element : value) {
+            if (!first)
+                out += ", ";
+            StaticConverter<E>::dump(element, out);
+            first = false;
+        }
+        out += "]";
+    }
+};
+
+template <class T>
+struct StaticConverter<T, typename std::enable_if<HasStaticSchema<T>::value>::type> {
+    typedef decltype(StaticSchema<T>::fields()) fields_type;
+    static constexpr size_t size = std::tuple_size<fields_type>::value;
+    typedef std::make_index_sequence<size> indices;
+
+    static void from_json(const json11::Json &json, T &value) {
+        // Match each key present in the JSON against the fields by precomputed hash,
+        // then give the fields that were absent json11's defaults, as Schema does.
+        std::bitset<size> seen;
+        for (const auto &item : json.object_items()) {
+            const uint32_t hash = KeyHash(item.first.data(), item.first.size());
+            match(item.first, hash, item.second, value, seen, indices());
+        }
+        if (!seen.all())
+            reset(value, seen, indices());
+    }
+
+    static json11::Json to_json(const T &value) {
+        json11::Json::object items;
+        to_json(value, items, indices());
+        return json11::Json(std::move(items));
+    }
+
+    static void dump(const T &value, std::string &out) {
+        bool first = true;
+        out += "{";
+        dump(value, out, first, indices());
+        out += "}";
+    }
+
+private:
+    template <class M>
+    static bool matches(const StaticField<T, M> &field, const std::string &key, uint32_t hash) {
+        return field.hash == hash && field.length == key.size()
+            && std::memcmp(field.key, key.data(), field.length) == 0;
+    }
+
+    template <size_t... I>
+    static void match(const std::string &key, uint32_t hash, const json11::Json &json, T &value,
+                      std::bitset<size> &seen, std::index_sequence<I...>) {
+        static constexpr fields_type fields = StaticSchema<T>::fields();
+        bool matched = false;
+        using expand = int[];
+        (void)expand { 0, (matched = matched || match_field<I>(std::get<I>(fields), key, hash, json, value, seen), 0)... };
+    }
+
+    template <size_t I, class M>
+    static bool match_field(const StaticField<T, M> &field, const std::string &key, uint32_t hash,
+                            const json11::Json &json, T &value, std::bitset<size> &seen) {
+        if (!matches(field, key, hash))
+            return false;
+        StaticConverter<M>::from_json(json, value.*field.member);
+        seen.set(I);
+        return true;
+    }
+
+    template <size_t... I>
+    static void reset(T &value, const std::bitset<size> &seen, std::index_sequence<I...>) {
+        static constexpr fields_type fields = StaticSchema<T>::fields();
+        static const json11::Json null;
+        using expand = int[];
+        (void)expand { 0, (seen[I] ? 0 : (reset_field(std::get<I>(fields), null, value), 0))... };
+    }
+
+    template <class M>
+    static void reset_field(const StaticField<T, M> &field, const json11::Json &null, T &value) {
+        StaticConverter<M>::from_json(null, value.*field.member);
+    }
+
+    template <size_t... I>
+    static void to_json(const T &value, json11::Json::object &items, std::index_sequence<I...>) {
+        static constexpr fields_type fields = StaticSchema<T>::fields();
+        using expand = int[];
+        (void)expand { 0, (to_json_field(std::get<I>(fields), value, items), 0)... };
+    }
+
+    template <class M>
+    static void to_json_field(const StaticField<T, M> &field, const T &value, json11::Json::object &items) {
+        items.emplace(std::string(field.key, field.length), StaticConverter<M>::to_json(value.*field.member));
+    }
+
+    template <size_t... I>
+    static void dump(const T &value, std::string &out, bool &first, std::index_sequence<I...>) {
+        static constexpr fields_type fields = StaticSchema<T>::fields();
+        using expand = int[];
+        (void)expand { 0, (dump_field(std::get<I>(fields), value, out, first), 0)... };
+    }
+
+    template <class M>
+    static void dump_field(const StaticField<T, M> &field, const T &value, std::string &out, bool &first) {
+        if (!first)
+            out += ", ";
+        schema11::dump(std::string_view(field.key, field.length), out);
+        out += ": ";
+        StaticConverter<M>::dump(value.*field.member, out);
+        first = false;
+    }
+};
+
+template <class T>
+void StaticFromJson(const json11::Json &json, T &value) {
+    StaticConverter<T>::from_json(json, value);
+}
+
+template <class T>
+json11::Json StaticToJson(const T &value) {
+    return StaticConverter<T>::to_json(value);
+}
+
+template <class T>
+void StaticDump(const T &value, std::string &out) {
+    StaticConverter<T>::dump(value, out);
+}
+
+template <class T>
+std::string StaticDump(const T &value) {
+    std::string out;
+    StaticConverter<T>::dump(value, out);
+    return out;
+}
+
+// Return a Schema for one instance of a type with a StaticSchema, to embed it within a
+// Schema tree.
+template <class T>
+Schema BindStaticSchema(T &value) {
+    ValueConverter converter;
+    converter.from_json = [&value](const json11::Json &json) {
+        StaticConverter<T>::from_json(json, value);
+    };
+    converter.to_json = [&value](json11::Json &json) {
+        json = StaticConverter<T>::to_json(value);
+    };
+    return Schema(Schema::OBJECT, converter);
+}
+
+}
+
+#define SCHEMA11_STATIC_SCHEMA(Type, ...)                       \
+    namespace schema11 {                                        \
+    template <>                                                 \
+    struct StaticSchema<Type> {                                 \
+        static constexpr auto fields() {                        \
+            return std::make_tuple(__VA_ARGS__);                \
+        }                                                       \
+    };                                                          \
+    }
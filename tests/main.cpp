@@ -1,8 +1,13 @@
+#include <cmath>
+#include <fstream>
+#include <sstream>
 #include <string>
+#include <thread>
 
 #define CATCH_CONFIG_MAIN
 #include "../third_party/catch/single_include/catch.hpp"
 #include "../schema11.hpp"
+#include "../schema11_static.hpp"
 #include "../third_party/json11/json11.hpp"
 
 using namespace json11;
@@ -153,4 +158,1338 @@ TEST_CASE("can process simple schema")
     REQUIRE(topLevel.nestedProp.arrayProp[0] == "one");
     REQUIRE(topLevel.nestedProp.arrayProp[1] == "two");
     REQUIRE(topLevel.nestedProp.arrayProp[2] == "three");
-}
\ No newline at end of file
+}
+
+TEST_CASE("can parse text directly into a schema")
+{
+    const string jsonStr = R"({
+        "unboundProp": { "deeply": [ "nested", 1.5e3, null, { "x": "é" } ] },
+        "intProp": 5,
+        "boolProp": true,
+        "nestedProp": {
+            "stringProp": "str \"quoted\" 😀",
+            "arrayProp": [ "one", "two", "three" ]
+        }
+    })";
+
+    TopLevel topLevel;
+    string err;
+    REQUIRE(TopLevelSchema(topLevel).parse_into(jsonStr, err));
+    REQUIRE(err.empty());
+
+    REQUIRE(topLevel.intProp == 5);
+    REQUIRE(topLevel.boolProp == true);
+    REQUIRE(topLevel.nestedProp.stringProp == "str \"quoted\" \xF0\x9F\x98\x80");
+    REQUIRE(topLevel.nestedProp.arrayProp.size() == 3);
+    REQUIRE(topLevel.nestedProp.arrayProp[0] == "one");
+    REQUIRE(topLevel.nestedProp.arrayProp[2] == "three");
+}
+
+TEST_CASE("direct parsing reports malformed input")
+{
+    TopLevel topLevel;
+    string err;
+    REQUIRE(!TopLevelSchema(topLevel).parse_into(R"({ "intProp": 5, "unboundProp": [1, 2 })", err));
+    REQUIRE(!err.empty());
+
+    err.clear();
+    REQUIRE(!TopLevelSchema(topLevel).parse_into(R"({ "intProp": 5 } trailing)", err));
+    REQUIRE(!err.empty());
+
+    // The input need not be NUL-terminated
+    const char truncated[] = { '{', '"', 'i', 'n', 't', 'P', 'r', 'o', 'p', '"', ':', '7' };
+    err.clear();
+    REQUIRE(!TopLevelSchema(topLevel).parse_into(truncated, sizeof truncated, err));
+    REQUIRE(!err.empty());
+}
+
+TEST_CASE("can process a compiled schema")
+{
+    Json json = Json::object {
+        { "intProp", 5 },
+        { "boolProp", true },
+        { "nestedProp", Json::object {
+            { "stringProp", "str" },
+            { "arrayProp", Json::array { "one", "two" }}
+        }}
+    };
+
+    TopLevel topLevel;
+    CompiledSchema compiled = TopLevelSchema(topLevel).compile();
+
+    // One instruction for each object and field; nested fields are laid out contiguously
+    REQUIRE(compiled.program().size() == 6);
+    REQUIRE(compiled.program()[0].op == CompiledSchema::OBJECT);
+    REQUIRE(compiled.program()[0].end_child - compiled.program()[0].first_child == 3);
+
+    compiled.from_json(json);
+
+    REQUIRE(topLevel.intProp == 5);
+    REQUIRE(topLevel.boolProp == true);
+    REQUIRE(topLevel.nestedProp.stringProp == "str");
+    REQUIRE(topLevel.nestedProp.arrayProp.size() == 2);
+    REQUIRE(topLevel.nestedProp.arrayProp[1] == "two");
+
+    // The program can be run again without recompiling
+    compiled.from_json(Json::object { { "intProp", 7 } });
+    REQUIRE(topLevel.intProp == 7);
+    REQUIRE(topLevel.boolProp == false);
+}
+
+static const TypeSchema<Nested> nestedTypeSchema {
+    { "stringProp", &Nested::stringProp },
+    { "arrayProp", &Nested::arrayProp }
+};
+
+static const TypeSchema<TopLevel> topLevelTypeSchema {
+    { "intProp", &TopLevel::intProp },
+    { "boolProp", &TopLevel::boolProp },
+    { "nestedProp", &TopLevel::nestedProp, nestedTypeSchema }
+};
+
+TEST_CASE("can reuse a type schema across instances")
+{
+    Json json = Json::object {
+        { "intProp", 5 },
+        { "boolProp", true },
+        { "nestedProp", Json::object {
+            { "stringProp", "str" },
+            { "arrayProp", Json::array { "one", "two", "three" }}
+        }}
+    };
+
+    TopLevel first, second;
+    topLevelTypeSchema.from_json(json, first);
+    topLevelTypeSchema.from_json(json, second);
+
+    for (const auto &topLevel : { first, second }) {
+        REQUIRE(topLevel.intProp == 5);
+        REQUIRE(topLevel.boolProp == true);
+        REQUIRE(topLevel.nestedProp.stringProp == "str");
+        REQUIRE(topLevel.nestedProp.arrayProp.size() == 3);
+        REQUIRE(topLevel.nestedProp.arrayProp[2] == "three");
+    }
+
+    // Vectors are replaced rather than appended to
+    topLevelTypeSchema.from_json(json, first);
+    REQUIRE(first.nestedProp.arrayProp.size() == 3);
+
+    // Direct parsing goes through the same type schema
+    TopLevel third;
+    string err;
+    REQUIRE(topLevelTypeSchema.parse_into(R"({"intProp": 9, "nestedProp": {"arrayProp": ["a"]}})", third, err));
+    REQUIRE(third.intProp == 9);
+    REQUIRE(third.nestedProp.arrayProp.size() == 1);
+
+    // A type schema can be bound into a Schema tree
+    int outerProp = 0;
+    TopLevel fourth;
+    Schema schema = Schema::object {
+        { "outerProp", Schema(outerProp) },
+        { "inner", topLevelTypeSchema.bind(fourth) }
+    };
+    schema.from_json(Json::object { { "outerProp", 1 }, { "inner", json } });
+    REQUIRE(outerProp == 1);
+    REQUIRE(fourth.nestedProp.stringProp == "str");
+
+    REQUIRE(schema.parse_into(R"({"outerProp": 2, "inner": {"intProp": 3}})", err));
+    REQUIRE(outerProp == 2);
+    REQUIRE(fourth.intProp == 3);
+}
+
+SCHEMA11_STATIC_SCHEMA(Nested,
+    StaticMember("stringProp", &Nested::stringProp),
+    StaticMember("arrayProp", &Nested::arrayProp))
+
+SCHEMA11_STATIC_SCHEMA(TopLevel,
+    StaticMember("intProp", &TopLevel::intProp),
+    StaticMember("boolProp", &TopLevel::boolProp),
+    StaticMember("nestedProp", &TopLevel::nestedProp))
+
+TEST_CASE("can process a static schema")
+{
+    Json json = Json::object {
+        { "intProp", 5 },
+        { "boolProp", true },
+        { "unboundProp", 1 },
+        { "nestedProp", Json::object {
+            { "stringProp", "str" },
+            { "arrayProp", Json::array { "one", "two", "three" }}
+        }}
+    };
+
+    TopLevel topLevel;
+    StaticFromJson(json, topLevel);
+
+    REQUIRE(topLevel.intProp == 5);
+    REQUIRE(topLevel.boolProp == true);
+    REQUIRE(topLevel.nestedProp.stringProp == "str");
+    REQUIRE(topLevel.nestedProp.arrayProp.size() == 3);
+    REQUIRE(topLevel.nestedProp.arrayProp[1] == "two");
+
+    // Encoding round-trips, both through json11 and directly to text
+    REQUIRE(StaticToJson(topLevel) == Json::object {
+        { "intProp", 5 },
+        { "boolProp", true },
+        { "nestedProp", Json::object {
+            { "stringProp", "str" },
+            { "arrayProp", Json::array { "one", "two", "three" }}
+        }}
+    });
+    REQUIRE(StaticDump(topLevel.nestedProp) == R"({"stringProp": "str", "arrayProp": ["one", "two", "three"]})");
+
+    // Fields absent from the JSON get json11's defaults, as with Schema
+    StaticFromJson(Json::object { { "boolProp", true } }, topLevel);
+    REQUIRE(topLevel.intProp == 0);
+    REQUIRE(topLevel.nestedProp.arrayProp.empty());
+
+    // Static schemas can be embedded in a Schema tree
+    int outerProp = 0;
+    Schema schema = Schema::object {
+        { "outerProp", Schema(outerProp) },
+        { "inner", BindStaticSchema(topLevel) }
+    };
+    schema.from_json(Json::object { { "outerProp", 1 }, { "inner", json } });
+    REQUIRE(outerProp == 1);
+    REQUIRE(topLevel.intProp == 5);
+}
+
+struct Point
+{
+    int x = 0;
+    int y = 0;
+};
+
+static const TypeSchema<Point> pointTypeSchema {
+    { "x", &Point::x },
+    { "y", &Point::y }
+};
+
+TEST_CASE("arrays are decoded in place")
+{
+    vector<int> ints;
+    vector<Point> points;
+    vector<string> strings;
+    Schema schema = Schema::object {
+        { "ints", ArraySchema(ints) },
+        { "points", ArraySchema(points, pointTypeSchema) },
+        { "strings", ArraySchema<string>(strings, &ArrayElementSchema) }
+    };
+
+    schema.from_json(Json::object {
+        { "ints", Json::array { 1, 2, 3 } },
+        { "points", Json::array { Json::object { { "x", 1 }, { "y", 2 } }, Json::object { { "x", 3 } } } },
+        { "strings", Json::array { "one", "two" } }
+    });
+    REQUIRE(ints == vector<int> { 1, 2, 3 });
+    REQUIRE(points.size() == 2);
+    REQUIRE(points[0].y == 2);
+    REQUIRE(points[1].x == 3);
+    REQUIRE(strings == vector<string> { "one", "two" });
+
+    // As before, decoding appends to the bound vectors, through the parser too
+    string err;
+    REQUIRE(schema.parse_into(R"({"ints": [4], "points": [{"x": 5, "y": 6}], "strings": ["three"]})", err));
+    REQUIRE(ints == vector<int> { 1, 2, 3, 4 });
+    REQUIRE(points.size() == 3);
+    REQUIRE(points[2].y == 6);
+    REQUIRE(strings.back() == "three");
+}
+
+static Schema BoolElementSchema(bool &value)
+{
+    return Schema(value);
+}
+
+TEST_CASE("vectors of bools are bound element by element")
+{
+    vector<bool> bools { true };
+    Schema schema = Schema::object { { "bools", ArraySchema<bool>(bools, &BoolElementSchema) } };
+
+    schema.from_json(Json::object { { "bools", Json::array { false, true } } });
+    REQUIRE(bools == vector<bool> { true, false, true });
+
+    string err;
+    REQUIRE(schema.parse_into(R"({"bools": [true]})", err));
+    REQUIRE(bools == vector<bool> { true, false, true, true });
+    REQUIRE(schema.dump() == R"({"bools": [true, false, true, true]})");
+
+    REQUIRE(schema.merge_patch(Json::object { { "bools", Json::array { false } } }, err));
+    REQUIRE(bools == vector<bool> { false });
+}
+
+TEST_CASE("object fields are matched against interleaved JSON members")
+{
+    int a = -1, c = -1, e = -1, g = -1;
+    Schema schema = Schema::object {
+        { "a", Schema(a) },
+        { "c", Schema(c) },
+        { "e", Schema(e) },
+        { "g", Schema(g) }
+    };
+
+    // Members before, between and after the bound fields are ignored, and bound fields
+    // that are absent get json11's defaults.
+    schema.from_json(Json::object { { "0", 9 }, { "a", 1 }, { "b", 9 }, { "d", 9 }, { "e", 5 }, { "z", 9 } });
+    REQUIRE(a == 1);
+    REQUIRE(c == 0);
+    REQUIRE(e == 5);
+    REQUIRE(g == 0);
+
+    CompiledSchema compiled = schema.compile();
+    compiled.from_json(Json::object { { "c", 3 }, { "g", 7 } });
+    REQUIRE(a == 0);
+    REQUIRE(c == 3);
+    REQUIRE(e == 0);
+    REQUIRE(g == 7);
+
+    // The direct parser finds fields by hash, in any order
+    string err;
+    REQUIRE(schema.parse_into(R"({"g": 70, "x": [1], "a": 10, "e": 50})", err));
+    REQUIRE(a == 10);
+    REQUIRE(c == 3);
+    REQUIRE(e == 50);
+    REQUIRE(g == 70);
+}
+
+TEST_CASE("can serialize bound values")
+{
+    TopLevel topLevel;
+    topLevel.intProp = 5;
+    topLevel.boolProp = true;
+    topLevel.nestedProp.stringProp = "line\nbreak \"quoted\"";
+    topLevel.nestedProp.arrayProp = { "one", "two" };
+
+    const Schema schema = TopLevelSchema(topLevel);
+    const string expected = R"({"boolProp": true, "intProp": 5, "nestedProp": )"
+        R"({"arrayProp": ["one", "two"], "stringProp": "line\nbreak \"quoted\""}})";
+
+    // Directly to text, with an exact size pre-pass
+    REQUIRE(schema.dump() == expected);
+    REQUIRE(schema.dump_size() == expected.size());
+
+    string out = "prefix ";
+    schema.dump(out);
+    REQUIRE(out == "prefix " + expected);
+
+    // Through json11, which formats the same way
+    Json json;
+    schema.to_json(json);
+    REQUIRE(json.dump() == expected);
+
+    // Decoding the output reproduces the values
+    TopLevel decoded;
+    TopLevelSchema(decoded).from_json(json);
+    REQUIRE(decoded.nestedProp.stringProp == topLevel.nestedProp.stringProp);
+    REQUIRE(decoded.nestedProp.arrayProp == topLevel.nestedProp.arrayProp);
+
+    // Type schemas serialize the same way
+    REQUIRE(topLevelTypeSchema.dump(topLevel) == expected);
+    REQUIRE(topLevelTypeSchema.dump_size(topLevel) == expected.size());
+    Json typeJson;
+    topLevelTypeSchema.to_json(topLevel, typeJson);
+    REQUIRE(typeJson == json);
+
+    // So do in-place arrays
+    vector<Point> points(2);
+    points[1].x = 3;
+    Schema pointsSchema = Schema::object { { "points", ArraySchema(points, pointTypeSchema) } };
+    REQUIRE(pointsSchema.dump() == R"({"points": [{"x": 0, "y": 0}, {"x": 3, "y": 0}]})");
+}
+
+static string ReferenceEscape(const string &value)
+{
+    string out = "\"";
+    for (size_t i = 0; i < value.size(); i++) {
+        const unsigned char ch = value[i];
+        char buf[8];
+        if (ch == '"' || ch == '\\') {
+            out += '\\';
+            out += ch;
+        } else if (ch == '\n') {
+            out += "\\n";
+        } else if (ch == '\t') {
+            out += "\\t";
+        } else if (ch <= 0x1f) {
+            snprintf(buf, sizeof buf, "\\u%04x", ch);
+            out += buf;
+        } else if (ch == 0xe2 && i + 2 < value.size() && (unsigned char)value[i+1] == 0x80
+                   && ((unsigned char)value[i+2] == 0xa8 || (unsigned char)value[i+2] == 0xa9)) {
+            out += (unsigned char)value[i+2] == 0xa8 ? "\\u2028" : "\\u2029";
+            i += 2;
+        } else {
+            out += ch;
+        }
+    }
+    return out + "\"";
+}
+
+TEST_CASE("strings are escaped at any position")
+{
+    const vector<string> specials = { "\"", "\\", "\n", "\t", "\x01", "\x1f", "\xe2\x80\xa8", "\xe2\x80\xa9", "\xe2\x82\xac", "\xe2" };
+    for (const auto &special : specials) {
+        for (size_t length = 0; length < 70; length++) {
+            for (size_t position = 0; position <= length; position++) {
+                string value(length, 'x');
+                value.insert(position, special);
+
+                string out;
+                schema11::dump(value, out);
+                REQUIRE(out == ReferenceEscape(value));
+                REQUIRE(schema11::dump_size(value) == out.size());
+            }
+        }
+    }
+}
+
+template <class T>
+static string Dumped(T value)
+{
+    string out;
+    schema11::dump(value, out);
+    REQUIRE(schema11::dump_size(value) == out.size());
+    return out;
+}
+
+TEST_CASE("numbers are dumped in their shortest round-trip form")
+{
+    REQUIRE(Dumped(0) == "0");
+    REQUIRE(Dumped(-7) == "-7");
+    REQUIRE(Dumped(1234567) == "1234567");
+    REQUIRE(Dumped(std::numeric_limits<int>::max()) == "2147483647");
+    REQUIRE(Dumped(std::numeric_limits<int>::min()) == "-2147483648");
+
+    REQUIRE(Dumped(0.0) == "0");
+    REQUIRE(Dumped(5.0) == "5");
+    REQUIRE(Dumped(-0.5) == "-0.5");
+    REQUIRE(Dumped(0.1) == "0.1");
+    REQUIRE(Dumped(1.57165) == "1.57165");
+    REQUIRE(Dumped(1.57165f) == "1.57165");
+    REQUIRE(Dumped(0.0001) == "0.0001");
+    REQUIRE(Dumped(1e-7) == "1e-07");
+    REQUIRE(Dumped(1e100) == "1e+100");
+    REQUIRE(Dumped(123456789012345678.0) == "1.2345678901234568e+17");
+    REQUIRE(Dumped(std::nan("")) == "null");
+
+    // Random bit patterns read back exactly
+    uint64_t state = 0x9e3779b97f4a7c15;
+    for (int i = 0; i < 20000; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+
+        double d;
+        memcpy(&d, &state, sizeof d);
+        if (std::isfinite(d)) {
+            const string text = Dumped(d);
+            REQUIRE(strtod(text.c_str(), nullptr) == d);
+        }
+
+        float f;
+        const uint32_t bits = static_cast<uint32_t>(state >> 32);
+        memcpy(&f, &bits, sizeof f);
+        if (std::isfinite(f)) {
+            const string text = Dumped(f);
+            REQUIRE(strtof(text.c_str(), nullptr) == f);
+        }
+    }
+}
+
+TEST_CASE("numbers are parsed directly into the bound type")
+{
+    int i = 0;
+    float f = 0;
+    double d = 0;
+    Schema schema = Schema::object {
+        { "i", i },
+        { "f", f },
+        { "d", d }
+    };
+    auto parse = [&](const string &text) {
+        string err;
+        REQUIRE(schema.parse_into(text, err));
+    };
+
+    parse(R"({"i": -2147483648, "f": 1.57165, "d": 0.1})");
+    REQUIRE(i == numeric_limits<int>::min());
+    REQUIRE(f == 1.57165f);
+    REQUIRE(d == 0.1);
+
+    // Integers out of range are clamped, and fractions are truncated
+    parse(R"({"i": 12345678901234567890, "f": 3e38, "d": 9007199254740993})");
+    REQUIRE(i == numeric_limits<int>::max());
+    REQUIRE(f == 3e38f);
+    REQUIRE(d == 9007199254740992.0);
+    parse(R"({"i": -2.9, "f": 1e-45, "d": 1.7976931348623157e308})");
+    REQUIRE(i == -2);
+    REQUIRE(f == strtof("1e-45", nullptr));
+    REQUIRE(d == numeric_limits<double>::max());
+    parse(R"({"i": 2.5e3, "f": -0.0, "d": 0.000000000000000000000000000001234})");
+    REQUIRE(i == 2500);
+    REQUIRE(f == 0);
+    REQUIRE(d == 1.234e-30);
+
+    // Floats are rounded once, rather than through a double
+    parse(R"({"i": 0, "f": 1.00000005960464477539062500001, "d": 0})");
+    REQUIRE(f == strtof("1.00000005960464477539062500001", nullptr));
+
+    // Whatever the path taken, values agree with strtod and strtof
+    uint64_t state = 0x2545f4914f6cdd1d;
+    for (int n = 0; n < 5000; n++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+
+        char text[64];
+        snprintf(text, sizeof text, "%.*g", static_cast<int>(state % 20) + 1,
+                 static_cast<double>(state >> 11) * pow(10.0, static_cast<int>(state % 64) - 40));
+        parse(string(R"({"i": 0, "f": )") + text + R"(, "d": )" + text + "}");
+        REQUIRE(d == strtod(text, nullptr));
+        REQUIRE(f == strtof(text, nullptr));
+    }
+}
+
+TEST_CASE("can build schemas in an arena")
+{
+    SchemaArena arena(256);
+    TopLevel topLevel;
+    {
+        SchemaArena::Scope scope(arena);
+        REQUIRE(SchemaArena::current() == &arena);
+
+        Schema schema = TopLevelSchema(topLevel);
+        REQUIRE(arena.allocated() > 0);
+
+        string err;
+        REQUIRE(schema.parse_into(R"({"intProp": 3, "nestedProp": {"arrayProp": ["a", "b"]}})", err));
+        REQUIRE(topLevel.intProp == 3);
+        REQUIRE(topLevel.nestedProp.arrayProp == vector<string> { "a", "b" });
+        const size_t allocated = arena.allocated();
+
+        // Nested scopes on other arenas take over, and restore the outer one
+        SchemaArena other;
+        {
+            SchemaArena::Scope inner(other);
+            Schema nested = NestedSchema(topLevel.nestedProp);
+            REQUIRE(other.allocated() > 0);
+        }
+        REQUIRE(SchemaArena::current() == &arena);
+        REQUIRE(arena.allocated() == allocated);
+    }
+    REQUIRE(SchemaArena::current() == nullptr);
+
+    // Outside any scope, schemas are allocated as usual
+    const size_t allocated = arena.allocated();
+    Schema schema = TopLevelSchema(topLevel);
+    REQUIRE(arena.allocated() == allocated);
+
+    arena.reset();
+    REQUIRE(arena.allocated() == 0);
+}
+
+TEST_CASE("object fields are stored sorted and can be looked up")
+{
+    int values[12] = {};
+    Schema::object fields {
+        { "k", values[0] }, { "c", values[1] }, { "a", values[2] }, { "c", values[3] }
+    };
+    REQUIRE(fields.size() == 3);
+    REQUIRE(fields.begin()->first == "a");
+    REQUIRE(fields.find("c") != fields.end());
+    REQUIRE(fields.count("b") == 0);
+
+    // Duplicates keep the first value, as std::map did
+    values[1] = 1;
+    values[3] = 3;
+    Json json;
+    fields.find("c")->second.to_json(json);
+    REQUIRE(json.int_value() == 1);
+
+    REQUIRE(fields.insert({ "b", values[4] }));
+    REQUIRE(!fields.insert({ "a", values[5] }));
+    vector<string> keys;
+    for (const auto &field : fields)
+        keys.push_back(field.first);
+    REQUIRE(keys == vector<string> { "a", "b", "c", "k" });
+
+    // Larger objects are searched by bisection
+    for (int i = 5; i < 12; i++)
+        REQUIRE(fields.insert({ "f" + to_string(i), values[i] }));
+    values[9] = 9;
+    Schema schema = fields;
+    schema["f9"].to_json(json);
+    REQUIRE(json.int_value() == 9);
+    REQUIRE(schema["f4"].type() == Schema::NUL);
+    REQUIRE(schema.object_items().size() == 11);
+}
+
+TEST_CASE("field keys are interned")
+{
+    const Symbol type("type");
+    REQUIRE(type == Symbol(string("type")));
+    REQUIRE(&type.str() == &Symbol("type").str());
+    REQUIRE(type.hash() == KeyHash("type", 4));
+    REQUIRE(type != Symbol("typeId"));
+    REQUIRE(Symbol("a") < Symbol("b"));
+    REQUIRE(Symbol().str().empty());
+
+    Symbol found;
+    REQUIRE(Symbol::Lookup("type", 4, found));
+    REQUIRE(found == type);
+    REQUIRE(!Symbol::Lookup("never-used-as-a-key", 19, found));
+
+    // Schemas built separately share their keys
+    TopLevel first, second;
+    Schema one = TopLevelSchema(first), two = TopLevelSchema(second);
+    REQUIRE(&one.object_items().begin()->first.str() == &two.object_items().begin()->first.str());
+}
+
+TEST_CASE("value converters hold built-in and custom conversions")
+{
+    double doubleValue = 0;
+    ValueConverter primitive = PrimitiveConverter(doubleValue);
+    ValueConverter copy = primitive;
+    copy.from_json(Json(2.5));
+    REQUIRE(doubleValue == 2.5);
+    Json json;
+    copy.to_json(json);
+    REQUIRE(json.number_value() == 2.5);
+
+    int calls = 0;
+    ValueConverter custom;
+    custom.from_json(Json(1));
+    custom.from_json = [&calls](const Json &json) { calls += json.int_value(); };
+    custom.from_json(Json(3));
+    REQUIRE(calls == 3);
+    REQUIRE(custom.kind == ValueConverter::CUSTOM);
+}
+
+TEST_CASE("large arrays can be decoded in parallel")
+{
+    Json::array pointsJson, intsJson;
+    for (int i = 0; i < 50000; i++) {
+        pointsJson.push_back(Json::object { { "x", i }, { "y", -i } });
+        intsJson.push_back(i * 3);
+    }
+
+    vector<Point> points { Point { 7, 7 } };
+    vector<int> ints;
+    vector<string> strings;
+    Schema::array pointsDesc = ArraySchema(points, pointTypeSchema);
+    Schema::array intsDesc = ArraySchema(ints);
+    Schema::array stringsDesc = ArraySchema<string>(strings, &ArrayElementSchema);
+    pointsDesc.parallel_threshold = intsDesc.parallel_threshold = stringsDesc.parallel_threshold = 1000;
+    Schema schema = Schema::object {
+        { "points", pointsDesc },
+        { "ints", intsDesc },
+        { "strings", stringsDesc }
+    };
+
+    schema.from_json(Json::object {
+        { "points", pointsJson },
+        { "ints", intsJson },
+        { "strings", Json::array(2000, Json("s")) }
+    });
+
+    // Appended after the existing element, in order
+    REQUIRE(points.size() == 50001);
+    REQUIRE(points[0].x == 7);
+    bool ordered = true;
+    for (int i = 0; i < 50000; i++)
+        ordered = ordered && points[i + 1].x == i && points[i + 1].y == -i && ints[i] == i * 3;
+    REQUIRE(ordered);
+    REQUIRE(ints.size() == 50000);
+    REQUIRE(strings == vector<string>(2000, "s"));
+}
+
+static Schema ParallelRowSchema(vector<int> &row)
+{
+    Schema::array desc = ArraySchema(row);
+    desc.parallel_threshold = 1000;
+    return desc;
+}
+
+TEST_CASE("nested and concurrent parallel arrays share one pool")
+{
+    Json::array rowJson;
+    for (int i = 0; i < 4000; i++)
+        rowJson.push_back(i);
+    const Json json = Json::object { { "rows", Json::array(2000, Json(rowJson)) } };
+
+    // Each thread decodes its own rows, whose elements are parallel arrays themselves
+    const int threadCount = 4;
+    vector<vector<vector<int>>> results(threadCount);
+    vector<std::thread> threads;
+    for (int t = 0; t < threadCount; t++) {
+        threads.emplace_back([&json, &results, t] {
+            Schema::array rowsDesc = ArraySchema<vector<int>>(results[t], &ParallelRowSchema);
+            rowsDesc.parallel_threshold = 1000;
+            Schema schema = Schema::object { { "rows", rowsDesc } };
+            schema.from_json(json);
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+
+    bool decoded = true;
+    for (const auto &rows : results) {
+        decoded = decoded && rows.size() == 2000;
+        for (const auto &row : rows)
+            decoded = decoded && row.size() == 4000 && row[0] == 0 && row[3999] == 3999;
+    }
+    REQUIRE(decoded);
+}
+
+TEST_CASE("one type schema can be used on many threads at once")
+{
+    const int threadCount = 8;
+    vector<int> failures(threadCount);
+    vector<std::thread> threads;
+    for (int t = 0; t < threadCount; t++) {
+        threads.emplace_back([t, &failures] {
+            for (int i = 0; i < 200; i++) {
+                const string text = R"({"intProp": )" + to_string(t * 1000 + i)
+                    + R"(, "boolProp": true, "nestedProp": {"stringProp": "s)" + to_string(t)
+                    + R"(", "arrayProp": ["a", "b"]}})";
+
+                TopLevel parsed, converted;
+                string err;
+                bool ok = topLevelTypeSchema.parse_into(text, parsed, err);
+                topLevelTypeSchema.from_json(Json::parse(text, err), converted);
+                ok = ok && parsed.intProp == t * 1000 + i && converted.intProp == parsed.intProp
+                    && parsed.nestedProp.stringProp == "s" + to_string(t)
+                    && converted.nestedProp.arrayProp == parsed.nestedProp.arrayProp
+                    && topLevelTypeSchema.dump(parsed) == topLevelTypeSchema.dump(converted);
+                if (!ok)
+                    failures[t]++;
+            }
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+    REQUIRE(failures == vector<int>(threadCount, 0));
+}
+
+TEST_CASE("can stream JSON lines")
+{
+    const string text =
+        "{\"intProp\": 1, \"nestedProp\": {\"arrayProp\": [\"a\"]}}\n"
+        "\n"
+        "{\"intProp\": 2, \"boolProp\": true}\r\n"
+        "{\"intProp\": 3, \"nestedProp\": {\"stringProp\": \"a line longer than the read buffer\"}}\n"
+        "{\"intProp\": oops}\n"
+        "   \n"
+        "{\"intProp\": 5}";
+
+    vector<TopLevel> records;
+    vector<size_t> errorLines;
+    auto onError = [&errorLines](size_t line, const string &err) {
+        REQUIRE(!err.empty());
+        errorLines.push_back(line);
+    };
+
+    SECTION("through a type schema") {
+        std::istringstream input(text);
+        JsonLinesReader reader(input, 16);
+        TopLevel record;
+        const size_t count = reader.read(topLevelTypeSchema, record,
+            [&records](TopLevel &record) { records.push_back(record); }, onError);
+
+        REQUIRE(count == 4);
+        REQUIRE(errorLines == vector<size_t> { 5 });
+        REQUIRE(records[0].nestedProp.arrayProp == vector<string> { "a" });
+        // Each record starts afresh
+        REQUIRE(records[1].boolProp);
+        REQUIRE(records[1].nestedProp.arrayProp.empty());
+        REQUIRE(records[2].nestedProp.stringProp == "a line longer than the read buffer");
+        REQUIRE(records[3].intProp == 5);
+        REQUIRE(!records[3].boolProp);
+    }
+
+    SECTION("through a schema, from a file descriptor") {
+        FILE *file = tmpfile();
+        REQUIRE(file);
+        fputs(text.c_str(), file);
+        fflush(file);
+        rewind(file);
+
+        TopLevel topLevel;
+        Schema schema = TopLevelSchema(topLevel);
+        JsonLinesReader reader(fileno(file), 32);
+        vector<int> ints;
+        const size_t count = reader.read(schema, [&ints, &topLevel] { ints.push_back(topLevel.intProp); }, onError);
+        fclose(file);
+
+        REQUIRE(count == 4);
+        REQUIRE(ints == vector<int> { 1, 2, 3, 5 });
+        REQUIRE(errorLines == vector<size_t> { 5 });
+        REQUIRE(reader.error().empty());
+    }
+
+    SECTION("with a short last line and the default buffer") {
+        // The last line is moved to the front of the buffer when the end is reached
+        std::istringstream input("{}\n{\"intProp\": 12345}");
+        TopLevel topLevel;
+        Schema schema = TopLevelSchema(topLevel);
+        JsonLinesReader reader(input);
+        vector<int> ints;
+        const size_t count = reader.read(schema, [&ints, &topLevel] { ints.push_back(topLevel.intProp); }, onError);
+
+        REQUIRE(count == 2);
+        REQUIRE(ints == vector<int> { 0, 12345 });
+        REQUIRE(errorLines.empty());
+    }
+}
+
+TEST_CASE("unbound values are skipped by bracket matching")
+{
+    TopLevel topLevel;
+    string err;
+    const string unbound = R"({"effects": [{"matrix": [1, 0, 0, 1.5e3], "name": "a \"quoted\" ]} \\"}, {}], )"
+                           R"("url": "http://example.com/{id}", "nested": {"deeper": [[[], {"x": null}]]}, )"
+                           "\"padding\": \"" + string(100, 'x') + "\", ";
+    REQUIRE(topLevelTypeSchema.parse_into(unbound + R"("intProp": 42, "boolProp": true})", topLevel, err));
+    REQUIRE(topLevel.intProp == 42);
+    REQUIRE(topLevel.boolProp);
+
+    // A value of the wrong type is skipped too
+    REQUIRE(TopLevelSchema(topLevel).parse_into(R"({"nestedProp": [{"a": "]"}], "intProp": 7})", err));
+    REQUIRE(topLevel.intProp == 7);
+
+    // Structure is still checked
+    for (const string text : {
+            R"({"unbound": [1, 2}, "intProp": 1})",
+            R"({"unbound": {"a": [}]}, "intProp": 1})",
+            R"({"unbound": ["unterminated]})",
+            R"({"unbound": [[[)" }) {
+        err.clear();
+        REQUIRE(!topLevelTypeSchema.parse_into(text, topLevel, err));
+        REQUIRE(!err.empty());
+    }
+
+    err.clear();
+    REQUIRE(!topLevelTypeSchema.parse_into("{\"unbound\": " + string(300, '[') + string(300, ']') + "}", topLevel, err));
+    REQUIRE(err.find("depth") != string::npos);
+}
+
+TEST_CASE("structural index matches a byte-at-a-time scan")
+{
+    // Reference: a backslash escapes the next byte, in or out of a string, though only a
+    // quote's meaning changes by being escaped
+    auto reference = [](const string &text, bool &closed) {
+        vector<uint32_t> positions;
+        bool in_string = false, escaped = false;
+        for (size_t i = 0; i < text.size(); i++) {
+            const char ch = text[i];
+            const bool was_escaped = escaped;
+            escaped = !was_escaped && ch == '\\';
+            if (ch == '"' && !was_escaped) {
+                if (!in_string)
+                    positions.push_back(uint32_t(i));
+                in_string = !in_string;
+            } else if (!in_string && string("{}[]:,").find(ch) != string::npos) {
+                positions.push_back(uint32_t(i));
+            }
+        }
+        closed = !in_string;
+        return positions;
+    };
+
+    const string alphabet = "{}[]:,\"\\\\\\ a";
+    uint32_t seed = 12345;
+    for (int round = 0; round < 200; round++) {
+        string text;
+        const size_t length = round < 64 ? size_t(round) : 64 + size_t(round) * 7;
+        for (size_t i = 0; i < length; i++) {
+            seed = seed * 1103515245 + 12345;
+            text += alphabet[(seed >> 16) % alphabet.size()];
+        }
+
+        bool closed;
+        const vector<uint32_t> expected = reference(text, closed);
+        for (auto implementation : { StructuralIndex::SCALAR, StructuralIndex::SSE2, StructuralIndex::AVX2 }) {
+            StructuralIndex index(implementation);
+            REQUIRE(index.build(text.data(), text.size()) == closed);
+            REQUIRE(index.positions() == expected);
+        }
+    }
+}
+
+TEST_CASE("large inputs skip unbound values through the structural index")
+{
+    TopLevel topLevel;
+    string err;
+
+    // Enough skipped values, with escapes and brackets inside strings landing on every
+    // offset of a block, to be well past the threshold
+    string text = "{";
+    for (int i = 0; i < 3000; i++) {
+        text += "\"unbound" + std::to_string(i) + "\": [{\"s\": \"" + string(i % 70, '\\') + string(i % 70, '\\')
+              + "\\\" ]}\", \"n\": [" + std::to_string(i) + ", {}]}], ";
+        if (i % 100 == 0)
+            text += "\"intProp\": " + std::to_string(i) + ", ";
+    }
+    REQUIRE(text.size() > 256 * 1024);
+
+    REQUIRE(topLevelTypeSchema.parse_into(text + "\"boolProp\": true}", topLevel, err));
+    REQUIRE(topLevel.intProp == 2900);
+    REQUIRE(topLevel.boolProp);
+
+    for (const string tail : {
+            R"("unbound": [1, 2}, "intProp": 1})",
+            R"("unbound": {"a": [}]}, "intProp": 1})",
+            R"("unbound": ["unterminated]})",
+            R"("unbound": [[[)" }) {
+        err.clear();
+        REQUIRE(!topLevelTypeSchema.parse_into(text + tail, topLevel, err));
+        REQUIRE(!err.empty());
+    }
+
+    err.clear();
+    REQUIRE(!topLevelTypeSchema.parse_into(text + R"("unbound": ["a\"]})", topLevel, err));
+    REQUIRE(err == "unexpected end of input in string");
+}
+
+TEST_CASE("strings can be bound to string_views into the input")
+{
+    std::string_view id, url;
+    int count = 0;
+    Schema schema = Schema::object {
+        { "id", id },
+        { "url", url },
+        { "count", count },
+    };
+
+    string err;
+    const string text = R"({"id": "abc123", "url": "https://example.com/a", "count": 2})";
+    REQUIRE(schema.parse_into(text, err));
+    REQUIRE(id == "abc123");
+    REQUIRE(id.data() == text.data() + text.find("abc123"));
+    REQUIRE(url == "https://example.com/a");
+    REQUIRE(schema.dump() == R"({"count": 2, "id": "abc123", "url": "https://example.com/a"})");
+
+    // Escaped strings are decoded into the arena in scope, and need one
+    const string escaped = R"({"id": "a\"bé", "url": ""})";
+    REQUIRE(!schema.parse_into(escaped, err));
+    REQUIRE(err.find("SchemaArena") != string::npos);
+
+    SchemaArena arena;
+    {
+        SchemaArena::Scope scope(arena);
+        REQUIRE(schema.parse_into(escaped, err));
+    }
+    REQUIRE(id == "a\"b\xc3\xa9");
+    REQUIRE(arena.allocated() == id.size());
+    REQUIRE(url.empty());
+
+    // Through json11, views point into the Json
+    const Json json = Json::object { { "id", "xyz" } };
+    schema.from_json(json);
+    REQUIRE(id == "xyz");
+    REQUIRE(id.data() == json["id"].string_value().data());
+
+    // As members of a type
+    struct Link {
+        std::string_view href;
+        vector<std::string_view> rels;
+    };
+    const TypeSchema<Link> linkSchema {
+        { "href", &Link::href },
+        { "rels", &Link::rels },
+    };
+    Link link;
+    const string linkText = R"({"href": "/x", "rels": ["self", "next"]})";
+    REQUIRE(linkSchema.parse_into(linkText, link, err));
+    REQUIRE(link.href == "/x");
+    REQUIRE(link.rels == vector<std::string_view> { "self", "next" });
+
+    // A mapped file is released once parsed, so its strings are copied into the arena
+    const string path = "string-view-test.json";
+    {
+        std::ofstream file(path, std::ios::binary);
+        file << linkText;
+    }
+    err.clear();
+    REQUIRE(!linkSchema.from_file(path, link, err));
+    REQUIRE(err.find("SchemaArena") != string::npos);
+
+    SchemaArena fileArena;
+    {
+        SchemaArena::Scope scope(fileArena);
+        REQUIRE(linkSchema.from_file(path, link, err));
+    }
+    std::remove(path.c_str());
+    REQUIRE(link.href == "/x");
+    REQUIRE(link.rels == vector<std::string_view> { "self", "next" });
+    REQUIRE(fileArena.allocated() == 10);
+}
+
+TEST_CASE("schemas read and write MessagePack and CBOR")
+{
+    TopLevel topLevel;
+    topLevel.intProp = -300;
+    topLevel.boolProp = true;
+    topLevel.nestedProp.stringProp = string(40, 's');
+    topLevel.nestedProp.arrayProp = { "one", "two" };
+    const string json = TopLevelSchema(topLevel).dump();
+
+    for (BinaryFormat format : { MSGPACK, CBOR }) {
+        const string packed = TopLevelSchema(topLevel).pack(format);
+        REQUIRE(packed.size() < json.size());
+
+        TopLevel decoded;
+        string err;
+        REQUIRE(TopLevelSchema(decoded).unpack(format, packed, err));
+        REQUIRE(TopLevelSchema(decoded).dump() == json);
+
+        decoded = TopLevel();
+        REQUIRE(topLevelTypeSchema.pack(format, topLevel) == packed);
+        REQUIRE(topLevelTypeSchema.unpack(format, packed, decoded, err));
+        REQUIRE(topLevelTypeSchema.dump(decoded) == json);
+
+        // Truncated input
+        for (size_t length = 0; length < packed.size(); length++) {
+            err.clear();
+            REQUIRE(!topLevelTypeSchema.unpack(format, packed.data(), length, decoded, err));
+            REQUIRE(!err.empty());
+        }
+    }
+
+    // Shortest encodings, as other implementations write them
+    int i = 1;
+    float f = 0;
+    std::string_view s;
+    Json custom;
+    ValueConverter converter;
+    converter.from_json = [&custom](const Json &json) { custom = json; };
+    converter.to_json = [&custom](Json &json) { json = custom; };
+    Schema schema = Schema::object { { "i", i }, { "f", f }, { "s", s }, { "c", Schema(Schema::OBJECT, converter) } };
+
+    string err;
+    REQUIRE(Schema(Schema::object { { "i", i } }).pack(MSGPACK) == "\x81\xa1i\x01");
+    REQUIRE(Schema(Schema::object { { "i", i } }).pack(CBOR) == "\xa1\x61i\x01");
+    i = 300;
+    REQUIRE(Schema(i).pack(MSGPACK) == string("\xcd\x01\x2c", 3));
+    REQUIRE(Schema(i).pack(CBOR) == string("\x19\x01\x2c", 3));
+    i = -1;
+    REQUIRE(Schema(i).pack(MSGPACK) == "\xff");
+    REQUIRE(Schema(i).pack(CBOR) == "\x20");
+
+    // Tags, half floats, unknown keys and values of the wrong type, in CBOR
+    const string cbor = string("\xa5", 1)
+        + "\x61i" + "\xc1\x1a\x00\x01\x00\x00"s         // tag 1, 65536
+        + "\x61" "f" + "\xf9\x3c\x00"s                  // 1.0 as a half float
+        + "\x61s" + "\x65hello"
+        + "\x61x" + "\x82\x01\xa1\x61y\x80"             // unknown: [1, {"y": []}]
+        + "\x61" "c" + "\xa1\x61k\x83\x01\xf5\xf6";     // {"k": [1, true, null]}
+    REQUIRE(schema.unpack(CBOR, cbor, err));
+    REQUIRE(i == 65536);
+    REQUIRE(f == 1.0f);
+    REQUIRE(s == "hello");
+    REQUIRE(s.data() == cbor.data() + cbor.find("hello"));
+    REQUIRE(custom == Json(Json::object { { "k", Json::array { 1, true, nullptr } } }));
+    REQUIRE(schema.unpack(MSGPACK, schema.pack(MSGPACK), err));
+    REQUIRE(custom == Json(Json::object { { "k", Json::array { 1, true, nullptr } } }));
+
+    REQUIRE(schema.unpack(MSGPACK, "\x81\xa1i\xa1x", err));
+    REQUIRE(i == 0);
+
+    err.clear();
+    REQUIRE(!schema.unpack(CBOR, "\xbf\xff", err));
+    REQUIRE(err == "indefinite-length CBOR items are not supported");
+    err.clear();
+    REQUIRE(!schema.unpack(MSGPACK, string("\x80\x00", 2), err));
+    REQUIRE(err == "unexpected trailing bytes");
+
+    // MessagePack lengths are at most 32 bits; longer ones are reported, not truncated
+    Schema::array huge;
+    huge.size = [] { return size_t(0x100000000); };
+    huge.element_kind = ValueConverter::INT;
+    string out = "kept";
+    err.clear();
+    REQUIRE(!Schema(Schema::object { { "huge", huge } }).pack(MSGPACK, out, err));
+    REQUIRE(err.find("MessagePack") != string::npos);
+    REQUIRE(out == "kept");
+    REQUIRE(Schema(huge).pack(MSGPACK).empty());
+}
+
+struct Samples
+{
+    string name;
+    std::vector<double> values;
+    std::vector<int> counts;
+    std::vector<Nested> children;
+};
+
+static const TypeSchema<Samples> samplesTypeSchema {
+    { "name", &Samples::name },
+    { "values", &Samples::values },
+    { "counts", &Samples::counts },
+    { "children", &Samples::children, nestedTypeSchema }
+};
+
+TEST_CASE("schemas write and read binary snapshots")
+{
+    Samples samples;
+    samples.name = "samples";
+    for (int i = 0; i < 1000; i++) {
+        samples.values.push_back(i * 0.5);
+        samples.counts.push_back(-i);
+    }
+    samples.children.resize(2);
+    samples.children[1].stringProp = "child";
+    samples.children[1].arrayProp = { "a", "b" };
+
+    string snapshot;
+    samplesTypeSchema.write_snapshot(samples, snapshot);
+
+    Samples loaded;
+    loaded.counts = { 7 };
+    string err;
+    REQUIRE(samplesTypeSchema.read_snapshot(snapshot, loaded, err));
+    REQUIRE(samplesTypeSchema.dump(loaded) == samplesTypeSchema.dump(samples));
+
+    // Schema trees
+    TopLevel topLevel;
+    topLevel.intProp = 5;
+    topLevel.boolProp = true;
+    topLevel.nestedProp.stringProp = "str";
+    topLevel.nestedProp.arrayProp = { "one", "two" };
+    snapshot.clear();
+    TopLevelSchema(topLevel).write_snapshot(snapshot);
+
+    TopLevel decoded;
+    REQUIRE(TopLevelSchema(decoded).read_snapshot(snapshot, err));
+    REQUIRE(TopLevelSchema(decoded).dump() == TopLevelSchema(topLevel).dump());
+
+    // Strings bound to string_views point into the snapshot
+    std::string_view stringProp;
+    std::vector<string> arrayProp;
+    Schema views = Schema::object {
+        { "intProp", Schema(decoded.intProp) },
+        { "boolProp", Schema(decoded.boolProp) },
+        { "nestedProp", Schema::object {
+            { "stringProp", Schema(stringProp) },
+            { "arrayProp", ArraySchema<string>(arrayProp, &ArrayElementSchema) }
+        }}
+    };
+    REQUIRE(views.read_snapshot(snapshot, err));
+    REQUIRE(stringProp == "str");
+    REQUIRE(stringProp.data() >= snapshot.data());
+    REQUIRE(stringProp.data() < snapshot.data() + snapshot.size());
+
+    // Snapshots written under another schema, truncated, or padded are rejected
+    REQUIRE(!TopLevelSchema(decoded)["nestedProp"].read_snapshot(snapshot, err));
+    REQUIRE(err == "snapshot written under a different schema");
+    snapshot.clear();
+    topLevelTypeSchema.write_snapshot(topLevel, snapshot);
+    err.clear();
+    REQUIRE(!samplesTypeSchema.read_snapshot(snapshot, loaded, err));
+    REQUIRE(err == "snapshot written under a different schema");
+    for (size_t length = 0; length < snapshot.size(); length++) {
+        err.clear();
+        REQUIRE(!topLevelTypeSchema.read_snapshot(snapshot.data(), length, decoded, err));
+        REQUIRE(!err.empty());
+    }
+    err.clear();
+    REQUIRE(!topLevelTypeSchema.read_snapshot(snapshot + "x", decoded, err));
+    REQUIRE(!err.empty());
+
+    // From a mapped file
+    const string path = "snapshot-test.s11";
+    {
+        std::ofstream file(path, std::ios::binary);
+        file << snapshot;
+    }
+    decoded = TopLevel();
+    REQUIRE(topLevelTypeSchema.read_snapshot_file(path, decoded, err));
+    REQUIRE(topLevelTypeSchema.dump(decoded) == topLevelTypeSchema.dump(topLevel));
+
+    // The mapping is released on return, so string_views are copied into the arena
+    snapshot.clear();
+    TopLevelSchema(topLevel).write_snapshot(snapshot);
+    {
+        std::ofstream file(path, std::ios::binary);
+        file << snapshot;
+    }
+    err.clear();
+    REQUIRE(!views.read_snapshot_file(path, err));
+    REQUIRE(err.find("SchemaArena") != string::npos);
+
+    SchemaArena arena;
+    {
+        SchemaArena::Scope scope(arena);
+        REQUIRE(views.read_snapshot_file(path, err));
+    }
+    std::remove(path.c_str());
+    REQUIRE(stringProp == "str");
+}
+
+TEST_CASE("merge patches write only the fields they contain")
+{
+    TopLevel topLevel;
+    topLevel.intProp = 5;
+    topLevel.boolProp = true;
+    topLevel.nestedProp.stringProp = "str";
+    topLevel.nestedProp.arrayProp = { "one", "two" };
+    TopLevel typed = topLevel;
+
+    const Json patch = Json::object {
+        { "boolProp", nullptr },
+        { "nestedProp", Json::object { { "arrayProp", Json::array { "three" } } } },
+        { "noSuchProp", 1 }
+    };
+
+    DirtyMask dirty;
+    string err;
+    Schema schema = TopLevelSchema(topLevel);
+    REQUIRE(schema.merge_patch(patch, dirty, err));
+    topLevelTypeSchema.merge_patch(patch, typed);
+
+    for (const TopLevel &patched : { topLevel, typed }) {
+        REQUIRE(patched.intProp == 5);
+        REQUIRE(patched.boolProp == false);
+        REQUIRE(patched.nestedProp.stringProp == "str");
+        REQUIRE(patched.nestedProp.arrayProp == std::vector<string> { "three" });
+    }
+
+    // Fields in key order: boolProp, intProp, nestedProp
+    REQUIRE(dirty.size() == 3);
+    REQUIRE(dirty.test(0));
+    REQUIRE(!dirty.test(1));
+    REQUIRE(dirty.test(2));
+    REQUIRE(dirty.count() == 2);
+
+    // Bits accumulate until cleared
+    REQUIRE(schema.merge_patch(Json::object { { "intProp", 6 } }, dirty, err));
+    REQUIRE(topLevel.intProp == 6);
+    REQUIRE(dirty.count() == 3);
+    dirty.clear();
+    REQUIRE(!dirty.any());
+
+    // A patch that is not an object replaces the whole value
+    topLevelTypeSchema.merge_patch(Json(), typed, dirty);
+    REQUIRE(typed.intProp == 0);
+    REQUIRE(typed.nestedProp.stringProp.empty());
+    REQUIRE(dirty.count() == 3);
+    REQUIRE(schema.merge_patch(Json(), err));
+    REQUIRE(topLevel.intProp == 0);
+    REQUIRE(topLevel.nestedProp.arrayProp.empty());
+
+    // Arrays are replaced, never appended to, so their descriptor must be able to clear them
+    vector<int> ints { 1, 2 };
+    Schema::array intsDesc = ArraySchema(ints);
+    intsDesc.clear = nullptr;
+    Schema intsSchema = Schema::object { { "a", Schema(topLevel.intProp) }, { "ints", intsDesc } };
+    REQUIRE(!intsSchema.merge_patch(Json::object { { "ints", Json::array { 3 } } }, err));
+    REQUIRE(err == "merge patch cannot replace an array bound without a clear callback");
+    REQUIRE(ints == vector<int> { 1, 2 });
+
+    // Custom converters are patched through their JSON
+    Json custom = Json::object { { "a", 1 }, { "b", Json::object { { "c", 2 }, { "d", 3 } } } };
+    ValueConverter converter;
+    converter.from_json = [&custom](const Json &json) { custom = json; };
+    converter.to_json = [&custom](Json &json) { json = custom; };
+    REQUIRE(Schema(Schema::OBJECT, converter).merge_patch(Json::object {
+        { "a", nullptr }, { "b", Json::object { { "d", 4 } } }
+    }, err));
+    REQUIRE(custom == Json(Json::object { { "b", Json::object { { "c", 2 }, { "d", 4 } } } }));
+}
+
+TEST_CASE("delta encoding sends only the fields that changed")
+{
+    TopLevel topLevel;
+    topLevel.intProp = 5;
+    topLevel.nestedProp.stringProp = "str";
+    topLevel.nestedProp.arrayProp = { "one" };
+    Schema schema = TopLevelSchema(topLevel);
+
+    for (bool typed : { false, true }) {
+        DeltaBaseline baseline;
+        Json patch;
+        const auto delta = [&] {
+            return typed ? topLevelTypeSchema.to_json_delta(topLevel, baseline, patch)
+                         : schema.to_json_delta(baseline, patch);
+        };
+
+        // The first delta is the whole document
+        REQUIRE(delta());
+        Json json;
+        schema.to_json(json);
+        REQUIRE(patch == json);
+
+        REQUIRE(!delta());
+        REQUIRE(patch == Json(Json::object()));
+
+        topLevel.intProp++;
+        topLevel.nestedProp.arrayProp.push_back("two");
+        REQUIRE(delta());
+        REQUIRE(patch == Json(Json::object {
+            { "intProp", topLevel.intProp },
+            { "nestedProp", Json::object { { "arrayProp", Json::array { "one", "two" } } } }
+        }));
+
+        // Applying each delta keeps a copy in sync
+        TopLevel copy;
+        baseline.clear();
+        REQUIRE(delta());
+        topLevelTypeSchema.merge_patch(patch, copy);
+        topLevel.nestedProp.stringProp += " changed";
+        REQUIRE(delta());
+        topLevelTypeSchema.merge_patch(patch, copy);
+        REQUIRE(topLevelTypeSchema.dump(copy) == topLevelTypeSchema.dump(topLevel));
+        topLevel.nestedProp.arrayProp.pop_back();
+    }
+
+    // From a dirty mask instead of a baseline
+    DirtyMask dirty;
+    TopLevel copy;
+    topLevelTypeSchema.merge_patch(Json::object { { "boolProp", true } }, copy, dirty);
+    Json patch;
+    topLevelTypeSchema.to_json_delta(copy, dirty, patch);
+    REQUIRE(patch == Json(Json::object { { "boolProp", true } }));
+    TopLevelSchema(copy).to_json_delta(dirty, patch);
+    REQUIRE(patch == Json(Json::object { { "boolProp", true } }));
+
+    // Objects behind custom converters are diffed, with removed members sent as nulls
+    Json custom = Json::object { { "a", 1 }, { "b", Json::object { { "c", 2 }, { "d", 3 } } } };
+    ValueConverter converter;
+    converter.from_json = [&custom](const Json &json) { custom = json; };
+    converter.to_json = [&custom](Json &json) { json = custom; };
+    Schema customSchema = Schema::object { { "custom", Schema(Schema::OBJECT, converter) } };
+    DeltaBaseline baseline;
+    REQUIRE(customSchema.to_json_delta(baseline, patch));
+    custom = Json::object { { "b", Json::object { { "c", 2 }, { "d", 4 } } } };
+    REQUIRE(customSchema.to_json_delta(baseline, patch));
+    REQUIRE(patch == Json(Json::object { { "custom", Json::object {
+        { "a", nullptr }, { "b", Json::object { { "d", 4 } } }
+    } } }));
+    REQUIRE(!customSchema.to_json_delta(baseline, patch));
+
+    // Values that encode as null would delete their field, so they are held back
+    double number = 1;
+    Schema numberSchema = Schema::object { { "nothing", Schema(nullptr) }, { "number", Schema(number) } };
+    baseline.clear();
+    REQUIRE(numberSchema.to_json_delta(baseline, patch));
+    REQUIRE(patch == Json(Json::object { { "number", 1 } }));
+    number = std::nan("");
+    REQUIRE(!numberSchema.to_json_delta(baseline, patch));
+    REQUIRE(patch == Json(Json::object()));
+    number = 2;
+    REQUIRE(numberSchema.to_json_delta(baseline, patch));
+    REQUIRE(patch == Json(Json::object { { "number", 2 } }));
+
+    number = std::nan("");
+    dirty.set_all(2);
+    numberSchema.to_json_delta(dirty, patch);
+    REQUIRE(patch == Json(Json::object()));
+
+    string err;
+    TopLevel typed;
+    Schema bound = topLevelTypeSchema.bind(typed);
+    DirtyMask typedDirty;
+    REQUIRE(bound.merge_patch(Json::object { { "intProp", 3 } }, typedDirty, err));
+    REQUIRE(typed.intProp == 3);
+    bound.to_json_delta(typedDirty, patch);
+    REQUIRE(patch == Json(Json::object { { "intProp", 3 } }));
+}
@@ -16,6 +16,7 @@ using namespace std;
 class ImageLayer
 {
     friend Schema BindImageLayerSchema(ImageLayer &imageLayer);
+    friend const TypeSchema<ImageLayer> &ImageLayerTypeSchema();
 private:
     
     string _Type;
@@ -32,6 +33,7 @@ public:
 class Idea
 {
     friend Schema BindIdeaSchema(Idea &idea);
+    friend const TypeSchema<Idea> &IdeaTypeSchema();
     
 private:
     std::string _Id;
@@ -72,17 +74,47 @@ Schema BindIdeaSchema(Idea &idea)
     };
 }
 
+//
+// Type Schemas
+//
+
+const TypeSchema<ImageLayer> &ImageLayerTypeSchema()
+{
+    static const TypeSchema<ImageLayer> schema {
+        { "type", &ImageLayer::_Type },
+        { "blobId", &ImageLayer::_BlobId },
+        { "url", &ImageLayer::_Url }
+    };
+    return schema;
+}
+
+const TypeSchema<Idea> &IdeaTypeSchema()
+{
+    static const TypeSchema<Idea> schema {
+        { "id", &Idea::_Id },
+        { "numLikes", &Idea::_NumLikes },
+        { "isRemix", &Idea::_IsRemix },
+        { "imageLayers", &Idea::_ImageLayers, ImageLayerTypeSchema() }
+    };
+    return schema;
+}
+
 //
 // Test Cases
 //
 
-Json LoadJson()
+string LoadJsonText()
 {
     ifstream ifs("6011983.json");
     string jsonStr;
     getline(ifs, jsonStr, (char)ifs.eof());
+    return jsonStr;
+}
+
+Json LoadJson()
+{
     string err;
-    return Json::parse(jsonStr, err);
+    return Json::parse(LoadJsonText(), err);
 }
 
 TEST_CASE("can parse idea")
@@ -104,4 +136,65 @@ TEST_CASE("can parse idea")
     REQUIRE(idea.ImageLayers()[0].BlobId() == "zPFnPEd8GFVwXAEPik0L7GAH_v36wFPo6Hs9fqzRlE4ivt7m");
     REQUIRE(idea.ImageLayers()[1].Type() == "sketch");
     REQUIRE(idea.ImageLayers()[1].BlobId() == "Klt9l_TfMYdvjuxGYwptSAus8F8JgUtd6sIYUqT3Th0ksJsU");
-}
\ No newline at end of file
+}
+
+TEST_CASE("can parse idea directly from text")
+{
+    // Skip the json11 tree entirely and parse the text straight into the Idea
+    auto jsonStr = LoadJsonText();
+    REQUIRE(!jsonStr.empty());
+
+    Idea idea;
+    string err;
+    REQUIRE(BindIdeaSchema(idea).parse_into(jsonStr, err));
+    REQUIRE(err.empty());
+
+    REQUIRE(idea.Id() == "6011983");
+    REQUIRE(idea.NumLikes() == 6);
+    REQUIRE(idea.IsRemix());
+    REQUIRE(idea.ImageLayers().size() == 2);
+    REQUIRE(idea.ImageLayers()[0].Type() == "photo");
+    REQUIRE(idea.ImageLayers()[0].BlobId() == "zPFnPEd8GFVwXAEPik0L7GAH_v36wFPo6Hs9fqzRlE4ivt7m");
+    REQUIRE(idea.ImageLayers()[1].Type() == "sketch");
+    REQUIRE(idea.ImageLayers()[1].BlobId() == "Klt9l_TfMYdvjuxGYwptSAus8F8JgUtd6sIYUqT3Th0ksJsU");
+}
+
+TEST_CASE("can parse ideas with a type schema")
+{
+    auto json = LoadJson();
+    auto jsonStr = LoadJsonText();
+
+    // The same type schema decodes into any number of Ideas
+    Idea fromJson, fromText;
+    IdeaTypeSchema().from_json(json, fromJson);
+    string err;
+    REQUIRE(IdeaTypeSchema().parse_into(jsonStr, fromText, err));
+
+    for (const auto &idea : { fromJson, fromText }) {
+        REQUIRE(idea.Id() == "6011983");
+        REQUIRE(idea.NumLikes() == 6);
+        REQUIRE(idea.IsRemix());
+        REQUIRE(idea.ImageLayers().size() == 2);
+        REQUIRE(idea.ImageLayers()[0].Type() == "photo");
+        REQUIRE(idea.ImageLayers()[1].BlobId() == "Klt9l_TfMYdvjuxGYwptSAus8F8JgUtd6sIYUqT3Th0ksJsU");
+    }
+}
+
+TEST_CASE("can parse ideas straight from a mapped file")
+{
+    Idea idea, typed;
+    string err;
+    REQUIRE(BindIdeaSchema(idea).from_file("6011983.json", err));
+    REQUIRE(IdeaTypeSchema().from_file("6011983.json", typed, err));
+    REQUIRE(err.empty());
+
+    for (const auto &parsed : { idea, typed }) {
+        REQUIRE(parsed.Id() == "6011983");
+        REQUIRE(parsed.NumLikes() == 6);
+        REQUIRE(parsed.ImageLayers().size() == 2);
+        REQUIRE(parsed.ImageLayers()[1].Type() == "sketch");
+    }
+
+    REQUIRE(!IdeaTypeSchema().from_file("does-not-exist.json", typed, err));
+    REQUIRE(err.find("does-not-exist.json") != string::npos);
+}